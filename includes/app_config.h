@@ -11,7 +11,6 @@
 #define BLE_BAS_ENABLED 1
 #define BLE_DIS_ENABLED 1
 #define BLE_QWR_ENABLED 1
-#define BLE_ADVERTISING_ENABLED 1
 #define NRF_BLE_GATT_ENABLED 1
 #define NRF_BLE_QWR_ENABLED 1
 #define NRF_PWR_MGMT_ENABLED 1
@@ -21,17 +20,31 @@
 #define NRF_SDH_BLE_ENABLED 1
 #define NRF_SECTION_ITER_ENABLED 1
 #define NRF_BLE_CONN_PARAMS_ENABLED 1
+// NUS client (central role, AT+CONN,NS)
+#define BLE_NUS_C_ENABLED 1
+#define BLE_DB_DISCOVERY_ENABLED 1
+#define NRF_BLE_GQ_ENABLED 1
+#define NRF_QUEUE_ENABLED 1
+// L2CAP CoC transport (l2cap_comm.c) next to the NUS
+#define COMM_L2CAP_ENABLED 1
+#define COMM_L2CAP_PSM 0x0081
+// gatt queue only carries discovery and the CCCD write (passthru data goes direct to the softdevice)
+#define NRF_BLE_GQ_DATAPOOL_ELEMENT_SIZE 20
+#define NRF_BLE_GQ_DATAPOOL_ELEMENT_COUNT 8
+#define NRF_BLE_GQ_GATTC_WRITE_MAX_DATA_LEN 16
+#define NRF_BLE_GQ_GATTS_HVX_MAX_DATA_LEN 16
 
 // BLE stackj config
 // <i> Requested BLE GAP data length to be negotiated.
 #define NRF_SDH_BLE_GAP_DATA_LENGTH 251
 // <o> NRF_SDH_BLE_PERIPHERAL_LINK_COUNT - Maximum number of peripheral links. 
-#define NRF_SDH_BLE_PERIPHERAL_LINK_COUNT 1
+// Several remotes can use the NUS at once (each has its own link context in comm_ble). Softdevice RAM grows with each link (see linker script)
+#define NRF_SDH_BLE_PERIPHERAL_LINK_COUNT 3
 // <o> NRF_SDH_BLE_CENTRAL_LINK_COUNT - Maximum number of central links. 
 #define NRF_SDH_BLE_CENTRAL_LINK_COUNT 1
 // <o> NRF_SDH_BLE_TOTAL_LINK_COUNT - Total link count. 
 // <i> Maximum number of total concurrent connections using the default configuration.
-#define NRF_SDH_BLE_TOTAL_LINK_COUNT 2
+#define NRF_SDH_BLE_TOTAL_LINK_COUNT 4
 // <o> NRF_SDH_BLE_GAP_EVENT_LENGTH - GAP event length. 
 #define NRF_SDH_BLE_GAP_EVENT_LENGTH 6
 // <o> NRF_SDH_BLE_GATT_MAX_MTU_SIZE - Static maximum MTU size. 
@@ -53,6 +66,8 @@
 #define UART_EASY_DMA_SUPPORT  1
 #define UART0_CONFIG_USE_EASY_DMA 1
 #define UART_LEGACY_SUPPORT 0
+// battery (VDD) measurement in bsp_minew_nrf52.c
+#define SAADC_ENABLED 1
 #define APP_UART_DRIVER_INSTANCE 0
 /*
 wutils
@@ -25,10 +25,21 @@ extern "C" {
 void at_process_input(char* data, UART_TX_FN_T source_txfn);
 // process at cmd locally only
 void at_process_line(char* line, UART_TX_FN_T utx_fn);
-// Has remote been authenticated?
-bool authenticated();
-bool clear_authentication();
-bool set_authentication();      // Session can be authenticated by at command but also by BLE bonding
+// send queued response output : call from main loop
+void at_process_pump();
+// false while the response output is backed up : comm modules keep their input lines until it isn't
+bool at_process_outReady();
+// a tx fn's link has gone : drop its queued output and free its slot
+void at_process_outGone(UART_TX_FN_T dev);
+// In raw passthru mode (AT+RAW) the comm modules give their data as it comes to at_process_rawInput() rather than as lines
+// Per source : others keep on with line processing. NULL asks if any raw session is running
+bool at_process_isRaw(UART_TX_FN_T source_txfn);
+// returns number of bytes not taken by the other side, which should be offered again
+int at_process_rawInput(uint8_t* data, int len, UART_TX_FN_T source_txfn);
+// Has remote been authenticated? This is per source (odev is its tx fn), as each BLE link logs in for itself
+bool authenticated(void* odev);
+bool clear_authentication(void* odev);      // NULL for all
+bool set_authentication(void* odev);        // Session can be authenticated by at command but also by BLE bonding
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,41 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_BENCH_H
+#define H_BENCH_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Throughput benchmark (AT+BENCH). The result line is given to printf/odev when the run ends.
+// Send nbytes of pattern data to dest (eg comm_uart_tx, comm_ble_tx or a single link)
+bool bench_tx_start(UART_TX_FN_T dest, uint32_t nbytes, PRINTF_FN_T printf, void* odev);
+// Check nbytes of pattern data sent by source. Its input comes via at_process_rawInput() while the sink runs
+bool bench_rx_start(UART_TX_FN_T source, uint32_t nbytes, PRINTF_FN_T printf, void* odev);
+void bench_stop(void);
+// Is the sink running for this source (NULL for any source)?
+bool bench_isSink(UART_TX_FN_T source);
+// Sink input, returns number of bytes not taken (always 0)
+int bench_sinkInput(uint8_t* data, int len);
+// Move a run on : call from main loop
+void bench_process(void);
+// Last (or current) run
+void bench_print_stats(PRINTF_FN_T printf, void* odev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BENCH_H */
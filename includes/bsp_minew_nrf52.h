@@ -50,6 +50,14 @@ bool hal_bsp_nvmWrite8(uint16_t off, uint8_t v);
 bool hal_bsp_nvmWrite16(uint16_t off, uint16_t v);
 bool hal_bsp_nvmWrite(uint16_t off, uint8_t len, uint8_t* buf);
 uint16_t hal_bsp_nvmSize();
+// Non-blocking write of a block to offset 0 (ie erase page then write). The data is copied so caller can change it straight away.
+// The erase/write steps are issued from hal_bsp_nvmProcess() (call from main loop) as the flash SOC events come in via hal_bsp_nvmFlashEvent().
+// done_fn is called (from hal_bsp_nvmProcess()) at the end. Returns false if a write is already in progress.
+typedef void (*NVM_WRITE_DONE_FN_T)(bool ok);
+bool hal_bsp_nvmWriteAsync(uint8_t len, uint8_t* buf, NVM_WRITE_DONE_FN_T done_fn);
+bool hal_bsp_nvmIsWriting();
+void hal_bsp_nvmProcess();
+void hal_bsp_nvmFlashEvent(bool ok);
 // Uart init
 bool hal_bsp_uart_init(int uartNb, int baudrate_selector, app_uart_event_handler_t uart_event_handler);
 void hal_bsp_uart_deinit(int uartNb);
@@ -65,6 +73,7 @@ void hal_bsp_buttons_deinit(void);
 void hal_bsp_adc_init(void);
 void hal_bsp_adc_disable(void);
 uint16_t hal_bsp_adc_read_u16(void);
+uint16_t hal_bsp_adc_read_vdd_mv(void);
 #ifdef __cplusplus
 }
 #endif
@@ -19,15 +19,45 @@
 extern "C" {
 #endif
 
+// Result of a central connection : tx fn of the new link, or NULL if it failed
+typedef void (*COMM_BLE_CONN_FN_T)(UART_TX_FN_T link_txfn);
+
 uint32_t comm_ble_init(void);
+// Connect to a remote NUS server (AT+CONN,NS). Result is given to done from the main loop
+bool comm_ble_central_connect(const uint8_t* addr, bool publicAddr, COMM_BLE_CONN_FN_T done);
 void comm_ble_getuuid(ble_uuid_t* p_uuid);
 void comm_ble_local_disconnected(void);
 void comm_ble_remote_connected(uint16_t conn_handle);
 void comm_ble_remote_disconnected(uint16_t conn_handle);
-void comm_ble_set_max_data_len(uint16_t ml);
+void comm_ble_set_max_data_len(uint16_t conn_handle, uint16_t ml);
+// Several remotes can be connected at once, each link has its own tx fn given to the at processor with the data it received
 bool comm_ble_isConnected();
-// Tx line. returns number of bytes not sent due to flow control. 
+int comm_ble_nbLinks();
+bool comm_ble_isLink(UART_TX_FN_T txfn);
+// For the benchmark : conn interval (1.25ms units) of a link (first peripheral link for comm_ble_tx), and notifications sent
+uint16_t comm_ble_connInterval(UART_TX_FN_T txfn);
+uint32_t comm_ble_nbNotifs(void);
+// NUS rx bytes dropped as the main loop didn't keep up (for the telemetry advert)
+uint32_t comm_ble_nbRxLost(void);
+// Other traffic on a connection (L2CAP), for the conn params manager
+void comm_ble_linkTraffic(uint16_t conn_handle, uint32_t bytes);
+// Links can ask for scan output, which is sent to them all by comm_ble_scan_tx(). Returns nb links subscribed, or -1 if txfn is not a link
+int comm_ble_scanSubscribe(UART_TX_FN_T txfn, bool on);
+int comm_ble_scan_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready);
+// Links go to the idle conn params profile when there is no traffic, and back to normal (or fast if set here, for passthru) when it resumes
+void comm_ble_setThroughput(bool throughput);
+// Conn params negotiation failed on a link : returns true if it was for the idle or fast profile (link goes back to normal and stays up)
+bool comm_ble_cpRefused(uint16_t conn_handle);
+// Process received data : call from main loop
+void comm_ble_processRX();
+// Tx line to all connected links. returns number of bytes not sent due to flow control (none of the links got those)
 int comm_ble_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready);
+// Passthru from the uart to the links (AT+CONN,NC) : only the links connected at the start (other than the requester) are in it
+int comm_ble_session_start(UART_TX_FN_T requester);
+void comm_ble_session_end(void);
+bool comm_ble_inSession(UART_TX_FN_T txfn);
+// Tx to the links in the passthru, same return as comm_ble_tx(). data NULL disconnects those links
+int comm_ble_session_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready);
 void comm_ble_print_stats(PRINTF_FN_T printf, void* odev);
 
 #ifdef __cplusplus
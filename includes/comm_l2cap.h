@@ -0,0 +1,37 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_COMM_L2CAP_H
+#define H_COMM_L2CAP_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// L2CAP connection oriented channel transport (COMM_L2CAP_ENABLED in app_config.h). A connected remote can open a channel
+// on COMM_L2CAP_PSM and use it like the NUS : AT commands, passthru and raw mode, with bigger SDUs and credit flow control.
+// Set the softdevice L2CAP config for our connections : call before nrf_sdh_ble_enable()
+uint32_t comm_l2cap_cfg_set(uint8_t conn_cfg_tag, uint32_t ram_start);
+bool comm_l2cap_isConnected(void);
+// Process received data : call from main loop
+void comm_l2cap_processRX(void);
+// Tx on the channel. returns number of bytes not sent due to flow control, or -1 if no channel. data NULL releases the channel
+int comm_l2cap_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready);
+void comm_l2cap_print_stats(PRINTF_FN_T printf, void* odev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_COMM_L2CAP_H */
@@ -25,6 +25,7 @@ void comm_uart_deinit(void);
 int comm_uart_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready);
 // Call this from main loop to check and process any pending rx data
 void comm_uart_processRX();
+uint32_t comm_uart_nbErrors(void);
 void comm_uart_print_stats(PRINTF_FN_T printf, void* odev);
 #ifdef __cplusplus
 }
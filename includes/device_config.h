@@ -10,6 +10,13 @@
 
 void cfg_init();
 void cfg_writeCheck();
+// Is there config waiting to be written or being written to flash?
+bool cfg_isWritePending();
+// Changes on every config change
+uint32_t cfg_getGeneration();
+// Callback when config is safely in flash (ok=true) or the write failed, and there is no more write pending
+typedef void (*CFG_WRITE_DONE_FN_T)(bool ok);
+void cfg_setWriteDoneCB(CFG_WRITE_DONE_FN_T fn);
 
 void cfg_setUUID(uint8_t* value);
 uint8_t* cfg_getUUID( void );
@@ -33,6 +40,40 @@ bool cfg_checkPassword( char* given );
 bool cfg_setPassword(char* oldp, char* newp);
 void cfg_setExtra_Value(uint8_t extra);
 uint8_t cfg_getExtra_Value();
+void cfg_setBleCoalesceMs(uint16_t value);
+uint16_t cfg_getBleCoalesceMs();
+// Advertising slots (see the advtype_t in main.c for which is which)
+#define CFG_ADV_SLOTS       (7)
+void cfg_setAdvSlotMs(uint16_t value);
+uint16_t cfg_getAdvSlotMs();
+void cfg_setAdvSlot(uint8_t slot, uint16_t intervalMs, uint8_t weight);
+uint16_t cfg_getAdvSlotInterval(uint8_t slot);
+uint8_t cfg_getAdvSlotWeight(uint8_t slot);
+void cfg_setSummaryRefreshS(uint16_t value);
+uint16_t cfg_getSummaryRefreshS();
+void cfg_setRelayFilter(uint32_t filter, uint32_t mask);
+uint32_t cfg_getRelayFilter();
+uint32_t cfg_getRelayMask();
+void cfg_setRelayMaxIds(uint8_t value);
+uint8_t cfg_getRelayMaxIds();
+void cfg_setRelayRateMs(uint16_t value);
+uint16_t cfg_getRelayRateMs();
+void cfg_setBattPeriodS(uint16_t value);
+uint16_t cfg_getBattPeriodS();
+void cfg_countReset();
+void cfg_setResetCount(uint16_t value);
+uint16_t cfg_getResetCount();
+// Adaptive advertising policy (see main.c)
+void cfg_setAdvPolicyOn(bool value);
+bool cfg_isAdvPolicyOn();
+void cfg_setAdvPolicyBattLowMv(uint16_t value);
+uint16_t cfg_getAdvPolicyBattLowMv();
+void cfg_setAdvPolicyBattCritMv(uint16_t value);
+uint16_t cfg_getAdvPolicyBattCritMv();
+void cfg_setAdvPolicyBoostS(uint8_t value);
+uint8_t cfg_getAdvPolicyBoostS();
+void cfg_setAdvPolicyIdleMin(uint16_t value);
+uint16_t cfg_getAdvPolicyIdleMin();
 
 int cfg_getFWMajor();
 int cfg_getFWMinor();
@@ -43,6 +84,8 @@ typedef void (*PK_CB_T)(void* odev, uint16_t k, uint8_t* d, int l);
 int cfg_getByKey(uint16_t key, uint8_t* vp, int maxlen);
 int cfg_setByKey(uint16_t key, uint8_t* vp, int len);
 int cfg_iterateKeys(void* odev, PK_CB_T pkcb);
+// i'th key of the list cfg_iterateKeys() goes through, DCFG_KEY_ILLEGAL past the end
+uint16_t cfg_getKeyAt(int i);
 
 
 /* generic key ids */
@@ -57,6 +100,24 @@ int cfg_iterateKeys(void* odev, PK_CB_T pkcb);
 #define DCFG_KEY_PASS       (DCFG_KEY_BASE + 0x07)
 #define DCFG_KEY_CONNECTABLE (DCFG_KEY_BASE + 0x08)
 #define DCFG_KEY_IBEACONNING (DCFG_KEY_BASE + 0x09)
+#define DCFG_KEY_BLE_COALESCE (DCFG_KEY_BASE + 0x0A)
+#define DCFG_KEY_ADV_SLOT_MS (DCFG_KEY_BASE + 0x0B)
+#define DCFG_KEY_BATT_PERIOD (DCFG_KEY_BASE + 0x0C)
+#define DCFG_KEY_RESET_COUNT (DCFG_KEY_BASE + 0x0D)
+#define DCFG_KEY_SUMMARY_REFRESH (DCFG_KEY_BASE + 0x0E)
+// one per advertising slot (0x0110-0x0116), value 0x00WWIIII : WW=weight, IIII=interval ms
+#define DCFG_KEY_ADV_SLOT_0 (DCFG_KEY_BASE + 0x10)
+// adaptive advertising policy
+#define DCFG_KEY_POL_ON     (DCFG_KEY_BASE + 0x18)
+#define DCFG_KEY_POL_BATT_LOW (DCFG_KEY_BASE + 0x19)
+#define DCFG_KEY_POL_BATT_CRIT (DCFG_KEY_BASE + 0x1A)
+#define DCFG_KEY_POL_BOOST  (DCFG_KEY_BASE + 0x1B)
+#define DCFG_KEY_POL_IDLE   (DCFG_KEY_BASE + 0x1C)
+// beacon relay
+#define DCFG_KEY_RELAY_FILTER (DCFG_KEY_BASE + 0x20)
+#define DCFG_KEY_RELAY_MASK (DCFG_KEY_BASE + 0x21)
+#define DCFG_KEY_RELAY_MAX_IDS (DCFG_KEY_BASE + 0x22)
+#define DCFG_KEY_RELAY_RATE (DCFG_KEY_BASE + 0x23)
 
 /* Card types */
 #define CARD_TYPE_WFILLE_REV_CD (4)
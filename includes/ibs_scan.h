@@ -13,6 +13,7 @@ typedef struct {
 	uint16_t major;
 	uint16_t minor;
 	uint8_t rssi;
+	bool recent;			// seen since it was last taken by ibs_scan_takeRecent()
 } ibs_scan_result_t;
 
 
@@ -23,4 +24,7 @@ bool ibs_scan_stop(void);
 void ibs_scan_set_uuid_filter(uint8_t* uuid);
 void ibs_handle_advert(const ble_gap_evt_adv_report_t *p_adv_report);
 int ibs_scan_getTableSize();
+bool ibs_scan_get(int i, ibs_scan_result_t* out);
+// Copy out up to max beacons seen since the last call (for the scan summary advert), returns how many
+int ibs_scan_takeRecent(ibs_scan_result_t* out, int max);
 #endif
@@ -11,6 +11,9 @@
 #define UUID16_SIZE             2                               /**< Size of 16 bit UUID */
 #define UUID32_SIZE             4                               /**< Size of 32 bit UUID */
 #define UUID128_SIZE            16                              /**< Size of 128 bit UUID */
+#define APP_BLE_CONN_CFG_TAG    1                               /**< A tag identifying the SoftDevice BLE configuration (for adverts and central connects) */
+// app_timer_cnt_get() rate (RTC is prescaled), for converting tick counts to time. Needs app_timer.h where used.
+#define APP_TIMER_TICKS_PER_SEC (APP_TIMER_CLOCK_FREQ/(APP_TIMER_CONFIG_RTC_FREQUENCY+1))
 
 // Callback when output sink can take tx again (if flow controlled)
 typedef int (*UART_TX_READY_FN_T)(void* txfn);
@@ -18,13 +21,30 @@ typedef int (*UART_TX_READY_FN_T)(void* txfn);
 typedef int (*UART_TX_FN_T)(uint8_t* output, int len, UART_TX_READY_FN_T txready);
 // A printf type fn that takes the uart tx fn to print to.
 typedef bool (*PRINTF_FN_T)(void* dev, const char* l, ...);
+// Connection parameter profiles of a link : idle (long interval + slave latency), normal, and throughput (passthru)
+typedef enum { APP_CONN_PROFILE_IDLE=0, APP_CONN_PROFILE_NORMAL, APP_CONN_PROFILE_FAST } APP_CONN_PROFILE_t;
 
 /******************************GLOBAL FUNCTIONS********************************/
 
 void app_reset_request();
+void app_setConnProfile(bool throughput);
+bool app_setLinkProfile(uint16_t conn_handle, APP_CONN_PROFILE_t profile);
 void app_setFlashBusy();
 void app_setFlashIdle();
 bool app_isFlashBusy();
+bool app_isRadioWindow();
+void app_setRadioNotify(bool on);
+// A:<advert rotations>,<encodes>,<average set up time per rotation in us>,<set restarts>,<in place updates> then AS:<ticks given to each advert slot>
+void app_print_adv_stats(PRINTF_FN_T printf, void* odev);
+// Last battery measurement (no ADC access)
+uint16_t app_getBatteryMv();
+uint8_t app_getBatteryPercent();
+// B:<mV>,<%>,<readings>
+void app_print_batt_stats(PRINTF_FN_T printf, void* odev);
+// RAM:<app RAM start in the linker script>,<lowest start the softdevice accepts for our BLE config> (to check the linker script ORIGIN)
+void app_print_ram_stats(PRINTF_FN_T printf, void* odev);
+// Advert on air with its effective interval and tx power, after the adaptive policy (AT+ADV?)
+void app_print_adv_policy(PRINTF_FN_T printf, void* odev);
 
 bool ibb_isBeaconning();
 void ibb_start();
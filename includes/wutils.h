@@ -124,6 +124,10 @@ uint8_t Util_hexdigit( char hex );
 uint8_t Util_hexbyte( const char* hex );
 /** convert a hex string to a byte array to avoid sscanf. Ensure 'out' is at least of size 'len'. Returns number of bytes successfully found */
 int Util_scanhex(char* in, int len, uint8_t* out);
+/** parse a hex value of 1 to maxdigits digits (no 0x prefix) into out. Whole string must be hex digits. Returns true if ok */
+bool Util_parsehex(const char* in, int maxdigits, uint32_t* out);
+/** parse a signed decimal value into out. Whole string must be consumed. Returns true if ok */
+bool Util_parsedec(const char* in, int32_t* out);
 
 #ifdef __cplusplus
 }
@@ -18,6 +18,7 @@
 #include "app_uart.h"
 #include "ibs_scan.h"
 #include "nrf_delay.h"
+#include "app_timer.h"
 //#include "softdevice_handler.h"
 
 #include "wutils.h"
@@ -27,47 +28,81 @@
 #include "at_process.h"
 #include "comm_uart.h"
 #include "comm_ble.h"
+#include "comm_l2cap.h"
+#include "bench.h"
 
 #include "nrf_drv_gpiote.h"
 
 #define MAX_TXSZ (100)
 #define MAX_ARGS (8)
+#define MAX_PENDING (4)
+#define OUT_RING_SZ (1024)          // MUST BE POWER OF 2
+#define MAX_OUTDEVS (8)             // uart + the BLE links + the L2CAP channel + the BLE fanouts (slots are freed as they go)
+#define OUT_DEV_DONE (0xFF)         // dev index of an output record that has been sent
+#define MAX_AUTHDEVS (MAX_OUTDEVS)
+#define OUT_ACCEPT_MIN (OUT_RING_SZ/2)  // free ring space needed before another input line is taken (room for its response)
+#define OUT_GEN_ROOM (256)          // free ring space needed to generate the next item of a long listing
+#define MAX_PIPE_LINE (256)         // a ';' line is copied here in case it has to wait for a listing in it to drain
+#define RAW_GUARD_MS (1000)         // silence required before and after "+++" to exit raw mode
 
 // per at command we have a definiton:
-typedef enum { ATCMD_OK, ATCMD_GENERR, ATCMD_BADARG, ATCMD_PROCESSED } ATRESULT;
-typedef ATRESULT (*ATCMD_CBFN_t)(uint8_t nargs, char* argv[], void* odev);
+// ATCMD_PENDING : handler started something slow (eg flash write) and got a token with at_pending_new(). "+PENDING <token>" is sent now,
+// and "+OK <token>" or "+ERROR <token>" when it completes. Other commands can be run meanwhile.
+typedef enum { ATCMD_OK, ATCMD_GENERR, ATCMD_BADARG, ATCMD_PROCESSED, ATCMD_PENDING } ATRESULT;
+// What a pending command is waiting for
+typedef enum { ATPEND_NONE=0, ATPEND_CFGWRITE, ATPEND_NUSCONN } ATPEND_t;
+// Typed value of an argument, as parsed by the dispatcher using the command's argument schema
+typedef struct {
+    bool present;       // false if an optional arg was empty or not given
+    int32_t v;          // value for hex16, hex8 and dec args
+    uint8_t* uuid;      // value for uuid128 args (16 bytes)
+    char* s;            // raw text of the arg
+} ATARG_t;
+typedef ATRESULT (*ATCMD_CBFN_t)(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+// Output item i (one or a few lines) of a long listing. Returns false when there are no more
+typedef bool (*AT_GEN_FN_T)(void* odev, int i);
+// Argument schema is a string with 1 char per arg giving its type, optionally followed by '?' if it can be empty/missing:
+//  x = hex16 (1-4 hex digits), b = hex8 (1-2 hex digits), d = signed decimal, u = uuid128 (32 hex digits), s = any string
+// eg "xs" = mandatory hex16 then a string, "u?d?" = optional uuid then optional decimal
+// A NULL schema means the args are not checked (commands that take none)
 typedef struct {
     const char* cmd;
     const char* desc;
     ATCMD_CBFN_t fn;
+    const char* args;
 } ATCMD_DEF_t;
 
 // Write output to console on given device
 static bool wconsole_println(void* udev, const char* l, ...);
 
 // predec at command handlers
-static ATRESULT atcmd_hello(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_who(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_type(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_reset(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_listcmds(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_info(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_getcfg(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_setcfg(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_checkconnect(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_connect(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_disconnect(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_password(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_start_scan(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_stop_scan(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_start_ib(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_stop_ib(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_enable_conn(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_disable_conn(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_push(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_out(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_in(uint8_t nargs, char* argv[], void* odev);
-static ATRESULT atcmd_debug_stats(uint8_t nargs, char* argv[], void* odev);
+static ATRESULT atcmd_hello(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_who(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_type(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_reset(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_listcmds(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_info(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_getcfg(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_setcfg(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_checkconnect(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_connect(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_disconnect(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_password(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_start_scan(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_stop_scan(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_start_ib(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_stop_ib(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_enable_conn(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_disable_conn(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_push(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_out(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_in(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_debug_stats(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_pipe(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_raw(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_bench(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_bench_stats(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
+static ATRESULT atcmd_adv_policy(uint8_t nargs, char* argv[], ATARG_t* args, void* odev);
 
 static ATCMD_DEF_t ATCMDS[] = {
     { .cmd="AT", .desc="Wakeup", .fn=atcmd_hello},
@@ -76,25 +111,32 @@ static ATCMD_DEF_t ATCMDS[] = {
     { .cmd="AT+HELP", .desc="List commands", .fn=atcmd_listcmds},
     { .cmd="ATZ", .desc="Reset card", .fn=atcmd_reset},
     { .cmd="AT+INFO", .desc="Show info", .fn=atcmd_info},
-    { .cmd="AT+GETCFG", .desc="Show config", .fn=atcmd_getcfg},     
-    { .cmd="AT+SETCFG", .desc="Set config", .fn=atcmd_setcfg},
+    { .cmd="AT+GETCFG", .desc="Show config", .fn=atcmd_getcfg, .args="x?"},     
+    { .cmd="AT+SETCFG", .desc="Set config", .fn=atcmd_setcfg, .args="xs"},
     { .cmd="AT+VERSION", .desc="FW version", .fn=atcmd_info},         
     { .cmd="AT+CONN?", .desc="Check connected", .fn=atcmd_checkconnect},
-    { .cmd="AT+CONN", .desc="Connect", .fn=atcmd_connect},  
+    { .cmd="AT+CONN", .desc="Connect", .fn=atcmd_connect, .args="s?s?s?"},  
     { .cmd="AT+DISC", .desc="Disconnect", .fn=atcmd_disconnect},  
-    { .cmd="AT+PASS", .desc="Check password", .fn=atcmd_password},
-    { .cmd="AT+START", .desc="Start scan", .fn=atcmd_start_scan},
+    { .cmd="AT+PASS", .desc="Check password", .fn=atcmd_password, .args="ss?"},
+    { .cmd="AT+START", .desc="Start scan", .fn=atcmd_start_scan, .args="u?"},
     { .cmd="AT+STOP", .desc="Stop scan", .fn=atcmd_stop_scan},
-    { .cmd="AT+IB_START", .desc="Start ibeaconning", .fn=atcmd_start_ib},
+    { .cmd="AT+IB_START", .desc="Start ibeaconning", .fn=atcmd_start_ib, .args="u?x?x?b?x?d?"},
     { .cmd="AT+IB_STOP", .desc="Stop ibeaconning", .fn=atcmd_stop_ib},
     { .cmd="AT+CONN_EN", .desc="Enable remote connection", .fn=atcmd_enable_conn},
     { .cmd="AT+CONN_DIS", .desc="Disable remote connection", .fn=atcmd_disable_conn},
     { .cmd="AT+PUSH", .desc="Push scan data", .fn=atcmd_push},
     { .cmd="AT+D?", .desc="Output debug stats", .fn=atcmd_debug_stats},
-    { .cmd="AT+O", .desc="Set output state", .fn=atcmd_out},
-    { .cmd="AT+I", .desc="Get input state", .fn=atcmd_in},
+    { .cmd="AT+O", .desc="Set output state", .fn=atcmd_out, .args="dd"},
+    { .cmd="AT+I", .desc="Get input state", .fn=atcmd_in, .args="d"},
+    { .cmd="AT+PIPE", .desc="Get/set abort on error for ';' command lines", .fn=atcmd_pipe, .args="d?"},
+    { .cmd="AT+RAW", .desc="Connect in raw mode (exit with +++)", .fn=atcmd_raw, .args="s?s?s?"},
+    { .cmd="AT+BENCH", .desc="Throughput test (TX,<bytes>[,U|B] / RX,<bytes> / STOP)", .fn=atcmd_bench, .args="sd?s?"},
+    { .cmd="AT+BENCH?", .desc="Throughput test result", .fn=atcmd_bench_stats},
+    { .cmd="AT+ADV?", .desc="Current advert, effective interval and tx power", .fn=atcmd_adv_policy},
 };
 
+#define NB_ATCMDS (sizeof(ATCMDS)/sizeof(ATCMDS[0]))
+
 // Our local data context
 static struct {
     uint8_t txbuf[MAX_TXSZ+3];          // space for terminating \r\n\0
@@ -102,21 +144,93 @@ static struct {
     UART_TX_FN_T passThru_txfn2;        // and this the other
     uint8_t ncmds;
     ATCMD_DEF_t* cmds;
-    bool authOk;
+    uint8_t cmdsByName[NB_ATCMDS];      // indexes into cmds, sorted by command name for binary search lookup
+    bool cmdsSorted;
+    ATARG_t args[MAX_ARGS];             // typed values of the current command's args
+    uint8_t uuidArg[UUID128_SIZE];      // storage for a parsed uuid128 arg
+    bool inPipeline;                    // executing a ';' separated line : per command OK/ERROR are not sent
+    bool pipeAbortOnError;              // stop a ';' separated line at the first command that fails
+    struct {
+        ATPEND_t what;
+        uint8_t token;
+        void* odev;                     // where to send the completion
+    } pending[MAX_PENDING];
+    uint8_t lastToken;                  // token of pending command just started, for the dispatcher
+    bool pendingCBSet;
+    // Output ring : response lines are queued as records [dev index][len][data] and sent straight from the ring
+    // as the destinations can take them, so a response can be any number of lines. Records for a flow controlled
+    // destination wait in place while those for the others go on out.
+    uint8_t outRing[OUT_RING_SZ];
+    uint16_t outHead;                   // free running write index
+    uint16_t outTail;                   // free running read index (oldest record not yet sent)
+    uint8_t outOff[MAX_OUTDEVS];        // bytes already sent of each destination's oldest record
+    volatile uint8_t outGone;           // bit per destination that has disconnected (set from event context)
+    bool outLost;                       // a line was dropped as ring stayed full : tell user with a '*'
+    volatile bool outPumping;
+    bool outFlushReq;                   // response complete : tell destinations to send now once ring is empty
+    UART_TX_FN_T outDevs[MAX_OUTDEVS];
+    // Long listing (AT+HELP etc) : generated an item at a time as the ring drains, so it can be bigger than the ring
+    AT_GEN_FN_T outGen;                 // NULL if none running
+    void* outGenDev;
+    int outGenNext;                     // item to generate next
+    const char* outGenStatus;           // final status of its command, sent after the last item
+    // ';' line waiting for a listing in it to drain before its next command
+    char pipeLine[MAX_PIPE_LINE];
+    char* pipeNext;                     // next command in pipeLine, NULL if no line is waiting
+    UART_TX_FN_T pipeDev;
+    int pipeExec;                       // commands run, failed, and first that failed (for the aggregated status)
+    int pipeFailed;
+    int pipeFirstFailed;
+    // Raw passthru mode : bytes go between passThru_txfn1 and 2 as they come, no line processing
+    bool rawMode;
+    uint8_t rawPlus;                    // number of '+' from passThru_txfn1 held back as they may be the escape sequence
+    bool rawPlusFlush;                  // they are not the escape after all, but the other side hasn't taken them all yet
+    volatile bool rawGuardExpired;      // guard time after held '+'s is up (set by timer)
+    bool rawTimerCreated;
+    uint32_t rawLastRx[2];              // tick of last data from txfn1 and from txfn2, for the guard time
+    uint32_t rawLastTick;               // tick when session time was last updated
+    uint32_t rawTicks;                  // session time
+    uint32_t rawBytes[2];               // bytes passed from txfn1 to txfn2, and from txfn2 to txfn1
+    bool rawOnConnect;                  // AT+RAW,NS : go to raw mode when the remote NUS server is connected
+    UART_TX_FN_T authDevs[MAX_AUTHDEVS];    // sources that have given the password (each BLE link logs in for itself)
 } _ctx = {
     .cmds=ATCMDS,
-    .ncmds= sizeof(ATCMDS)/sizeof(ATCMDS[0]),
-    .authOk = false,
+    .ncmds= NB_ATCMDS,
+    .cmdsSorted = false,
+    .inPipeline = false,
+    .pipeAbortOnError = false,
 };
 
+// predecs
+static ATCMD_DEF_t* at_find_cmd(const char* name);
+static bool at_parse_args(ATCMD_DEF_t* cmd, uint8_t nargs, char* argv[], void* odev);
+static bool at_exec_cmd(char* line, UART_TX_FN_T utx_fn);
+static void at_send_status(void* odev, const char* status);
+static int at_pending_new(ATPEND_t what, void* odev);
+static bool at_out_line(UART_TX_FN_T dev, uint8_t* d, int len);
+static int at_out_txready(void* txfn);
+static uint16_t at_out_free();
+static void at_out_reap();
+static bool at_out_gen_start(void* odev, AT_GEN_FN_T gen);
+static void at_pipe_run();
+static void at_raw_exit(UART_TX_FN_T escaper);
+static bool at_raw_flushPlus();
+static void at_passthru_end();
+static bool at_passthru_isSide(UART_TX_FN_T source_txfn);
+static void at_raw_start();
+static void at_nusc_connected(UART_TX_FN_T link_txfn);
+
+APP_TIMER_DEF(m_raw_guard_timer);
+
 // External api
 
 // Deal with received data : line string either of max length or \r or \n terminated. utx_fn is the fn to send data back to this originator
-// If in 'pass-thru' mode the data is just copied to the other guy (see AT+CONN) unless we find a "AT+DISC" in either direction
+// If in 'pass-thru' mode the data is just copied to the other guy (see AT+CONN) unless we find a "AT+DISC" in either direction.
+// Sources that are not in the pass-thru keep on with their AT commands.
 void at_process_input(char* data, UART_TX_FN_T source_txfn) {
     int dlen = strlen(data);
     if (dlen>1) {
-        if (_ctx.passThru_txfn1!=NULL && _ctx.passThru_txfn2!=NULL) {
+        if (at_passthru_isSide(source_txfn)) {
             // see which is the other guy..
             UART_TX_FN_T dest_txfn = _ctx.passThru_txfn1;  
             if (_ctx.passThru_txfn1==source_txfn) {
@@ -133,8 +247,7 @@ void at_process_input(char* data, UART_TX_FN_T source_txfn) {
                 if ((*dest_txfn)((uint8_t*)data, dlen, NULL)<0) {
                     // broken
                     (*source_txfn)(NULL, -1, NULL);        // tell guy who sent me data
-                    _ctx.passThru_txfn1 = NULL;      // ie disconnect
-                    _ctx.passThru_txfn2 = NULL;      // ie disconnect
+                    at_passthru_end();
                 }
             }
         } else {
@@ -147,7 +260,398 @@ void at_process_input(char* data, UART_TX_FN_T source_txfn) {
 }
 
 //Process an input line terminated by \0, and write any output back to the given tx fn
+// The line can hold several commands separated by ';' (eg "AT+PASS,xxx;AT+SETCFG,0101,1;AT+IB_START") : these are run in order
+// and a single aggregated OK/ERROR is returned at the end, to save a round trip per command when provisioning over BLE.
 void at_process_line(char* line, UART_TX_FN_T utx_fn) {
+    // Response is complete when we return
+    _ctx.outFlushReq = true;
+    if (strchr(line, ';')==NULL) {
+        // Just the one
+        at_exec_cmd(line, utx_fn);
+        return;
+    }
+    // copy it, as running it may have to wait for a listing to drain (and the caller will reuse its buffer)
+    strncpy(&_ctx.pipeLine[0], line, MAX_PIPE_LINE-1);
+    _ctx.pipeLine[MAX_PIPE_LINE-1] = '\0';
+    _ctx.pipeNext = &_ctx.pipeLine[0];
+    _ctx.pipeDev = utx_fn;
+    _ctx.pipeExec = 0;
+    _ctx.pipeFailed = 0;
+    _ctx.pipeFirstFailed = 0;
+    at_pipe_run();
+}
+
+// A destination has disconnected (may be called from event context) : its queued output is dropped and its slot freed
+void at_process_outGone(UART_TX_FN_T dev) {
+    for(int di=0;di<MAX_OUTDEVS;di++) {
+        if (dev!=NULL && _ctx.outDevs[di]==dev) {
+            CRITICAL_REGION_ENTER();
+            _ctx.outGone |= (1<<di);
+            CRITICAL_REGION_EXIT();
+        }
+    }
+}
+
+// Output can be taken for another input line? Comm modules leave input where it is (fifo etc) until this is true
+bool at_process_outReady() {
+    return (_ctx.outGen==NULL && _ctx.pipeNext==NULL && at_out_free()>=OUT_ACCEPT_MIN);
+}
+
+// Is source in raw mode (one side of the AT+RAW cross-connect, or the AT+BENCH,RX source)? NULL : is anyone?
+bool at_process_isRaw(UART_TX_FN_T source_txfn) {
+    if (source_txfn==NULL) {
+        return _ctx.rawMode || bench_isSink(NULL);
+    }
+    return (_ctx.rawMode && at_passthru_isSide(source_txfn)) || bench_isSink(source_txfn);
+}
+
+// Raw mode data from one side of the cross-connect : give it straight to the other side.
+// Returns number of bytes the other side couldn't take (source should offer them again later)
+// Exit from raw mode is by "+++" on its own with RAW_GUARD_MS of silence from that side before and after (Hayes style), and
+// only from the side that started it (passThru_txfn1) : the far side's data is never taken as the escape.
+// Any '+' that could be the escape are held back until we know they're not.
+int at_process_rawInput(uint8_t* data, int len, UART_TX_FN_T source_txfn) {
+    if (bench_isSink(source_txfn)) {
+        return bench_sinkInput(data, len);
+    }
+    if (!_ctx.rawMode || !at_passthru_isSide(source_txfn) || len<=0) {
+        return 0;
+    }
+    int dir = (source_txfn==_ctx.passThru_txfn1)?0:1;
+    UART_TX_FN_T dest_txfn = (dir==0)?_ctx.passThru_txfn2:_ctx.passThru_txfn1;
+    uint32_t now = app_timer_cnt_get();
+    bool guardOk = (app_timer_cnt_diff_compute(now, _ctx.rawLastRx[dir]) >= APP_TIMER_TICKS(RAW_GUARD_MS));
+    _ctx.rawLastRx[dir] = now;
+    _ctx.rawTicks += app_timer_cnt_diff_compute(now, _ctx.rawLastTick);
+    _ctx.rawLastTick = now;
+    // Could this be (part of) the escape?
+    if (dir==0 && !_ctx.rawPlusFlush && len<=(3-_ctx.rawPlus) && (guardOk || _ctx.rawPlus>0)) {
+        bool allPlus = true;
+        for(int i=0;i<len;i++) {
+            allPlus &= (data[i]=='+');
+        }
+        if (allPlus) {
+            _ctx.rawPlus += len;
+            _ctx.rawGuardExpired = false;
+            app_timer_stop(m_raw_guard_timer);
+            app_timer_start(m_raw_guard_timer, APP_TIMER_TICKS(RAW_GUARD_MS), NULL);
+            return 0;
+        }
+    }
+    // Not the escape : send on any held '+' first, this waits if they can't all go yet
+    if (dir==0 && !at_raw_flushPlus()) {
+        return len;
+    }
+    int res = (*dest_txfn)(data, len, &at_out_txready);
+    if (res<0) {
+        // broken
+        (*source_txfn)(NULL, -1, NULL);        // tell guy who sent me data
+        at_passthru_end();
+        return 0;
+    }
+    _ctx.rawBytes[dir] += (len-res);
+    return res;
+}
+
+// Run the commands of the waiting ';' line. Stops, to be carried on by the pump, if one leaves a listing generating
+static void at_pipe_run() {
+    // A command's output pumps the ring : the pump must not start the rest of the line from inside that command
+    if (_ctx.inPipeline) {
+        return;
+    }
+    _ctx.inPipeline = true;
+    while(_ctx.pipeNext!=NULL && _ctx.outGen==NULL) {
+        char* s = _ctx.pipeNext;
+        char* next = strchr(s, ';');
+        if (next!=NULL) {
+            *next++ = '\0';
+        }
+        // move on before running it, so it is only run the once
+        _ctx.pipeNext = next;
+        while(*s==' ') {
+            s++;
+        }
+        // ignore empty commands (eg trailing ';')
+        if (*s!='\0' && *s!='\r' && *s!='\n') {
+            _ctx.pipeExec++;
+            if (!at_exec_cmd(s, _ctx.pipeDev)) {
+                _ctx.pipeFailed++;
+                if (_ctx.pipeFirstFailed==0) {
+                    _ctx.pipeFirstFailed = _ctx.pipeExec;
+                }
+                if (_ctx.pipeAbortOnError) {
+                    _ctx.pipeNext = NULL;
+                }
+            }
+        }
+    }
+    _ctx.inPipeline = false;
+    if (_ctx.pipeNext!=NULL) {
+        return;
+    }
+    _ctx.outFlushReq = true;
+    if (_ctx.pipeFailed==0) {
+        wconsole_println(_ctx.pipeDev, "OK");
+    } else {
+        wconsole_println(_ctx.pipeDev, "ERROR");
+        wconsole_println(_ctx.pipeDev, "%d of %d commands failed, first was %d%s", _ctx.pipeFailed, _ctx.pipeExec, _ctx.pipeFirstFailed,
+                    (_ctx.pipeAbortOnError?" (aborted)":""));
+    }
+}
+
+// Drop everything queued for a destination and free its slot
+static void at_out_drop(uint8_t di) {
+    for(uint16_t p=_ctx.outTail;p!=_ctx.outHead;p+=(2+_ctx.outRing[(p+1) & (OUT_RING_SZ-1)])) {
+        if (_ctx.outRing[p & (OUT_RING_SZ-1)]==di) {
+            _ctx.outRing[p & (OUT_RING_SZ-1)] = OUT_DEV_DONE;
+        }
+    }
+    _ctx.outOff[di] = 0;
+    _ctx.outDevs[di] = NULL;
+}
+// Destinations that disconnected since last time : their output goes and their slots are free for others
+static void at_out_reap() {
+    if (_ctx.outGone==0) {
+        return;
+    }
+    uint8_t gone;
+    CRITICAL_REGION_ENTER();
+    gone = _ctx.outGone;
+    _ctx.outGone = 0;
+    CRITICAL_REGION_EXIT();
+    for(int di=0;di<MAX_OUTDEVS;di++) {
+        if (gone & (1<<di)) {
+            at_out_drop(di);
+        }
+    }
+}
+// Send queued output records as the destinations can take them. A flow controlled destination keeps its records (in order)
+// and the records of the other destinations behind them still go, so one slow BLE link doesn't hold up the rest.
+static void at_out_send() {
+    uint8_t blocked = 0;        // bit per destination that is flow controlled for the rest of this pass
+    for(uint16_t p=_ctx.outTail;p!=_ctx.outHead;) {
+        uint8_t di = _ctx.outRing[p & (OUT_RING_SZ-1)];
+        uint8_t len = _ctx.outRing[(p+1) & (OUT_RING_SZ-1)];
+        if (di<MAX_OUTDEVS && !(blocked & (1<<di))) {
+            while(_ctx.outOff[di]<len) {
+                // send up to the end of the record or the end of the ring, whichever comes first
+                uint16_t start = (p+2+_ctx.outOff[di]) & (OUT_RING_SZ-1);
+                int chunk = len-_ctx.outOff[di];
+                if (chunk>(OUT_RING_SZ-start)) {
+                    chunk = OUT_RING_SZ-start;
+                }
+                int res = (*_ctx.outDevs[di])(&_ctx.outRing[start], chunk, &at_out_txready);
+                if (res<0) {
+                    // destination gone, drop all its output (this record included)
+                    at_out_drop(di);
+                    break;
+                }
+                _ctx.outOff[di] += (chunk-res);
+                if (res>0) {
+                    // flow controlled : carry on when it says its ready or next time round the main loop
+                    blocked |= (1<<di);
+                    break;
+                }
+            }
+            if (_ctx.outDevs[di]!=NULL && _ctx.outOff[di]>=len) {
+                _ctx.outRing[p & (OUT_RING_SZ-1)] = OUT_DEV_DONE;
+                _ctx.outOff[di] = 0;
+            }
+        }
+        p += (2+len);
+    }
+    // free the space of the sent records at the tail
+    while(_ctx.outTail!=_ctx.outHead && _ctx.outRing[_ctx.outTail & (OUT_RING_SZ-1)]==OUT_DEV_DONE) {
+        _ctx.outTail += (2+_ctx.outRing[(_ctx.outTail+1) & (OUT_RING_SZ-1)]);
+    }
+}
+
+// Send as much as possible of the queued output, and generate more of any listing (or carry on a ';' line waiting for one)
+// as it drains. Called from main loop, and when writing output
+void at_process_pump() {
+    // Not re-entrant (eg tx ready upcall from sink while we're in it)
+    if (_ctx.outPumping) {
+        return;
+    }
+    // Guard time after held '+'s done? (dealt with here rather than in the timer callback as its in interrupt context)
+    if (_ctx.rawGuardExpired) {
+        _ctx.rawGuardExpired = false;
+        if (_ctx.rawMode && _ctx.rawPlus==3 && !_ctx.rawPlusFlush) {
+            at_raw_exit(_ctx.passThru_txfn1);
+        } else {
+            at_raw_flushPlus();
+        }
+    } else if (_ctx.rawPlusFlush) {
+        at_raw_flushPlus();         // other side couldn't take them all last time
+    }
+    _ctx.outPumping = true;
+    at_out_reap();
+    for(;;) {
+        at_out_send();
+        if (_ctx.outGen!=NULL && at_out_free()>=OUT_GEN_ROOM) {
+            if (!(*_ctx.outGen)(_ctx.outGenDev, _ctx.outGenNext++)) {
+                // listing done : now its command's status
+                _ctx.outGen = NULL;
+                _ctx.outFlushReq = true;
+                if (_ctx.outGenStatus!=NULL) {
+                    wconsole_println(_ctx.outGenDev, _ctx.outGenStatus);
+                }
+            }
+        } else if (_ctx.outGen==NULL && _ctx.pipeNext!=NULL && !_ctx.inPipeline && at_out_free()>=OUT_ACCEPT_MIN) {
+            at_pipe_run();
+        } else {
+            break;
+        }
+    }
+    if (_ctx.outFlushReq && _ctx.outTail==_ctx.outHead) {
+        // write of 0 bytes is the flush hint (so BLE doesn't wait to coalesce the end of an interactive response)
+        _ctx.outFlushReq = false;
+        for(int i=0;i<MAX_OUTDEVS;i++) {
+            if (_ctx.outDevs[i]!=NULL) {
+                (*_ctx.outDevs[i])((uint8_t*)"", 0, &at_out_txready);
+            }
+        }
+    }
+    _ctx.outPumping = false;
+}
+
+// internals
+static void at_raw_guard_timer_cb(void* p_context) {
+    _ctx.rawGuardExpired = true;
+}
+// Send any held '+' to the other side as they weren't an escape after all. Returns false if it couldn't take them all : the
+// rest are kept (and go before any more data from that side) and sent from the pump
+static bool at_raw_flushPlus() {
+    if (_ctx.rawPlus==0 || !_ctx.rawMode) {
+        _ctx.rawPlus = 0;
+        _ctx.rawPlusFlush = false;
+        return true;
+    }
+    _ctx.rawPlusFlush = true;
+    int res = (*_ctx.passThru_txfn2)((uint8_t*)"+++", _ctx.rawPlus, &at_out_txready);
+    if (res<0) {
+        res = 0;        // broken : the next data from that side finds out
+    }
+    _ctx.rawBytes[0] += (_ctx.rawPlus-res);
+    _ctx.rawPlus = res;
+    if (res>0) {
+        return false;
+    }
+    _ctx.rawPlusFlush = false;
+    return true;
+}
+// Print raw mode throughput : bytes each way, and kbit/s over the session
+static void at_raw_print_stats(void* odev) {
+    uint32_t ms = (uint32_t)(((uint64_t)_ctx.rawTicks*1000)/APP_TIMER_TICKS_PER_SEC);
+    if (ms==0) {
+        ms = 1;
+    }
+    wconsole_println(odev, "R:%d,%d,%d,%d,%d", ms, _ctx.rawBytes[0], _ctx.rawBytes[1], (_ctx.rawBytes[0]*8)/ms, (_ctx.rawBytes[1]*8)/ms);
+}
+// Leave raw mode after escape sequence : tear down the cross-connect, and confirm to the side that asked
+static void at_raw_exit(UART_TX_FN_T escaper) {
+    _ctx.rawPlus = 0;
+    _ctx.rawPlusFlush = false;
+    UART_TX_FN_T other = (escaper==_ctx.passThru_txfn1)?_ctx.passThru_txfn2:_ctx.passThru_txfn1;
+    at_passthru_end();
+    if (other!=NULL) {
+        (*other)(NULL, -1, NULL);        // Tell other side we're done
+    }
+    _ctx.outFlushReq = true;
+    wconsole_println(escaper, "OK");
+    at_raw_print_stats(escaper);
+}
+// Is source one side of the cross-connect? (with the passthru from the uart to the links, any of the links in it)
+static bool at_passthru_isSide(UART_TX_FN_T source_txfn) {
+    if (_ctx.passThru_txfn1==NULL || _ctx.passThru_txfn2==NULL || source_txfn==NULL) {
+        return false;
+    }
+    return (source_txfn==_ctx.passThru_txfn1 || source_txfn==_ctx.passThru_txfn2 ||
+                (_ctx.passThru_txfn2==&comm_ble_session_tx && comm_ble_inSession(source_txfn)));
+}
+// Cross-connect (line or raw) is finished
+static void at_passthru_end() {
+    if (_ctx.passThru_txfn2==&comm_ble_session_tx) {
+        comm_ble_session_end();
+    }
+    _ctx.passThru_txfn1 = NULL;      // ie disconnect
+    _ctx.passThru_txfn2 = NULL;
+    _ctx.rawMode = false;
+    // back to low power connection parameters
+    app_setConnProfile(false);
+}
+// tx ready upcall from a destination : may be in interrupt context, and that interrupt has already woken the main loop
+// whose pump sends the rest and generates more of any listing
+static int at_out_txready(void* txfn) {
+    return 0;
+}
+
+static uint16_t at_out_free() {
+    return OUT_RING_SZ-(uint16_t)(_ctx.outHead-_ctx.outTail);
+}
+
+// Start a long listing for odev : its items are generated by the pump as the ring has room. The command's final status
+// is held back until the last item is out. Returns false if another listing is still running.
+static bool at_out_gen_start(void* odev, AT_GEN_FN_T gen) {
+    if (_ctx.outGen!=NULL) {
+        return false;
+    }
+    _ctx.outGen = gen;
+    _ctx.outGenDev = odev;
+    _ctx.outGenNext = 0;
+    _ctx.outGenStatus = NULL;
+    at_process_pump();
+    return true;
+}
+
+// Queue a line for output to dev. Never waits for the ring to drain (that would hold up the main loop, and so all the other
+// links) : long listings are generated as it drains, and input lines are held while its low (at_process_outReady()), so
+// a line is only dropped if a single command says more than the ring holds. Returns false if the line had to be dropped.
+static bool at_out_line(UART_TX_FN_T dev, uint8_t* d, int len) {
+    if (dev==NULL || len>255) {
+        return false;
+    }
+    // find index of destination, or a free one for it
+    at_out_reap();
+    int di = -1;
+    for(int i=0;i<MAX_OUTDEVS;i++) {
+        if (_ctx.outDevs[i]==dev) {
+            di = i;
+            break;
+        } else if (_ctx.outDevs[i]==NULL && di<0) {
+            di = i;
+        }
+    }
+    if (di<0) {
+        log_noout_fn("console write FAIL no dev slot");      // just for debugger to watch
+        return false;
+    }
+    _ctx.outDevs[di] = dev;
+    int need = 2+len+(_ctx.outLost?3:0);
+    if (at_out_free()<need) {
+        at_process_pump();
+        if (at_out_free()<need) {
+            _ctx.outLost = true;
+            log_noout_fn("console write FAIL ring full");      // just for debugger to watch
+            return false;
+        }
+    }
+    if (_ctx.outLost) {
+        _ctx.outLost = false;
+        _ctx.outRing[_ctx.outHead++ & (OUT_RING_SZ-1)] = di;
+        _ctx.outRing[_ctx.outHead++ & (OUT_RING_SZ-1)] = 1;
+        _ctx.outRing[_ctx.outHead++ & (OUT_RING_SZ-1)] = '*';       // so user knows he missed something.
+    }
+    _ctx.outRing[_ctx.outHead++ & (OUT_RING_SZ-1)] = di;
+    _ctx.outRing[_ctx.outHead++ & (OUT_RING_SZ-1)] = len;
+    for(int i=0;i<len;i++) {
+        _ctx.outRing[_ctx.outHead++ & (OUT_RING_SZ-1)] = d[i];
+    }
+    return true;
+}
+
+// Execute one command from line, sending its output and final status (unless in a pipeline) to utx_fn. Returns false if it failed
+static bool at_exec_cmd(char* line, UART_TX_FN_T utx_fn) {
     // parse line into : command, args
     char* els[MAX_ARGS];
     char* s = line;
@@ -178,76 +682,278 @@ void at_process_line(char* line, UART_TX_FN_T utx_fn) {
     }
     if (strlen(els[0])==0) {
         // empty bad command, ignore it
-        return;
+        return true;
     }
     // find it in the list
-    for(int i=0;i<_ctx.ncmds;i++) {
-        if (strcmp(els[0], _ctx.cmds[i].cmd)==0) {
-            // gotcha
-//            log_debug("got cmd %s with %d args", els[0], elsi-1);
-            // call the specific command processor function as registered
-            ATRESULT ret = (*_ctx.cmds[i].fn)(elsi, els, utx_fn);
-            // generic processing of return for OK and GENERR, other cases the cmd processing sent the return
-            if (ret==ATCMD_OK) {
-                wconsole_println(utx_fn, "OK");
-            } else if (ret==ATCMD_GENERR) {
-                wconsole_println(utx_fn, "ERROR");
-//                wconsole_println(utx_fn, "Bad args for %s : %s", _ctx.cmds[i].cmd, _ctx.cmds[i].desc);
-            }
-            return;
+    ATCMD_DEF_t* cmd = at_find_cmd(els[0]);
+    if (cmd!=NULL) {
+        // gotcha
+//        log_debug("got cmd %s with %d args", els[0], elsi-1);
+        // check and parse the args as the command's schema says, so handler gets typed values
+        if (!at_parse_args(cmd, elsi, els, utx_fn)) {
+            return false;
         }
+        // call the specific command processor function as registered
+        ATRESULT ret = (*cmd->fn)(elsi, els, &_ctx.args[0], utx_fn);
+        // generic processing of return for OK and GENERR, other cases the cmd processing sent the return
+        if (ret==ATCMD_OK) {
+            at_send_status(utx_fn, "OK");
+        } else if (ret==ATCMD_GENERR) {
+            at_send_status(utx_fn, "ERROR");
+//            wconsole_println(utx_fn, "Bad args for %s : %s", cmd->cmd, cmd->desc);
+        } else if (ret==ATCMD_PENDING) {
+            // not a final status so sent even in a pipeline : caller needs the token to match the completion
+            wconsole_println(utx_fn, "PENDING %d", _ctx.lastToken);
+        }
+        return (ret==ATCMD_OK || ret==ATCMD_PROCESSED || ret==ATCMD_PENDING);
     }
     // not found
-    wconsole_println(utx_fn, "ERROR");
+    at_send_status(utx_fn, "ERROR");
     wconsole_println(utx_fn, "Unknown command [%s].", els[0]);
 //    log_debug("no cmd %s with %d args", els[0], elsi-1);
+    return false;
 }
 
-// internals
-bool authenticated() {
-    return _ctx.authOk;
+// Send the final OK/ERROR of a command, except when it is part of a ';' line where only the aggregate status is sent
+static void at_send_status(void* odev, const char* status) {
+    if (_ctx.inPipeline) {
+        return;
+    }
+    if (_ctx.outGen!=NULL && _ctx.outGenDev==odev) {
+        _ctx.outGenStatus = status;         // after the listing the command started
+    } else {
+        wconsole_println(odev, status);
+    }
+}
+
+// Build the by-name index of the command table. Done once on first lookup : ATCMDS[] itself stays in AT+HELP order.
+static void at_sort_cmds() {
+    // insertion sort, its only ~25 entries and only done once
+    for(int i=0;i<_ctx.ncmds;i++) {
+        int j=i;
+        while(j>0 && strcmp(_ctx.cmds[_ctx.cmdsByName[j-1]].cmd, _ctx.cmds[i].cmd)>0) {
+            _ctx.cmdsByName[j] = _ctx.cmdsByName[j-1];
+            j--;
+        }
+        _ctx.cmdsByName[j] = i;
+    }
+    _ctx.cmdsSorted = true;
+}
+
+// Find command definition by name using binary search on the sorted index (~5 strcmps rather than up to 24)
+static ATCMD_DEF_t* at_find_cmd(const char* name) {
+    if (!_ctx.cmdsSorted) {
+        at_sort_cmds();
+    }
+    int lo = 0;
+    int hi = _ctx.ncmds-1;
+    while(lo<=hi) {
+        int mid = (lo+hi)/2;
+        ATCMD_DEF_t* c = &_ctx.cmds[_ctx.cmdsByName[mid]];
+        int r = strcmp(name, c->cmd);
+        if (r==0) {
+            return c;
+        } else if (r<0) {
+            hi = mid-1;
+        } else {
+            lo = mid+1;
+        }
+    }
+    return NULL;
+}
+
+// Completion of config writes to flash : finish any commands waiting for it
+static void at_cfg_written(bool ok) {
+    for(int i=0;i<MAX_PENDING;i++) {
+        if (_ctx.pending[i].what==ATPEND_CFGWRITE) {
+            _ctx.outFlushReq = true;
+            wconsole_println(_ctx.pending[i].odev, (ok?"OK %d":"ERROR %d"), _ctx.pending[i].token);
+            _ctx.pending[i].what = ATPEND_NONE;
+        }
+    }
 }
-bool clear_authentication() {
-    _ctx.authOk = false;
+
+// AT+CONN,NS result (from main loop) : passthru to the remote NUS server starts now if it worked
+static void at_nusc_connected(UART_TX_FN_T link_txfn) {
+    for(int i=0;i<MAX_PENDING;i++) {
+        if (_ctx.pending[i].what==ATPEND_NUSCONN) {
+            if (link_txfn!=NULL) {
+                _ctx.passThru_txfn1 = (UART_TX_FN_T)_ctx.pending[i].odev;
+                _ctx.passThru_txfn2 = link_txfn;
+                if (_ctx.rawOnConnect) {
+                    at_raw_start();
+                }
+            }
+            _ctx.outFlushReq = true;
+            wconsole_println(_ctx.pending[i].odev, (link_txfn!=NULL?"OK %d":"ERROR %d"), _ctx.pending[i].token);
+            _ctx.pending[i].what = ATPEND_NONE;
+        }
+    }
+    _ctx.rawOnConnect = false;
 }
-bool set_authentication() {
-    _ctx.authOk = true;
+
+// Record a command as pending completion of 'what', returning its token or -1 if too many already pending
+static int at_pending_new(ATPEND_t what, void* odev) {
+    if (!_ctx.pendingCBSet) {
+        cfg_setWriteDoneCB(&at_cfg_written);
+        _ctx.pendingCBSet = true;
+    }
+    for(int i=0;i<MAX_PENDING;i++) {
+        if (_ctx.pending[i].what==ATPEND_NONE) {
+            _ctx.lastToken++;
+            _ctx.pending[i].what = what;
+            _ctx.pending[i].token = _ctx.lastToken;
+            _ctx.pending[i].odev = odev;
+            return _ctx.lastToken;
+        }
+    }
+    return -1;
+}
+
+// Parse one arg according to its schema type. Returns true if ok
+static bool at_parse_arg(char t, char* s, ATARG_t* a) {
+    uint32_t v = 0;
+    a->s = s;
+    switch(t) {
+        case 'x': {
+            if (!Util_parsehex(s, 4, &v)) {
+                return false;
+            }
+            a->v = v;
+            return true;
+        }
+        case 'b': {
+            if (!Util_parsehex(s, 2, &v)) {
+                return false;
+            }
+            a->v = v;
+            return true;
+        }
+        case 'd': {
+            return Util_parsedec(s, &a->v);
+        }
+        case 'u': {
+            if (strlen(s)!=(UUID128_SIZE*2) || Util_scanhex(s, UUID128_SIZE, &_ctx.uuidArg[0])!=UUID128_SIZE) {
+                return false;
+            }
+            a->uuid = &_ctx.uuidArg[0];
+            return true;
+        }
+        case 's': {
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Check args against the command's schema and parse them into _ctx.args[] (index as argv, so args[1] is the first arg)
+// Returns false (after telling the user) if the args are malformed
+static bool at_parse_args(ATCMD_DEF_t* cmd, uint8_t nargs, char* argv[], void* odev) {
+    memset(&_ctx.args[0], 0, sizeof(_ctx.args));
+    if (cmd->args==NULL) {
+        return true;        // not checked
+    }
+    int ai = 1;
+    for(const char* sp=cmd->args; *sp!='\0'; sp++, ai++) {
+        char t = *sp;
+        bool opt = (*(sp+1)=='?');
+        if (opt) {
+            sp++;
+        }
+        if (ai<nargs && argv[ai][0]!='\0') {
+            if (!at_parse_arg(t, argv[ai], &_ctx.args[ai])) {
+                at_send_status(odev, "ERROR");
+                wconsole_println(odev, "Bad arg %d [%s] for %s", ai, argv[ai], cmd->cmd);
+                return false;
+            }
+            _ctx.args[ai].present = true;
+        } else if (!opt) {
+            at_send_status(odev, "ERROR");
+            wconsole_println(odev, "Missing arg %d for %s", ai, cmd->cmd);
+            return false;
+        }
+    }
+    if (nargs>ai) {
+        at_send_status(odev, "ERROR");
+        wconsole_println(odev, "Too many args for %s", cmd->cmd);
+        return false;
+    }
+    return true;
+}
+
+bool authenticated(void* odev) {
+    for(int i=0;i<MAX_AUTHDEVS;i++) {
+        if (odev!=NULL && _ctx.authDevs[i]==odev) {
+            return true;
+        }
+    }
+    return false;
+}
+// odev NULL clears for everyone
+bool clear_authentication(void* odev) {
+    for(int i=0;i<MAX_AUTHDEVS;i++) {
+        if (odev==NULL || _ctx.authDevs[i]==odev) {
+            _ctx.authDevs[i] = NULL;
+        }
+    }
+    return true;
+}
+bool set_authentication(void* odev) {
+    if (authenticated(odev)) {
+        return true;
+    }
+    for(int i=0;i<MAX_AUTHDEVS;i++) {
+        if (_ctx.authDevs[i]==NULL) {
+            _ctx.authDevs[i] = (UART_TX_FN_T)odev;
+            return true;
+        }
+    }
+    return false;
 }
 
 // AT command processing
-static ATRESULT atcmd_listcmds(uint8_t nargs, char* argv[], void* odev) {
-    for(int i=0;i<_ctx.ncmds;i++) {
-        wconsole_println(odev, "%s: %s", _ctx.cmds[i].cmd, _ctx.cmds[i].desc);
+static bool at_gen_listcmds(void* odev, int i) {
+    if (i>=_ctx.ncmds) {
+        return false;
     }
-    return ATCMD_OK;
+    wconsole_println(odev, "%s: %s", _ctx.cmds[i].cmd, _ctx.cmds[i].desc);
+    return true;
+}
+static ATRESULT atcmd_listcmds(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    return (at_out_gen_start(odev, &at_gen_listcmds) ? ATCMD_OK : ATCMD_GENERR);
 }
 
-static ATRESULT atcmd_hello(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_hello(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     wconsole_println(odev, "Hello.");
     return ATCMD_OK;
 }
 
 // Return decimal integer with firmware version
-static ATRESULT atcmd_who(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_who(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     wconsole_println(odev, "%d", (((cfg_getFWMajor() & 0xFF)<<8) + (cfg_getFWMinor() & 0xff)));
     return ATCMD_PROCESSED;     // don't need to says ok
 }
-static ATRESULT atcmd_type(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_type(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     wconsole_println(odev, "%d", cfg_getCardType());
     return ATCMD_PROCESSED;     // don't need to says ok
 }
 
-static ATRESULT atcmd_push(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_push(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     // always in push mode anyway
     return ATCMD_OK;
 }
 
-static ATRESULT atcmd_reset(uint8_t nargs, char* argv[], void* odev) {
+// Reset is done by main loop once any config write is finished, so if one is in progress we complete when its done
+static ATRESULT atcmd_reset(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     app_reset_request();
+    if (cfg_isWritePending() && at_pending_new(ATPEND_CFGWRITE, odev)>=0) {
+        return ATCMD_PENDING;
+    }
     return ATCMD_OK;
 }
 
-static ATRESULT atcmd_info(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_info(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     wconsole_println(odev, "Wyres BLE v%d.%d", cfg_getFWMajor(), cfg_getFWMinor());
     wconsole_println(odev, "id:%04x:%04x (%d:%d) name [%s]", cfg_getMajor_Value(), cfg_getMinor_Value(),cfg_getMajor_Value(), cfg_getMinor_Value(), cfg_getAdvName());
     wconsole_println(odev, "Scan: %s, Beacon: %s", (ibs_is_scan_active()?"YES":"NO"), (ibb_isBeaconning()?"YES":"NO"));
@@ -299,56 +1005,40 @@ static void printKey(void* odev, uint16_t k, uint8_t* d, int l) {
     }
 }
 
-static ATRESULT atcmd_getcfg(uint8_t nargs, char* argv[], void* odev) {
-    // Check args - if 1 present then show just that config element else show all
-    if (nargs>2) {
-        return ATCMD_BADARG;
+static bool at_gen_getcfg(void* odev, int i) {
+    uint16_t k = cfg_getKeyAt(i);
+    if (k==DCFG_KEY_ILLEGAL) {
+        return false;
     }
-    if (nargs==1) {
-        // get al config elements and print them
-        // Currently not possible as uart output buffer can't hold them all
-        cfg_iterateKeys(odev, &printKey);
-    } else if (nargs==2) {
-        int k=0;
-        int kl = strlen(argv[1]);
-        if (kl==4) {
-            if (sscanf(argv[1], "%4x", &k)<1) {
-                wconsole_println(odev, "ERROR");
-                wconsole_println(odev, "Bad key [%s] must be 4 hex digits", argv[1]);
-                return ATCMD_BADARG;
-            } else {
-                uint8_t d[16];
-                int l = cfg_getByKey(k, &d[0], 16);
-                printKey(odev, k, &d[0], l);
-            }
-        } else {
-            wconsole_println(odev, "ERROR");
-            wconsole_println(odev, "Must give key of 4 digits");
-            return ATCMD_BADARG;
+    uint8_t d[16];
+    int l = cfg_getByKey(k, &d[0], 16);
+    printKey(odev, k, &d[0], l);
+    return true;
+}
+static ATRESULT atcmd_getcfg(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    // Check args - if key present then show just that config element else show all
+    if (!args[1].present) {
+        // get all config elements and print them, as the output has room
+        if (!at_out_gen_start(odev, &at_gen_getcfg)) {
+            return ATCMD_GENERR;
         }
+    } else {
+        uint8_t d[16];
+        int l = cfg_getByKey(args[1].v, &d[0], 16);
+        printKey(odev, args[1].v, &d[0], l);
     }
     return ATCMD_OK;
 }
-static ATRESULT atcmd_setcfg(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_setcfg(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     // Must have done a password login to set params
-    if (!authenticated()) {
+    if (!authenticated(odev)) {
         wconsole_println(odev, "Not authenticated");
         return ATCMD_GENERR;
     }
 
-    // args : cmd, config key (always 4 digits hex), config value as hex string (0x prefix) or decimal
-    if (nargs<3) {
-        return ATCMD_BADARG;
-    }
-    // parse key
-    if (strlen(argv[1])!=4) {
-        wconsole_println(odev, "Key[%s] must be 4 digits", argv[1]);
-        return ATCMD_BADARG;
-    }
-    int k=0;
-    if (sscanf(argv[1], "%4x", &k)<1) {
-        wconsole_println(odev, "Key[%s] must be 4 digits", argv[1]);
-    } else {
+    // args : cmd, config key (hex16, checked by schema), config value as hex string (0x prefix) or decimal
+    uint16_t k = args[1].v;
+    {
         // parse value
         // Get the length it should be by a dummy get
         uint32_t d=0;
@@ -363,19 +1053,19 @@ static ATRESULT atcmd_setcfg(uint8_t nargs, char* argv[], void* odev) {
             case 2:
             case 3:
             case 4: {
-                int v = 0;
+                int32_t v = 0;
                 char *vp = argv[2];
                 if (*vp=='0' && *(vp+1)=='x') {
                     if (strlen((vp+2))!=(l*2)) {
                         wconsole_println(odev, "Key[%04x]=%s value is incorrect length. (expected %d bytes)", k, argv[2], l);
                         return ATCMD_BADARG;
                     }
-                    if (sscanf((vp+2), "%x", &v)<1) {
+                    if (!Util_parsehex((vp+2), l*2, (uint32_t*)&v)) {
                         wconsole_println(odev, "Key[%04x] bad hex value:%s",k,vp);
                         return ATCMD_BADARG;
                     }
                 } else {
-                    if (sscanf(vp, "%d", &v)<1) {
+                    if (!Util_parsedec(vp, &v)) {
                         wconsole_println(odev, "Key[%04x] bad dec value:%s",k,vp);
                         return ATCMD_BADARG;
                     }
@@ -403,15 +1093,9 @@ static ATRESULT atcmd_setcfg(uint8_t nargs, char* argv[], void* odev) {
                 }
                 // gonna allow up to 16 bytes
                 uint8_t val[16];
-                for(int i=0;i<l;i++) {
-                    // sscanf into int (4 bytes) then copy just LSB as value for each byte
-                    unsigned int b=0;
-                    if (sscanf(vp, "%02x", &b)<1) {
-                        wconsole_println(odev, "Key[%04x] bad hex : %s", k, vp);
-                        return ATCMD_BADARG;
-                    }
-                    val[i] = b;
-                    vp+=2;
+                if (Util_scanhex(vp, l, &val[0])!=l) {
+                    wconsole_println(odev, "Key[%04x] bad hex : %s", k, vp);
+                    return ATCMD_BADARG;
                 }
                 cfg_setByKey(k, &val[0], l);
                 printKey(odev, k, &val[0], l);
@@ -419,11 +1103,16 @@ static ATRESULT atcmd_setcfg(uint8_t nargs, char* argv[], void* odev) {
             }
         }
     }
+    // Value is set, but only final once written to flash : tell caller when its done rather than blocking
+    // (if can't track it, just say OK as it will be written anyway)
+    if (cfg_isWritePending() && at_pending_new(ATPEND_CFGWRITE, odev)>=0) {
+        return ATCMD_PENDING;
+    }
     return ATCMD_OK;
 }
 
 // Check if connected to BLE (0=no, 1=yes but not cross, 2=cross)
-static ATRESULT atcmd_checkconnect(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_checkconnect(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     if (_ctx.passThru_txfn1!=NULL && _ctx.passThru_txfn2!=NULL) {
         wconsole_println(odev, "2");
     } else if (comm_ble_isConnected()) {
@@ -438,48 +1127,67 @@ static ATRESULT atcmd_checkconnect(uint8_t nargs, char* argv[], void* odev) {
 // 1st Parameter indicates the device to connect to: 
 //  - U = physical uart (logically only from a remote BLE NUS service...) - this is also the default
 //  - NC = NUS remote client (must be already connected to us)
-//  - NS = NUS remote server (connection will be initiated, parameter 2 must indicate devAddr)
-static ATRESULT atcmd_connect(uint8_t nargs, char* argv[], void* odev) {
+//  - NS = NUS remote server (connection will be initiated, parameter 2 must indicate devAddr as 12 hex digits in the order
+//    the scan shows it, parameter 3 is P if its a public address). Returns PENDING, then OK/ERROR once connected (or not)
+static ATRESULT atcmd_connect(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
 
     if (nargs==1 || (nargs==2 && argv[1][0]=='U')) {
         // Must have done a password login to be allowed to connect if coming from remote BLE guy
-        if (!authenticated()) {
+        if (!authenticated(odev)) {
             return ATCMD_GENERR;
         }
         // the sender is one side (assumed to be a remote BLE) and the comm UART is forced as the other side
         _ctx.passThru_txfn1 = (UART_TX_FN_T)odev;
         _ctx.passThru_txfn2 = &comm_uart_tx;
         // Setting these 2 attributes will mean that the pass-thru handling takes place in the at_process_line() method
+        app_setConnProfile(true);
         return ATCMD_OK;    
     }
     if (nargs>=2) {
         if (strncmp("NC", argv[1], 2)==0) {
-            // Must have BLE NUS client connected currently
-            if (comm_ble_isConnected()) {
+            // Must have BLE NUS client(s) connected currently : those connected now are the other side
+            if (comm_ble_session_start((UART_TX_FN_T)odev)>0) {
                 _ctx.passThru_txfn1 = (UART_TX_FN_T)odev;
-                _ctx.passThru_txfn2 = &comm_ble_tx;
+                _ctx.passThru_txfn2 = &comm_ble_session_tx;
                 // Setting these 2 attributes will mean that the pass-thru handling takes place in the at_process_line() method
+                app_setConnProfile(true);
                 return ATCMD_OK;    
             } else {
                 // don't connect when noone there to listen
                 return ATCMD_GENERR;
             }
         } else if (strncmp("NS", argv[1], 2)==0) {
-            wconsole_println(odev, "ERROR");
-            wconsole_println(odev, "Not yet implemented");
-            return ATCMD_BADARG;
+            uint8_t addr[BLE_GAP_ADDR_LEN];
+            if (nargs<3 || strlen(argv[2])!=(BLE_GAP_ADDR_LEN*2) || Util_scanhex(argv[2], BLE_GAP_ADDR_LEN, &addr[0])!=BLE_GAP_ADDR_LEN) {
+                at_send_status(odev, "ERROR");
+                wconsole_println(odev, "Bad device address");
+                return ATCMD_BADARG;
+            }
+            int tok = at_pending_new(ATPEND_NUSCONN, odev);
+            if (tok<0) {
+                return ATCMD_GENERR;
+            }
+            if (!comm_ble_central_connect(&addr[0], (nargs>=4 && argv[3][0]=='P'), &at_nusc_connected)) {
+                // eg scanning, or already connected to a server
+                for(int i=0;i<MAX_PENDING;i++) {
+                    if (_ctx.pending[i].token==tok) {
+                        _ctx.pending[i].what = ATPEND_NONE;
+                    }
+                }
+                return ATCMD_GENERR;
+            }
+            return ATCMD_PENDING;
         }
     }
     return ATCMD_GENERR;
 }
 // And tear down the cross-connect
-static ATRESULT atcmd_disconnect(uint8_t nargs, char* argv[], void* odev) {
-    // Are we connected currently?
-    if (_ctx.passThru_txfn1!=NULL && _ctx.passThru_txfn2!=NULL) {
+static ATRESULT atcmd_disconnect(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    // Are we connected currently, and is this one of the sides (any BLE link in it counts when passthru is to the links)?
+    if (at_passthru_isSide((UART_TX_FN_T)odev)) {
         (*_ctx.passThru_txfn1)(NULL, -1, NULL);        // Tell remote dest we're done
         (*_ctx.passThru_txfn2)(NULL, -1, NULL);       // and confirm to source
-        _ctx.passThru_txfn1 = NULL;
-        _ctx.passThru_txfn2 = NULL;
+        at_passthru_end();
     } else {
         wconsole_println(odev, "Not connected");
         return ATCMD_GENERR;
@@ -489,22 +1197,24 @@ static ATRESULT atcmd_disconnect(uint8_t nargs, char* argv[], void* odev) {
 }
 
 // AT+PASS,V,<password> or AT+PASS,S,<newpassword> (must already have had a password 'V' ok)
-static ATRESULT atcmd_password(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_password(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     if (nargs==2) {
         // Check password
         if (cfg_checkPassword(argv[1])) {
-            set_authentication();
-            return ATCMD_OK;
+            if (set_authentication(odev)) {
+                return ATCMD_OK;
+            }
         }
     } else if (nargs==3) {
         if (strcmp("V", argv[1])==0) {
             if (cfg_checkPassword(argv[2])) {
-                set_authentication();
-                return ATCMD_OK;
+                if (set_authentication(odev)) {
+                    return ATCMD_OK;
+                }
             }
         } else if (strcmp("S", argv[1])==0) {
             // set password if already logged in (old pass is passed as NULL)
-            if (authenticated()) {
+            if (authenticated(odev)) {
                 if (cfg_setPassword(NULL, argv[2])) {
                     return ATCMD_OK;
                 }
@@ -512,44 +1222,43 @@ static ATRESULT atcmd_password(uint8_t nargs, char* argv[], void* odev) {
         }
     }
     // Else not
-    clear_authentication();
+    clear_authentication(odev);
     return ATCMD_GENERR;
 }
 
-static ATRESULT atcmd_start_scan(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_start_scan(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     // check if a UUID is provided
-    // expected pattern is AT+START,<UUID> UUID is 32 hex digits long
-    // parser cuts into argv[0]=AT+START, argv[1]=<UUID>
-    if (nargs>1) 
+    // expected pattern is AT+START,<UUID> UUID is 32 hex digits long (checked by the arg schema)
+    if (args[1].present) 
     {
-        // Parse hex string to build bytes
-        uint8_t uuid[16];
-        if (Util_scanhex(argv[1], 16, uuid)!=16) 
-//        if (sscanf(argv[1], "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-//                    &uuid[0],&uuid[1],&uuid[2],&uuid[3],&uuid[4],&uuid[5],&uuid[6],&uuid[7],
-//                    &uuid[8],&uuid[9],&uuid[10],&uuid[11],&uuid[12],&uuid[13],&uuid[14],&uuid[15])!=16) 
-        {
-            // oops
-            wconsole_println(odev, "ERROR");
-            wconsole_println(odev, "Failed to parse UUID [%s]", argv[1]);
-            return ATCMD_BADARG;
-        }
-        
-        ibs_scan_set_uuid_filter(&uuid[0]);
+        ibs_scan_set_uuid_filter(args[1].uuid);
     }
     else
     {
         ibs_scan_set_uuid_filter(NULL);
     }
     
-    if (!ibs_scan_start((UART_TX_FN_T)odev)) 
+    // BLE links subscribe to the scan output, which goes to all those that asked for it
+    UART_TX_FN_T dest = (UART_TX_FN_T)odev;
+    if (comm_ble_scanSubscribe(dest, true)>0) {
+        if (ibs_is_scan_active()) {
+            return ATCMD_OK;        // already running, this link now gets the output too
+        }
+        dest = &comm_ble_scan_tx;
+    }
+    if (!ibs_scan_start(dest)) 
     {
+        comm_ble_scanSubscribe((UART_TX_FN_T)odev, false);
         return ATCMD_GENERR;
     }
     return ATCMD_OK;
 }
 
-static ATRESULT atcmd_stop_scan(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_stop_scan(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    // Keep scanning if other links still want it
+    if (comm_ble_scanSubscribe((UART_TX_FN_T)odev, false)>0) {
+        return ATCMD_OK;
+    }
     if (!ibs_scan_stop()) 
     {
         return ATCMD_GENERR;
@@ -557,92 +1266,196 @@ static ATRESULT atcmd_stop_scan(uint8_t nargs, char* argv[], void* odev) {
     return ATCMD_OK;
 }
 
-static ATRESULT atcmd_start_ib(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_start_ib(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     // set all the params from the args optionally
-    if (nargs==7) {
-        // AT_IB_START <uuid>,<major>,<minor>,<extrabyte>,<interval in ms>,<txpower>
-        // All values in hex
-        uint8_t uuid[16];
-        unsigned int major;
-        unsigned int minor;
-        unsigned int extra;
-        unsigned int interMS;
-        int txpower;
-        // any param can be ignored by making it empty eg AT+IB_START,,,,,,-10
-        if (Util_scanhex(argv[1], 16, uuid)==16) {
-            cfg_setUUID(uuid);
-        }
-        if (sscanf(argv[2], "%04x", &major)==1) {
-            cfg_setMajor_Value(major);
-        }
-        if (sscanf(argv[3], "%04x", &minor)==1) {
-            cfg_setMinor_Value(minor);
-        }
-        if (sscanf(argv[4], "%02x", &extra)==1) {
-            cfg_setExtra_Value(extra);
-        }
-        if (sscanf(argv[5], "%04x", &interMS)==1) {
-            cfg_setADV_IND(interMS);
-        }
-        if (sscanf(argv[6], "%d", &txpower)==1) {
-            cfg_setTXPOWER_Level(txpower);
-        }
+    // AT_IB_START <uuid>,<major>,<minor>,<extrabyte>,<interval in ms>,<txpower>
+    // All values in hex except txpower (decimal)
+    // any param can be ignored by making it empty eg AT+IB_START,,,,,,-10
+    if (args[1].present) {
+        cfg_setUUID(args[1].uuid);
+    }
+    if (args[2].present) {
+        cfg_setMajor_Value(args[2].v);
+    }
+    if (args[3].present) {
+        cfg_setMinor_Value(args[3].v);
+    }
+    if (args[4].present) {
+        cfg_setExtra_Value(args[4].v);
+    }
+    if (args[5].present) {
+        cfg_setADV_IND(args[5].v);
+    }
+    if (args[6].present) {
+        cfg_setTXPOWER_Level(args[6].v);
     }
     ibb_start();
     return ATCMD_OK;
 }
 
-static ATRESULT atcmd_stop_ib(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_stop_ib(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     ibb_stop();
     return ATCMD_OK;
 }
-static ATRESULT atcmd_enable_conn(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_enable_conn(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     cfg_setConnectable(true);
     return ATCMD_OK;
 }
-static ATRESULT atcmd_disable_conn(uint8_t nargs, char* argv[], void* odev) {
+static ATRESULT atcmd_disable_conn(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
     cfg_setConnectable(false);
     return ATCMD_OK;
 }
-static ATRESULT atcmd_debug_stats(uint8_t nargs, char* argv[], void* odev) {
-    comm_ble_print_stats(wconsole_println, odev);
-    comm_uart_print_stats(wconsole_println, odev);
+// One module's stats per item
+static bool at_gen_debug_stats(void* odev, int i) {
+    switch(i) {
+        case 0:
+            comm_ble_print_stats(wconsole_println, odev);
+            break;
+        case 1:
+            comm_uart_print_stats(wconsole_println, odev);
+            break;
+        case 2:
+            comm_l2cap_print_stats(wconsole_println, odev);
+            break;
+        case 3:
+            app_print_adv_stats(wconsole_println, odev);
+            break;
+        case 4:
+            app_print_batt_stats(wconsole_println, odev);
+            break;
+        case 5:
+            at_raw_print_stats(odev);       // last (or current) raw mode session
+            break;
+        case 6:
+            app_print_ram_stats(wconsole_println, odev);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+static ATRESULT atcmd_debug_stats(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    return (at_out_gen_start(odev, &at_gen_debug_stats) ? ATCMD_PROCESSED : ATCMD_GENERR);
+}
+// AT+RAW : same args as AT+CONN, but then all data is passed through as is (binary ok, no line length limit) until
+// the side that started it sends "+++" with 1s silence before and after. Throughput is shown on exit and in AT+D?
+static ATRESULT atcmd_raw(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    if (!_ctx.rawTimerCreated) {
+        if (app_timer_create(&m_raw_guard_timer, APP_TIMER_MODE_SINGLE_SHOT, at_raw_guard_timer_cb)!=NRF_SUCCESS) {
+            return ATCMD_GENERR;
+        }
+        _ctx.rawTimerCreated = true;
+    }
+    ATRESULT ret = atcmd_connect(nargs, argv, args, odev);
+    if (ret==ATCMD_OK) {
+        at_raw_start();
+    } else if (ret==ATCMD_PENDING) {
+        _ctx.rawOnConnect = true;       // when its connected
+    }
+    return ret;
+}
+// AT+BENCH,TX,<bytes>[,U|B] : send pattern data back to the requester, or to the uart / all the BLE links
+// AT+BENCH,RX,<bytes> : the requester sends the pattern, we check it. Ends when all seen or after a silence
+// AT+BENCH,STOP
+// Result line (BENCH:...) is sent to the requester at the end, see bench_print_stats()
+// Bad AT+BENCH args : say what was wrong and how it goes, as the requester is often at the far end of a link
+static ATRESULT at_bench_usage(void* odev, const char* what) {
+    at_send_status(odev, "ERROR");
+    wconsole_println(odev, "%s : AT+BENCH,TX,<bytes>[,U|B] / AT+BENCH,RX,<bytes> / AT+BENCH,STOP", what);
+    return ATCMD_BADARG;
+}
+static ATRESULT atcmd_bench(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    if (strncmp("STOP", args[1].s, 4)==0) {
+        bench_stop();
+        return ATCMD_OK;
+    }
+    if (strncmp("TX", args[1].s, 2)!=0 && strncmp("RX", args[1].s, 2)!=0) {
+        return at_bench_usage(odev, "Unknown mode");
+    }
+    if (!args[2].present || args[2].v<=0) {
+        return at_bench_usage(odev, "Byte count missing or 0");
+    }
+    if (strncmp("TX", args[1].s, 2)==0) {
+        UART_TX_FN_T dest = (UART_TX_FN_T)odev;
+        if (args[3].present) {
+            // Remote must be logged in to load up the other side
+            if (!authenticated(odev)) {
+                return ATCMD_GENERR;
+            }
+            if (args[3].s[0]=='U') {
+                dest = &comm_uart_tx;
+            } else if (args[3].s[0]=='B') {
+                dest = &comm_ble_tx;
+            } else {
+                return at_bench_usage(odev, "Bad destination");
+            }
+        }
+        return bench_tx_start(dest, args[2].v, wconsole_println, odev) ? ATCMD_OK : ATCMD_GENERR;
+    }
+    if (strncmp("RX", args[1].s, 2)==0) {
+        return bench_rx_start((UART_TX_FN_T)odev, args[2].v, wconsole_println, odev) ? ATCMD_OK : ATCMD_GENERR;
+    }
+    return at_bench_usage(odev, "Unknown mode");
+}
+static ATRESULT atcmd_bench_stats(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    bench_print_stats(wconsole_println, odev);
     return ATCMD_PROCESSED;
 }
-static ATRESULT atcmd_out(uint8_t nargs, char* argv[], void* odev) {
-    if (nargs<3) {
-        return ATCMD_GENERR;
+static ATRESULT atcmd_adv_policy(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    app_print_adv_policy(wconsole_println, odev);
+    return ATCMD_PROCESSED;
+}
+static void at_raw_start() {
+    _ctx.rawMode = true;
+    _ctx.rawPlus = 0;
+    _ctx.rawPlusFlush = false;
+    _ctx.rawGuardExpired = false;
+    _ctx.rawLastTick = app_timer_cnt_get();
+    // guard time starts now
+    _ctx.rawLastRx[0] = _ctx.rawLastTick;
+    _ctx.rawLastRx[1] = _ctx.rawLastTick;
+    _ctx.rawTicks = 0;
+    _ctx.rawBytes[0] = 0;
+    _ctx.rawBytes[1] = 0;
+}
+// AT+PIPE,<0|1> : set if a ';' separated command line stops at the first failing command (1) or runs them all (0)
+// Without arg, returns current setting
+static ATRESULT atcmd_pipe(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    if (!args[1].present) {
+        wconsole_println(odev, "%d", _ctx.pipeAbortOnError?1:0);
+        return ATCMD_PROCESSED;
     }
-    int pin = atoi(argv[1]);
-    if( argv[2][0]=='0') {
+    _ctx.pipeAbortOnError = (args[1].v!=0);
+    return ATCMD_OK;
+}
+static ATRESULT atcmd_out(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    int pin = args[1].v;
+    if (args[2].v==0) {
         nrf_drv_gpiote_out_clear(pin);
     } else {
         nrf_drv_gpiote_out_set(pin);
     }
     return ATCMD_OK;
 }
-static ATRESULT atcmd_in(uint8_t nargs, char* argv[], void* odev) {
-    if (nargs<2) {
-        return ATCMD_GENERR;
-    }
-    int pin = atoi(argv[1]);
+static ATRESULT atcmd_in(uint8_t nargs, char* argv[], ATARG_t* args, void* odev) {
+    int pin = args[1].v;
     wconsole_println(odev, "Input[%d] is [%s]", pin, nrf_drv_gpiote_in_is_set(pin)?"HIGH":"LOW");
     wconsole_println(odev, "%d", nrf_drv_gpiote_in_is_set(pin)?1:0);
     return ATCMD_PROCESSED;
 }
 
 // internal processing
+// Each line goes into the output ring, and is sent from there as the destination can take it
 static bool wconsole_println(void* dev, const char* l, ...) {
     UART_TX_FN_T utx_fn = (UART_TX_FN_T)dev;
     bool ret = true;
     va_list vl;
     va_start(vl, l);
     _ctx.txbuf[0] = '+';        // All AT response lines MUST start with a "+"
-    vsprintf((char*)&_ctx.txbuf[1], l, vl);     // response goes in at offset 1
-    int len = strlen((const char*)&_ctx.txbuf[0]);  //, MAX_TXSZ);        why no strnlen in gcc libc??
-    if (len>=MAX_TXSZ) {
-        // oops might just have broken stuff...
-        len = MAX_TXSZ-1;
+    int len = 1+vsnprintf((char*)&_ctx.txbuf[1], MAX_TXSZ, l, vl);     // response goes in at offset 1
+    if (len>MAX_TXSZ) {
+        // line was truncated
+        len = MAX_TXSZ;
         ret = false;        // caller knows there was an issue
     }
     _ctx.txbuf[len]='\n';
@@ -650,14 +1463,10 @@ static bool wconsole_println(void* dev, const char* l, ...) {
     _ctx.txbuf[len+2]=0;
     len+=2;     // Don't send the null byte!
     if (utx_fn!=NULL) {
-        int res = (*utx_fn)(&_ctx.txbuf[0], len, NULL);
-        if (res!=0) {       // Error or flow control
-            _ctx.txbuf[0] = '*';
-            (*utx_fn)(&_ctx.txbuf[0], 1, NULL);      // so user knows he missed something.
+        if (!at_out_line(utx_fn, &_ctx.txbuf[0], len)) {
             ret = false;        // caller knows there was an issue
-            // Not dealing with tx ready upcalls just now
-           log_noout_fn("console write FAIL %d", res);      // just for debugger to watch
-       }
+        }
+        at_process_pump();
     } else {
         ret = false;        // caller knows there was an issue
         log_noout_fn("console write no open uart");      // just for debugger to watch
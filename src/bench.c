@@ -0,0 +1,197 @@
+/* bench.c : on-device throughput benchmark (AT+BENCH). Sends a known pattern to the uart or the BLE links, or checks one
+ * received from them, and reports the rate achieved. Runs from the main loop like the rest of the data path.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "bsp_minew_nrf52.h"
+#include "ble.h"
+#include "app_timer.h"
+
+#include "wutils.h"
+
+#include "main.h"
+#include "comm_ble.h"
+#include "bench.h"
+
+#define BENCH_CHUNK         (NRF_SDH_BLE_GATT_MAX_MTU_SIZE-3)   // a full notification at the biggest MTU
+#define BENCH_MAX_CHUNKS    (4)             // per main loop pass, so the rest of the loop still gets a look in
+#define BENCH_PERIOD        (251)           // pattern byte is its index modulo this (prime, so lost blocks show as a jump)
+#define BENCH_START_MS      (10000)         // sink gives up if the first byte takes longer than this
+#define BENCH_IDLE_MS       (2000)          // or if data stops for this long
+
+typedef enum { BENCH_NONE=0, BENCH_TX, BENCH_RX } BENCH_MODE_t;
+
+static struct {
+    BENCH_MODE_t mode;                  // of the current or last run
+    bool running;
+    bool aborted;                       // tx destination went away, or stopped by AT+BENCH,STOP
+    UART_TX_FN_T dev;                   // destination (tx) or source (rx)
+    PRINTF_FN_T printf;                 // where the result goes
+    void* odev;
+    uint32_t total;                     // bytes asked for
+    uint32_t done;                      // sent (tx) or received ok (rx)
+    uint32_t retries;                   // tx chunks the transport refused (all or part of) and we had to offer again
+    uint32_t drops;                     // rx bytes missing from the pattern
+    uint32_t gaps;                      // and how many times it jumped
+    uint8_t next;                       // rx : pattern byte expected next
+    bool started;                       // rx : first byte seen
+    uint32_t lastTick;
+    uint32_t ticks;                     // run time
+    uint32_t notifs;                    // BLE notifications at start, then sent during the run
+    uint8_t buf[BENCH_CHUNK];
+} _ctx;
+
+static void bench_end(bool aborted);
+
+bool bench_tx_start(UART_TX_FN_T dest, uint32_t nbytes, PRINTF_FN_T printf, void* odev) {
+    if (_ctx.running || dest==NULL || nbytes==0) {
+        return false;
+    }
+    memset(&_ctx, 0, sizeof(_ctx));
+    _ctx.mode = BENCH_TX;
+    _ctx.dev = dest;
+    _ctx.total = nbytes;
+    _ctx.printf = printf;
+    _ctx.odev = odev;
+    _ctx.notifs = comm_ble_nbNotifs();
+    _ctx.lastTick = app_timer_cnt_get();
+    _ctx.running = true;
+    log_info("bench:tx %d bytes", nbytes);
+    return true;
+}
+
+bool bench_rx_start(UART_TX_FN_T source, uint32_t nbytes, PRINTF_FN_T printf, void* odev) {
+    if (_ctx.running || source==NULL || nbytes==0) {
+        return false;
+    }
+    memset(&_ctx, 0, sizeof(_ctx));
+    _ctx.mode = BENCH_RX;
+    _ctx.dev = source;
+    _ctx.total = nbytes;
+    _ctx.printf = printf;
+    _ctx.odev = odev;
+    _ctx.lastTick = app_timer_cnt_get();
+    _ctx.running = true;
+    log_info("bench:rx %d bytes", nbytes);
+    return true;
+}
+
+void bench_stop(void) {
+    if (_ctx.running) {
+        bench_end(true);
+    }
+}
+
+bool bench_isSink(UART_TX_FN_T source) {
+    return (_ctx.running && _ctx.mode==BENCH_RX && (source==NULL || source==_ctx.dev));
+}
+
+// Check the pattern : a byte that isn't the one expected means the ones in between were lost (modulo the pattern period)
+int bench_sinkInput(uint8_t* data, int len) {
+    if (!bench_isSink(NULL)) {
+        return 0;
+    }
+    uint32_t now = app_timer_cnt_get();
+    if (_ctx.started) {
+        _ctx.ticks += app_timer_cnt_diff_compute(now, _ctx.lastTick);
+    }
+    _ctx.started = true;
+    _ctx.lastTick = now;
+    for(int i=0;i<len;i++) {
+        if (data[i]!=_ctx.next) {
+            _ctx.gaps++;
+            _ctx.drops += (data[i]+BENCH_PERIOD-_ctx.next) % BENCH_PERIOD;
+        }
+        _ctx.done++;
+        _ctx.next = (data[i]+1) % BENCH_PERIOD;
+    }
+    if ((_ctx.done+_ctx.drops)>=_ctx.total) {
+        bench_end(false);
+    }
+    return 0;
+}
+
+void bench_process(void) {
+    if (!_ctx.running) {
+        return;
+    }
+    uint32_t now = app_timer_cnt_get();
+    if (_ctx.mode==BENCH_RX) {
+        uint32_t wait = app_timer_cnt_diff_compute(now, _ctx.lastTick);
+        if (wait >= APP_TIMER_TICKS(_ctx.started ? BENCH_IDLE_MS : BENCH_START_MS)) {
+            log_info("bench:rx timeout");
+            bench_end(false);
+        }
+        return;
+    }
+    _ctx.ticks += app_timer_cnt_diff_compute(now, _ctx.lastTick);
+    _ctx.lastTick = now;
+    for(int c=0;c<BENCH_MAX_CHUNKS && _ctx.done<_ctx.total;c++) {
+        int n = BENCH_CHUNK;
+        if (n>(_ctx.total-_ctx.done)) {
+            n = _ctx.total-_ctx.done;
+        }
+        uint8_t p = _ctx.done % BENCH_PERIOD;
+        for(int i=0;i<n;i++) {
+            _ctx.buf[i] = p;
+            if (++p>=BENCH_PERIOD) {
+                p = 0;
+            }
+        }
+        // No tx_ready : the event that frees space also wakes the main loop which brings us back here
+        int res = (*_ctx.dev)(&_ctx.buf[0], n, NULL);
+        if (res<0) {
+            log_warn("bench:tx destination gone");
+            bench_end(true);
+            return;
+        }
+        _ctx.done += (n-res);
+        if (res>0) {
+            _ctx.retries++;
+            break;
+        }
+    }
+    if (_ctx.done>=_ctx.total) {
+        // rate is for the data the transport has accepted : use a size well above its queue (1KB for BLE)
+        (*_ctx.dev)((uint8_t*)"", 0, NULL);
+        bench_end(false);
+    }
+}
+
+static void bench_end(bool aborted) {
+    _ctx.running = false;
+    _ctx.aborted = aborted;
+    if (_ctx.mode==BENCH_TX) {
+        _ctx.notifs = comm_ble_nbNotifs()-_ctx.notifs;
+    }
+    if (_ctx.printf!=NULL) {
+        bench_print_stats(_ctx.printf, _ctx.odev);
+    }
+}
+
+// BENCH:<TX|RX>,<bytes>,<ms>,<bytes/s>,<notifications per conn event>,<retries>,<drops>,<gaps>[,ABORTED|,RUN]
+void bench_print_stats(PRINTF_FN_T printf, void* odev) {
+    if (_ctx.mode==BENCH_NONE) {
+        (*printf)(odev, "BENCH:none");
+        return;
+    }
+    uint32_t ms = (uint32_t)(((uint64_t)_ctx.ticks*1000)/APP_TIMER_TICKS_PER_SEC);
+    if (ms==0) {
+        ms = 1;
+    }
+    // Notifications per connection event (x100), when the destination is BLE. Interval is in 1.25ms units.
+    uint32_t npe = 0;
+    uint32_t notifs = (_ctx.running ? comm_ble_nbNotifs()-_ctx.notifs : _ctx.notifs);
+    uint16_t ci = (_ctx.mode==BENCH_TX ? comm_ble_connInterval(_ctx.dev) : 0);
+    if (ci>0) {
+        uint32_t events = (ms*4)/(ci*5);
+        if (events>0) {
+            npe = (notifs*100)/events;
+        }
+    }
+    (*printf)(odev, "BENCH:%s,%d,%d,%d,%d.%02d,%d,%d,%d%s", (_ctx.mode==BENCH_TX ? "TX" : "RX"), _ctx.done, ms,
+                (uint32_t)(((uint64_t)_ctx.done*1000)/ms), npe/100, npe%100, _ctx.retries, _ctx.drops, _ctx.gaps,
+                (_ctx.running ? ",RUN" : (_ctx.aborted ? ",ABORTED" : "")));
+}
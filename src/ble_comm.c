@@ -1,60 +1,273 @@
 /* ble_comm.c : handle the BLE UART emulation used for the communication with remote BLE ie AT commands
  */
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
 
 #include "bsp_minew_nrf52.h"
-//#include "ble_nus_c.h"
+#include "ble_nus_c.h"
 #include "ble_nus.h"
 //#include "ble_hci.h"
-//#include "ble_db_discovery.h"
+#include "ble_db_discovery.h"
+#include "nrf_ble_gq.h"
 #include "nrf_delay.h"
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "app_fifo.h"
+#include "ble_conn_state.h"
+#include "ble_link_ctx_manager.h"
+#include "nrf_sdh_ble.h"
 
 #include "wutils.h"
 
 #include "main.h"
 #include "at_process.h"
 #include "comm_ble.h"
+#include "device_config.h"
 
-#define MAX_RX_LINE (60)
+#define MAX_RX_LINE (250)       // room for several ';' separated commands on 1 line, and more than a full notification (MTU-3)
+#define RX_FIFO_SIZE (512)      // per link. MUST BE POWER OF 2. Data received, waiting for main loop
+// TX queue (per link) for data the softdevice can't take yet. Size MUST BE POWER OF 2. Watermarks can be set in app_config.h
+#ifndef BLE_TXQ_SIZE
+#define BLE_TXQ_SIZE (1024)
+#endif
+#ifndef BLE_TXQ_HIGH_WM
+#define BLE_TXQ_HIGH_WM (BLE_TXQ_SIZE-256)      // refuse more data above this
+#endif
+#ifndef BLE_TXQ_LOW_WM
+#define BLE_TXQ_LOW_WM (256)                    // and accept it again (calling tx_ready) when below this
+#endif
+#define TXQ_COUNT(l) ((uint16_t)((l)->txqHead-(l)->txqTail))
+// Links are indexed by their ble_conn_state index, so there is a slot for every connection the softdevice can have
+#define MAX_LINKS (NRF_SDH_BLE_TOTAL_LINK_COUNT)
+// Which links the same data goes to
+typedef enum { BLE_TO_ALL, BLE_TO_SCANSUBS, BLE_TO_SESSION } BLE_FANOUT_t;
 
-// NUS hooks observer for BLE events itself
-BLE_NUS_DEF(m_nus, NRF_SDH_BLE_TOTAL_LINK_COUNT);                                   /**< BLE NUS service instance. */
+#define APP_BLE_OBSERVER_PRIO           3                                           /**< Application's BLE observer priority. You shouldn't need to modify this value. */
 
-static struct {
-    bool connected;
+// Central role (AT+CONN,NS) : we connect to a remote NUS server
+#define NUSC_SCAN_INTERVAL              0x00A0                                      /**< Scan interval while connecting (units of 0.625 ms) */
+#define NUSC_SCAN_WINDOW                0x0050                                      /**< Scan window while connecting (units of 0.625 ms) */
+#define NUSC_CONNECT_TIMEOUT            MSEC_TO_UNITS(5000, UNIT_10_MS)             /**< Give up if remote not seen in this time */
+#define NUSC_MIN_CONN_INTERVAL          MSEC_TO_UNITS(7.5, UNIT_1_25_MS)            /**< We are the central : go straight for the throughput profile */
+#define NUSC_MAX_CONN_INTERVAL          MSEC_TO_UNITS(15, UNIT_1_25_MS)
+#define NUSC_CONN_SUP_TIMEOUT           MSEC_TO_UNITS(4000, UNIT_10_MS)
+#define NUSC_HANDLE_CACHE_SZ            (4)                                         /**< Remotes whose NUS handles we remember, to skip discovery on reconnect */
+// Connection parameter manager : links with no NUS traffic for a while go to the idle (low power) profile
+#define CP_TICK_MS                      (1000)                                      /**< Traffic is checked this often */
+#define CP_IDLE_TICKS                   (5)                                         /**< Ticks without traffic before going idle */
+#define NUSC_GQ_SIZE                    (4)                                         /**< GATT queue (discovery and CCCD write only, data goes direct) */
+// Connection tx power : keep our signal at the remote in a window, estimated as our tx power + the rssi we measure from it
+// (the path loss is the same both ways, and remotes transmit at about 0dBm). The window is wider than the biggest step so a
+// step can't cross it, and the hold lets the filtered rssi settle on the new level before the next one.
+#define PWR_RSSI_THRESHOLD_DBM          (2)                                         /**< RSSI change events when it moves this much */
+#define PWR_RSSI_SKIP                   (4)                                         /**< and has stayed moved for this many samples */
+#define PWR_TARGET_LOW_DBM              (-80)                                       /**< Step up below this */
+#define PWR_TARGET_HIGH_DBM             (-65)                                       /**< Step down above this */
+#define PWR_HOLD_TICKS                  (3)                                         /**< CP ticks between steps */
+
+// Context of 1 NUS link. Lives in the link context manager storage, found by conn handle
+typedef struct {
+    bool connected;                     // remote has enabled notifications (or we have on the remote NUS server), we can send
+    bool central;                       // we are the central (and remote is the NUS server) : data goes by write commands
+    uint16_t nus_rx_handle;             // when central, handle of the remote's NUS RX characteristic
     uint16_t conn_handle;
-    uint16_t   m_ble_nus_max_data_len;
+    uint8_t slot;                       // our index for it (ble_conn_state index)
+    UART_TX_FN_T txfn;                  // tx fn the at processor uses for this link (so responses go back to it)
+    bool scanSub;                       // wants scan output
+    bool inSession;                     // one of the remotes of the uart passthru to the links (AT+CONN,NC)
+    uint16_t max_data_len;
+    uint16_t connInterval;              // current, in 1.25ms units
+    app_fifo_t rx_fifo;
+    uint8_t rx_fifo_buf[RX_FIFO_SIZE];
     uint8_t rx_buf[MAX_RX_LINE];
-    uint8_t rx_index;
+    uint16_t rx_index;
+    uint32_t cpBytes;                   // rx+tx bytes since last conn params manager tick
+    uint8_t cpIdleTicks;                // ticks with no traffic
+    APP_CONN_PROFILE_t cpProfile;       // profile last asked for
+    uint8_t cpRefused;                  // bit per profile the central would not take : not asked for again on this link
+    int8_t txPower;                     // connection tx power (dBm) set for this link
+    int8_t rssi;                        // filtered rssi of the remote (0 : none reported yet)
+    uint8_t pwrHoldTicks;               // before the next power step is allowed
     UART_TX_READY_FN_T tx_ready_fn;     // in case caller wants to be told
+    uint8_t txq[BLE_TXQ_SIZE];
+    volatile uint16_t txqHead;          // free running write index (added by comm_ble_tx())
+    volatile uint16_t txqTail;          // free running read index (removed when sent on TX_RDY)
+    volatile bool txqBlocked;           // above high watermark, producer must wait for tx_ready
+    volatile bool flushDue;             // coalescing delay is up (or flush asked) : send partial notifications too
+} ble_link_t;
+
+// Timer to flush coalesced small writes
+APP_TIMER_DEF(m_ble_flush_timer);
+// Timer for the connection parameter manager
+APP_TIMER_DEF(m_ble_cp_timer);
+
+// NUS hooks observer for BLE events itself
+BLE_NUS_DEF(m_nus, NRF_SDH_BLE_TOTAL_LINK_COUNT);                                   /**< BLE NUS service instance. */
+BLE_LINK_CTX_MANAGER_DEF(m_links, MAX_LINKS, sizeof(ble_link_t));                   /**< Our per link contexts */
+// NUS client for the central role, and what it needs to find the service on the remote
+BLE_NUS_C_DEF(m_nus_c);
+BLE_DB_DISCOVERY_DEF(m_db_disc);
+NRF_BLE_GQ_DEF(m_gatt_queue, NRF_SDH_BLE_CENTRAL_LINK_COUNT, NUSC_GQ_SIZE);
+
+// And we watch connections come and go ourselves to setup/close the link contexts
+static void comm_ble_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context);
+NRF_SDH_BLE_OBSERVER(m_ble_comm_observer, APP_BLE_OBSERVER_PRIO, comm_ble_on_ble_evt, NULL);
+
+static struct {
+    uint16_t linkHandle[MAX_LINKS];     // conn handle using each link slot, or BLE_CONN_HANDLE_INVALID
+    volatile bool discReq[MAX_LINKS];   // remote disconnected, tell at processor from main loop
+    // central role
+    ble_gap_addr_t nuscAddr;            // remote we are connecting to
+    uint16_t nuscHandle;                // its conn handle once connected
+    bool nuscConnecting;                // from sd_ble_gap_connect() until connected+discovered, or failed
+    bool nuscUsedCache;                 // handles came from the cache (and must be dropped if they turn out wrong)
+    volatile bool nuscDone;             // result is in, tell caller from main loop
+    volatile bool nuscOk;
+    COMM_BLE_CONN_FN_T nuscDoneFn;
+    struct {
+        bool valid;
+        uint8_t addr[BLE_GAP_ADDR_LEN];
+        ble_nus_c_handles_t handles;
+    } nuscCache[NUSC_HANDLE_CACHE_SZ];
+    uint8_t nuscCacheNext;              // round robin replacement
+    volatile bool flushTimerOn;
+    bool cpTimerOn;                     // conn params (and tx power) tick runs while there are links
+    bool throughput;                    // passthru wants the fast profile while there is traffic
+    uint32_t cpReq;                     // conn param updates we asked for
+    uint32_t cpFail;                    // and that couldn't be asked (retried next tick)
+    uint32_t cpRefused;                 // and that the central refused
+    uint32_t cpUpd;                     // updates done (by us or the central)
+    uint32_t pwrUp;                     // connection tx power steps up
+    uint32_t pwrDown;                   // and down
+    uint32_t txN;                       // number of notifications sent
+    uint32_t rxO;                       // rx bytes lost as main loop didn't process them fast enough
     uint32_t rxC;
     uint32_t rxL;
     uint32_t txC;
     uint32_t txL;
     uint32_t txLfc;
     uint32_t txLemp;
-} _ctx = {
-    .m_ble_nus_max_data_len = BLE_GATT_ATT_MTU_DEFAULT - 3
-};
+} _ctx;
 
 // predecs
 static void comm_ble_nus_data_handler(ble_nus_evt_t * p_evt);
+static ble_link_t* comm_ble_link(uint16_t conn_handle);
+static ble_link_t* comm_ble_link_slot(int slot);
+static void comm_ble_link_disconnect(ble_link_t* l);
+static void comm_ble_link_processRX(ble_link_t* l);
+static int comm_ble_link_tx(ble_link_t* l, uint8_t* data, int len, UART_TX_READY_FN_T tx_ready);
+static int comm_ble_fanout(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready, BLE_FANOUT_t to);
+static int comm_ble_send(ble_link_t* l, uint8_t* data, int len);
+static void comm_ble_txq_drain(ble_link_t* l);
+static void comm_ble_flush_timer_cb(void* p_context);
+static void comm_ble_txq_reset(ble_link_t* l);
+static void comm_ble_nusc_evt_handler(ble_nus_c_t* p_ble_nus_c, ble_nus_c_evt_t const* p_evt);
+static void comm_ble_nusc_error_handler(uint32_t nrf_error);
+static void comm_ble_db_disc_handler(ble_db_discovery_evt_t* p_evt);
+static void comm_ble_nusc_result(bool ok);
+static void comm_ble_cp_timer_cb(void* p_context);
+static void comm_ble_pwr_start(ble_link_t* l);
+static void comm_ble_pwr_tick(ble_link_t* l);
+static void comm_ble_cp_traffic(ble_link_t* l);
+static void comm_ble_cp_set(ble_link_t* l, APP_CONN_PROFILE_t p);
+
+// Each link slot has its own tx fn, so the at processor can tell the links apart and send responses to the right one
+static int comm_ble_tx0(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    return comm_ble_link_tx(comm_ble_link_slot(0), data, len, tx_ready);
+}
+static int comm_ble_tx1(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    return comm_ble_link_tx(comm_ble_link_slot(1), data, len, tx_ready);
+}
+static int comm_ble_tx2(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    return comm_ble_link_tx(comm_ble_link_slot(2), data, len, tx_ready);
+}
+static int comm_ble_tx3(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    return comm_ble_link_tx(comm_ble_link_slot(3), data, len, tx_ready);
+}
+static const UART_TX_FN_T _linkTx[] = { &comm_ble_tx0, &comm_ble_tx1, &comm_ble_tx2, &comm_ble_tx3 };
+STATIC_ASSERT(MAX_LINKS <= (sizeof(_linkTx)/sizeof(_linkTx[0])));
 
 /**@brief Function for initializing the BLE as a NUS slave (remote connects to me) and a NUS cient.
- * NUS client not yet supported
  */
 uint32_t comm_ble_init(void) {
     ble_nus_init_t nus_init;
+    ble_nus_c_init_t nus_c_init;
+    ble_db_discovery_init_t db_init;
  
-    _ctx.connected = false;
-    _ctx.conn_handle=BLE_CONN_HANDLE_INVALID;
+    for(int i=0;i<MAX_LINKS;i++) {
+        _ctx.linkHandle[i] = BLE_CONN_HANDLE_INVALID;
+    }
+    _ctx.nuscHandle = BLE_CONN_HANDLE_INVALID;
 
+    uint32_t err_code = app_timer_create(&m_ble_flush_timer, APP_TIMER_MODE_SINGLE_SHOT, comm_ble_flush_timer_cb);
+    if (err_code!=NRF_SUCCESS) {
+        return err_code;
+    }
+    err_code = app_timer_create(&m_ble_cp_timer, APP_TIMER_MODE_REPEATED, comm_ble_cp_timer_cb);
+    if (err_code!=NRF_SUCCESS) {
+        return err_code;
+    }
+    // cp timer only runs while there are links (started on the first connect), so an unconnected device isn't woken for it
     memset(&nus_init, 0, sizeof(nus_init)); 
     nus_init.data_handler = comm_ble_nus_data_handler;
     log_info("Init NUS service..");
-    return ble_nus_init(&m_nus, &nus_init);
+    err_code = ble_nus_init(&m_nus, &nus_init);
+    if (err_code!=NRF_SUCCESS) {
+        return err_code;
+    }
+    // Client side : discovery must be ready before the NUS client registers its service with it
+    log_info("Init NUS client..");
+    memset(&db_init, 0, sizeof(db_init));
+    db_init.evt_handler = comm_ble_db_disc_handler;
+    db_init.p_gatt_queue = &m_gatt_queue;
+    err_code = ble_db_discovery_init(&db_init);
+    if (err_code!=NRF_SUCCESS) {
+        return err_code;
+    }
+    memset(&nus_c_init, 0, sizeof(nus_c_init));
+    nus_c_init.evt_handler = comm_ble_nusc_evt_handler;
+    nus_c_init.error_handler = comm_ble_nusc_error_handler;
+    nus_c_init.p_gatt_queue = &m_gatt_queue;
+    return ble_nus_c_init(&m_nus_c, &nus_c_init);
+}
+
+// Connect as central to the NUS server at addr (6 bytes, in the order they are shown by the scan). done is called from the main
+// loop with the tx fn of the new link, or NULL if it failed. Returns false if connecting can't be started.
+bool comm_ble_central_connect(const uint8_t* addr, bool publicAddr, COMM_BLE_CONN_FN_T done) {
+    if (_ctx.nuscConnecting || _ctx.nuscHandle!=BLE_CONN_HANDLE_INVALID) {
+        log_warn("nusc:already connecting/connected");
+        return false;
+    }
+    memset(&_ctx.nuscAddr, 0, sizeof(_ctx.nuscAddr));
+    _ctx.nuscAddr.addr_type = (publicAddr ? BLE_GAP_ADDR_TYPE_PUBLIC : BLE_GAP_ADDR_TYPE_RANDOM_STATIC);
+    memcpy(&_ctx.nuscAddr.addr[0], addr, BLE_GAP_ADDR_LEN);
+    ble_gap_scan_params_t scan_params = {
+        .active = 0,
+        .interval = NUSC_SCAN_INTERVAL,
+        .window = NUSC_SCAN_WINDOW,
+        .timeout = NUSC_CONNECT_TIMEOUT,
+        .scan_phys = BLE_GAP_PHY_1MBPS,
+        .filter_policy = BLE_GAP_SCAN_FP_ACCEPT_ALL,
+    };
+    ble_gap_conn_params_t conn_params = {
+        .min_conn_interval = NUSC_MIN_CONN_INTERVAL,
+        .max_conn_interval = NUSC_MAX_CONN_INTERVAL,
+        .slave_latency = 0,
+        .conn_sup_timeout = NUSC_CONN_SUP_TIMEOUT,
+    };
+    _ctx.nuscDoneFn = done;
+    _ctx.nuscDone = false;
+    _ctx.nuscConnecting = true;
+    // Fails if we are scanning (ibeacon scan must be stopped first)
+    uint32_t err_code = sd_ble_gap_connect(&_ctx.nuscAddr, &scan_params, &conn_params, APP_BLE_CONN_CFG_TAG);
+    if (err_code!=NRF_SUCCESS) {
+        log_warn("nusc:connect failed %d", err_code);
+        _ctx.nuscConnecting = false;
+        return false;
+    }
+    return true;
 }
 
 void comm_ble_getuuid(ble_uuid_t* p_uuid) {
@@ -62,108 +275,869 @@ void comm_ble_getuuid(ble_uuid_t* p_uuid) {
     p_uuid->uuid = BLE_UUID_NUS_SERVICE;
 }
 
-// Remote connect
+// Remote enabled notifications : we can send to it
 void comm_ble_remote_connected(uint16_t conn_handle) {
     log_info("nus:connect");
-    if (_ctx.connected==true) {
-        // we can only handle 1 cnx at a time, drop the apparently existing one
-        comm_ble_local_disconnected();
+    ble_link_t* l = comm_ble_link(conn_handle);
+    if (l==NULL) {
+        return;
     }
-    _ctx.connected = true;
-    _ctx.conn_handle = conn_handle;
-    _ctx.rx_index = 0;      // just in case
+    l->connected = true;
+    comm_ble_txq_reset(l);
 }
 // NUS tells us we have been disconnected
 void comm_ble_remote_disconnected(uint16_t conn_handle) {
     log_info("nus:remote disconnect");
-    // Tell at cmd processor by sending disc at command
-    at_process_input("AT+DISC", &comm_ble_tx);
-    _ctx.connected = false;
-    _ctx.conn_handle = BLE_CONN_HANDLE_INVALID;
-    _ctx.tx_ready_fn = NULL;
-    _ctx.rx_index = 0;
-}
-// Our end wants to disconnect
+    ble_link_t* l = comm_ble_link(conn_handle);
+    if (l==NULL) {
+        return;
+    }
+    // at cmd processor is told from main loop (may be in softdevice event context here)
+    _ctx.discReq[l->slot] = true;
+    l->connected = false;
+    l->tx_ready_fn = NULL;
+    comm_ble_txq_reset(l);
+}
+// Our end wants to disconnect : all the links
 void comm_ble_local_disconnected(void) {
-    log_info("nus:local disconnect");
-    // Seems a little brutual to break its connection but there you go?
-    if (_ctx.conn_handle!=BLE_CONN_HANDLE_INVALID) {
-        uint32_t err_code = sd_ble_gap_disconnect(_ctx.conn_handle,
-                                     BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-        if (err_code != NRF_ERROR_INVALID_STATE)
-        {
-            APP_ERROR_CHECK(err_code);
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL) {
+            comm_ble_link_disconnect(l);
         }
-   }
-    _ctx.conn_handle=BLE_CONN_HANDLE_INVALID;
-    _ctx.connected = false;
-    _ctx.tx_ready_fn = NULL;
-    _ctx.rx_index = 0;
+    }
 }
 
-void comm_ble_set_max_data_len(uint16_t ml) {
-    _ctx.m_ble_nus_max_data_len = ml;
+void comm_ble_set_max_data_len(uint16_t conn_handle, uint16_t ml) {
+    ble_link_t* l = comm_ble_link(conn_handle);
+    if (l!=NULL) {
+        l->max_data_len = ml;
+    }
 }
-// are we currently connected?
+// are we currently connected (to any remote NUS client)?
 bool comm_ble_isConnected() {
-    return _ctx.connected;
+    return (comm_ble_nbLinks()>0);
+}
+// number of remotes currently connected
+int comm_ble_nbLinks() {
+    int n = 0;
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL && l->connected && !l->central) {
+            n++;
+        }
+    }
+    return n;
+}
+// Is this the tx fn of one of our links?
+bool comm_ble_isLink(UART_TX_FN_T txfn) {
+    for(int i=0;i<MAX_LINKS;i++) {
+        if (_linkTx[i]==txfn) {
+            return true;
+        }
+    }
+    return false;
+}
+// Passthru from the uart to the links (AT+CONN,NC) : the remote NUS clients connected now, other than the one asking, take part.
+// Returns how many do. Links that connect later, and the others, carry on with their own AT commands.
+int comm_ble_session_start(UART_TX_FN_T requester) {
+    int n = 0;
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL) {
+            l->inSession = (l->connected && !l->central && l->txfn!=requester);
+            if (l->inSession) {
+                n++;
+            }
+        }
+    }
+    return n;
+}
+// Passthru is over : the links stay connected
+void comm_ble_session_end(void) {
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL) {
+            l->inSession = false;
+        }
+    }
+}
+bool comm_ble_inSession(UART_TX_FN_T txfn) {
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL && l->inSession && l->txfn==txfn) {
+            return true;
+        }
+    }
+    return false;
+}
+// Connection interval (1.25ms units) of the link with this tx fn, or of the first peripheral link for comm_ble_tx. 0 if not connected
+uint16_t comm_ble_connInterval(UART_TX_FN_T txfn) {
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL && l->connected && (l->txfn==txfn || (txfn==&comm_ble_tx && !l->central))) {
+            return l->connInterval;
+        }
+    }
+    return 0;
+}
+// Traffic on the connection that didn't go through the NUS (eg L2CAP channel) : keeps the link out of the idle profile
+void comm_ble_linkTraffic(uint16_t conn_handle, uint32_t bytes) {
+    ble_link_t* l = comm_ble_link(conn_handle);
+    if (l!=NULL && bytes>0) {
+        l->cpBytes += bytes;
+        comm_ble_cp_traffic(l);
+    }
+}
+// Notifications (and write commands when central) sent on all links since boot
+uint32_t comm_ble_nbNotifs(void) {
+    return _ctx.txN;
+}
+uint32_t comm_ble_nbRxLost(void) {
+    return _ctx.rxO;
+}
+// (Un)subscribe the link with this tx fn to scan output (sent via comm_ble_scan_tx()).
+// Returns number of links now subscribed, or -1 if its not one of our links.
+int comm_ble_scanSubscribe(UART_TX_FN_T txfn, bool on) {
+    if (!comm_ble_isLink(txfn)) {
+        return -1;
+    }
+    int n = 0;
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL) {
+            if (_linkTx[i]==txfn) {
+                l->scanSub = on;
+            }
+            if (l->scanSub) {
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+// Call this from main loop to process data received over NUS on each link : as lines for the at processor, or as is in raw mode
+void comm_ble_processRX() {
+    if (_ctx.nuscDone) {
+        _ctx.nuscDone = false;
+        if (_ctx.nuscDoneFn!=NULL) {
+            ble_link_t* l = comm_ble_link(_ctx.nuscHandle);
+            (*_ctx.nuscDoneFn)((_ctx.nuscOk && l!=NULL) ? l->txfn : NULL);
+        }
+    }
+    for(int i=0;i<MAX_LINKS;i++) {
+        if (_ctx.discReq[i]) {
+            _ctx.discReq[i] = false;
+            // Tell at cmd processor by sending disc at command
+            at_process_input("AT+DISC", _linkTx[i]);
+            continue;
+        }
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL) {
+            comm_ble_link_processRX(l);
+        }
+    }
+}
+
+static void comm_ble_link_processRX(ble_link_t* l) {
+    if (at_process_isRaw(l->txfn)) {
+        // Raw mode : top up the line buffer and give it all to the other side, keeping what it couldn't take for next time
+        uint32_t n = MAX_RX_LINE-l->rx_index;
+        if (app_fifo_read(&l->rx_fifo, &l->rx_buf[l->rx_index], &n)==NRF_SUCCESS) {
+            l->rx_index += n;
+            _ctx.rxC += n;
+        }
+        if (l->rx_index>0) {
+            int left = at_process_rawInput(&l->rx_buf[0], l->rx_index, l->txfn);
+            if (left>0) {
+                memmove(&l->rx_buf[0], &l->rx_buf[l->rx_index-left], left);
+                l->rx_index = left;
+            } else {
+                l->rx_index = 0;
+            }
+        }
+        return;
+    }
+    // rest of the input waits in the fifo while the at processor's output is backed up
+    while(at_process_outReady() && app_fifo_get(&l->rx_fifo, &l->rx_buf[l->rx_index])==NRF_SUCCESS) {
+        // Don't take nulls
+        if (l->rx_buf[l->rx_index]!=0) {
+            _ctx.rxC++;
+            if( (l->rx_buf[l->rx_index] == '\r') || (l->rx_buf[l->rx_index] == '\n') || (l->rx_index >= (MAX_RX_LINE-2)) )
+            {
+                // Don't process empty lines (eg the \n from people who do "<blah>\r\n" -> "<blah>\n","\n" after processing) 
+                if (l->rx_index>0) {
+                    l->rx_buf[l->rx_index] = '\n';  // make sure its got a LF on end
+                    l->rx_index++;
+                    l->rx_buf[l->rx_index] = 0; // null terminate the data in buffer AFTER the \r or \n
+                    // And process, with responses going back to this link
+                    at_process_input((char*)(&l->rx_buf[0]), l->txfn);
+                    _ctx.rxL++;
+                }
+                // reset our line buffer
+                l->rx_index = 0;
+                // Continue for rest of data in input
+            } else {
+                l->rx_index++;
+            }
+        }
+        // Back to raw mode processing if that command started it
+        if (at_process_isRaw(l->txfn)) {
+            break;
+        }
+    }
 }
 
-// Tx line. returns number of bytes not sent due to flow control or -1 for error 
+// Tx to all connected remote NUS clients (eg AT+BENCH). Returns the number of bytes not sent (to be offered again), or -1 if noone is connected.
+// data NULL (disconnect) is ignored : its not for one remote to drop the others
 int comm_ble_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
-    if (!_ctx.connected) {
+    if (data==NULL) {
+        return 0;
+    }
+    return comm_ble_fanout(data, len, tx_ready, BLE_TO_ALL);
+}
+// Tx to links that subscribed to scan output. Same return as comm_ble_tx()
+int comm_ble_scan_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    if (data==NULL) {
+        return 0;       // scan output never disconnects anyone
+    }
+    return comm_ble_fanout(data, len, tx_ready, BLE_TO_SCANSUBS);
+}
+// Tx to the links in the uart passthru. Same return as comm_ble_tx(). data NULL disconnects them (and only them), ending it
+int comm_ble_session_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    if (data==NULL) {
+        log_info("nus:disconnect passthru links");
+        for(int i=0;i<MAX_LINKS;i++) {
+            ble_link_t* l = comm_ble_link_slot(i);
+            if (l!=NULL && l->inSession) {
+                l->inSession = false;
+                comm_ble_link_disconnect(l);
+            }
+        }
+        return 0;
+    }
+    return comm_ble_fanout(data, len, tx_ready, BLE_TO_SESSION);
+}
+
+static bool comm_ble_fanout_to(ble_link_t* l, BLE_FANOUT_t to) {
+    return (l!=NULL && l->connected && !l->central &&
+                (to==BLE_TO_ALL || (to==BLE_TO_SCANSUBS && l->scanSub) || (to==BLE_TO_SESSION && l->inSession)));
+}
+// Same data to several links : only as much as the fullest tx queue can take, so every link gets all of what is sent and the caller
+// offers the rest again (tx_ready is called by any link that was blocked). Returns bytes not sent, or -1 if there are no links.
+// The scan output comes here from softdevice event context, so the room check and the sends are one critical region : another
+// producer can't fill a queue in between.
+static int comm_ble_fanout(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready, BLE_FANOUT_t to) {
+    int n = len;
+    bool any = false;
+    int ret;
+    CRITICAL_REGION_ENTER();
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (comm_ble_fanout_to(l, to)) {
+            any = true;
+            l->tx_ready_fn = tx_ready;
+            int room = (l->txqBlocked ? 0 : BLE_TXQ_SIZE-TXQ_COUNT(l));
+            if (room<n) {
+                n = room;
+            }
+        }
+    }
+    if (!any) {
+        ret = -1;
+    } else if (n==0 && len>0) {
+        _ctx.txLfc++;
+        ret = len;
+    } else {
+        for(int i=0;i<MAX_LINKS;i++) {
+            ble_link_t* l = comm_ble_link_slot(i);
+            if (comm_ble_fanout_to(l, to)) {
+                comm_ble_link_tx(l, data, n, tx_ready);       // all of it fits (or its the flush hint)
+            }
+        }
+        ret = len-n;
+    }
+    CRITICAL_REGION_EXIT();
+    return ret;
+}
+
+// Tx to 1 link. returns number of bytes not sent due to flow control or -1 for error 
+// Data the softdevice can't take right now is kept in the tx queue and sent on BLE_NUS_EVT_TX_RDY. Once the queue is above
+// its high watermark we refuse more (return the count not taken) until it drains below the low watermark, when tx_ready is called.
+// If coalescing is configured (DCFG_KEY_BLE_COALESCE), small writes are held for up to that many ms to fill whole notifications.
+// A write with len 0 (and data not NULL) is a hint to flush now (eg end of an AT response).
+static int comm_ble_link_tx(ble_link_t* l, uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    if (l==NULL || !l->connected) {
         return -1;      // not connected, sorry
     }
-    _ctx.tx_ready_fn = tx_ready;        // in case of..
     // check if disconnecting and ignore (as can't disconnect from uart...)
     if (data!=NULL)  {
+        l->tx_ready_fn = tx_ready;        // in case of..
         log_info("nus:send data to nus");
-        // Send to NUS : we need to cut it up into BLE_NUS_MAX_DATA_LEN sized blocks (actually as set by GATT nego)
+        if (len==0) {
+            // flush hint
+            l->flushDue = true;
+            comm_ble_txq_drain(l);
+            return 0;
+        }
+        uint16_t coalesceMs = cfg_getBleCoalesceMs();
         int off = 0;
-        do {
-            // Length for this block
-//            uint16_t tlen = ((len-off)>BLE_NUS_MAX_DATA_LEN)?BLE_NUS_MAX_DATA_LEN:(len-off);
-            uint16_t tlen = ((len-off)>_ctx.m_ble_nus_max_data_len )?_ctx.m_ble_nus_max_data_len:(len-off);
-            if (tlen>0) {
-                uint32_t err_code = ble_nus_data_send(&m_nus, &data[off], &tlen, _ctx.conn_handle);
-        //        err_code = ble_nus_c_string_send(&m_nus_c, data, len);
-                if (err_code == NRF_ERROR_INVALID_STATE) {
-                    // NUS tells us we are disconnected
-                    comm_ble_remote_disconnected(_ctx.conn_handle);
-                    return len-off;     // this is what is left
-                } else if (err_code == NRF_SUCCESS) {
-                    if (tlen==0) {
-                        _ctx.txLfc++;
-                        // saturated the tx Q! drop the rest of the output but don't drop connection
-                        return len-off;
-                    }
-                    _ctx.txC+=tlen;
-                } else {
-                    // badness
-                    log_warn("error code from data_send");
-                    comm_ble_remote_disconnected(_ctx.conn_handle);
-                    APP_ERROR_CHECK(err_code);
-                    return len-off;     // this is what is left
+        bool gone = false;
+        // Thread mode (AT output, bench) and softdevice event context (scan output) both write here, and the drain takes from it
+        CRITICAL_REGION_ENTER();
+        if (l->txqBlocked) {
+            off = -1;
+        } else {
+            // If nothing queued, try to send direct (keeping order, if something is queued this goes after it)
+            // When coalescing only full notifications go direct, the rest waits for more data
+            if (TXQ_COUNT(l)==0) {
+                int n = (coalesceMs>0 ? (len/l->max_data_len)*l->max_data_len : len);
+                if (n>0) {
+                    off = comm_ble_send(l, data, n);
+                    gone = (off<0);
                 }
-                off+=tlen;
             }
-        } while (off<len);
+            // Queue what is left, as much as fits
+            while(!gone && off<len && TXQ_COUNT(l)<BLE_TXQ_SIZE) {
+                l->txq[l->txqHead & (BLE_TXQ_SIZE-1)] = data[off++];
+                l->txqHead++;
+            }
+            if (TXQ_COUNT(l)>=BLE_TXQ_HIGH_WM) {
+                l->txqBlocked = true;
+            }
+        }
+        CRITICAL_REGION_EXIT();
+        if (off<0) {
+            if (!gone) {
+                _ctx.txLfc++;
+            }
+            return len;     // blocked (come back when we call tx_ready), or disconnected
+        }
+        if (coalesceMs>0 && TXQ_COUNT(l)>0) {
+            // send any full notifications, and make sure the rest goes within the delay
+            comm_ble_txq_drain(l);
+            if (TXQ_COUNT(l)>0 && !_ctx.flushTimerOn) {
+                _ctx.flushTimerOn = true;
+                app_timer_start(m_ble_flush_timer, APP_TIMER_TICKS(coalesceMs), NULL);
+            }
+        }
+        comm_ble_cp_traffic(l);
         if (len>1) {
             _ctx.txL++;
         } else {
             _ctx.txLemp++;
         }
+        if (off<len) {
+            _ctx.txLfc++;
+        }
+        return len-off;
     } else {
         log_info("nus:disconnect request");
-        // disconnnect NUS
-        comm_ble_local_disconnected();
+        // disconnnect this link
+        comm_ble_link_disconnect(l);
     }
     return 0;       // all sent
 }
 
+// Seems a little brutual to break its connection but there you go?
+static void comm_ble_link_disconnect(ble_link_t* l) {
+    log_info("nus:local disconnect");
+    if (l->conn_handle!=BLE_CONN_HANDLE_INVALID) {
+        uint32_t err_code = sd_ble_gap_disconnect(l->conn_handle,
+                                     BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+        if (err_code != NRF_ERROR_INVALID_STATE)
+        {
+            APP_ERROR_CHECK(err_code);
+        }
+    }
+    l->connected = false;
+    l->tx_ready_fn = NULL;
+    comm_ble_txq_reset(l);
+    // and the slot is freed when the softdevice says the link is gone
+}
+
+// Send data as notifications, cut up into max data len sized blocks (as set by GATT nego), until softdevice queue is full
+// Returns number of bytes sent, or -1 if disconnected
+static int comm_ble_send(ble_link_t* l, uint8_t* data, int len) {
+    int off = 0;
+    while (off<len) {
+        uint16_t tlen = ((len-off)>l->max_data_len )?l->max_data_len:(len-off);
+        uint32_t err_code;
+        if (l->central) {
+            // Write without response to the remote's RX characteristic (direct, not by the gatt queue which drops data if the
+            // softdevice has no room). Room again is signalled by BLE_GATTC_EVT_WRITE_CMD_TX_COMPLETE
+            ble_gattc_write_params_t wp = {
+                .write_op = BLE_GATT_OP_WRITE_CMD,
+                .flags = 0,
+                .handle = l->nus_rx_handle,
+                .offset = 0,
+                .len = tlen,
+                .p_value = &data[off],
+            };
+            err_code = sd_ble_gattc_write(l->conn_handle, &wp);
+        } else {
+            err_code = ble_nus_data_send(&m_nus, &data[off], &tlen, l->conn_handle);
+        }
+        if (err_code == NRF_ERROR_INVALID_STATE) {
+            // NUS tells us we are disconnected
+            comm_ble_remote_disconnected(l->conn_handle);
+            return -1;
+        } else if (err_code == NRF_ERROR_RESOURCES) {
+            // softdevice tx queue is full : rest goes when it says TX_RDY
+            break;
+        } else if (err_code != NRF_SUCCESS) {
+            // badness
+            log_warn("error code from data_send");
+            comm_ble_remote_disconnected(l->conn_handle);
+            APP_ERROR_CHECK(err_code);
+            return -1;
+        }
+        _ctx.txC+=tlen;
+        _ctx.txN++;
+        l->cpBytes+=tlen;
+        off+=tlen;
+    }
+    return off;
+}
+
+// Softdevice has space again : send what we can from the queue, and tell producer when its below low watermark
+// Called from main loop, TX_RDY/WRITE_CMD_TX_COMPLETE events and flush timer, so protected against itself
+static void comm_ble_txq_drain(ble_link_t* l) {
+    uint8_t blk[NRF_SDH_BLE_GATT_MAX_MTU_SIZE];
+    bool ready = false;
+    CRITICAL_REGION_ENTER();
+    // partial notifications only if not coalescing or the coalescing delay is up
+    bool partial = (l->flushDue || cfg_getBleCoalesceMs()==0);
+    while(TXQ_COUNT(l)>0 && l->connected) {
+        // copy out a block (without taking it off the queue until its sent)
+        int n = TXQ_COUNT(l);
+        if (n>l->max_data_len) {
+            n = l->max_data_len;
+        } else if (n<l->max_data_len && !partial) {
+            break;
+        }
+        for(int i=0;i<n;i++) {
+            blk[i] = l->txq[(l->txqTail+i) & (BLE_TXQ_SIZE-1)];
+        }
+        int sent = comm_ble_send(l, &blk[0], n);
+        if (sent<=0) {
+            break;
+        }
+        l->txqTail += sent;
+    }
+    if (TXQ_COUNT(l)==0) {
+        l->flushDue = false;
+    }
+    ready = (l->txqBlocked && TXQ_COUNT(l)<=BLE_TXQ_LOW_WM);
+    if (ready) {
+        l->txqBlocked = false;
+    }
+    CRITICAL_REGION_EXIT();
+    if (ready && l->tx_ready_fn!=NULL) {
+        (*l->tx_ready_fn)(l->txfn);
+    }
+}
+
+// Coalescing delay is up : send whatever is queued on every link
+static void comm_ble_flush_timer_cb(void* p_context) {
+    _ctx.flushTimerOn = false;
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL && TXQ_COUNT(l)>0) {
+            l->flushDue = true;
+            comm_ble_txq_drain(l);
+        }
+    }
+}
+
+
+// Anything queued is for the old connection
+static void comm_ble_txq_reset(ble_link_t* l) {
+    l->txqTail = l->txqHead;
+    l->txqBlocked = false;
+    l->flushDue = false;
+}
+
+// Get context of link by its conn handle, NULL if not one of ours
+static ble_link_t* comm_ble_link(uint16_t conn_handle) {
+    ble_link_t* l = NULL;
+    uint16_t slot = ble_conn_state_conn_idx(conn_handle);
+    if (conn_handle==BLE_CONN_HANDLE_INVALID || slot>=MAX_LINKS || _ctx.linkHandle[slot]!=conn_handle) {
+        return NULL;
+    }
+    if (blcm_link_ctx_get(&m_links, conn_handle, (void*)&l)!=NRF_SUCCESS) {
+        return NULL;
+    }
+    return l;
+}
+// Get context of link using a slot, NULL if slot is free
+static ble_link_t* comm_ble_link_slot(int slot) {
+    if (slot<0 || slot>=MAX_LINKS) {
+        return NULL;
+    }
+    return comm_ble_link(_ctx.linkHandle[slot]);
+}
+
+// Connections as peripheral get a link context, as does the one we initiated to a NUS server
+static void comm_ble_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context) {
+    uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+    switch (p_ble_evt->header.evt_id) {
+        case BLE_GAP_EVT_CONNECTED: {
+            bool central = (p_ble_evt->evt.gap_evt.params.connected.role==BLE_GAP_ROLE_CENTRAL);
+            if (central && !_ctx.nuscConnecting) {
+                break;      // not one of ours
+            }
+            uint16_t slot = ble_conn_state_conn_idx(conn_handle);
+            ble_link_t* l = NULL;
+            if (slot>=MAX_LINKS || blcm_link_ctx_get(&m_links, conn_handle, (void*)&l)!=NRF_SUCCESS) {
+                log_warn("nus:no link ctx for %d", conn_handle);
+                break;
+            }
+            memset(l, 0, sizeof(ble_link_t));
+            l->conn_handle = conn_handle;
+            l->slot = slot;
+            l->txfn = _linkTx[slot];
+            l->max_data_len = BLE_GATT_ATT_MTU_DEFAULT - 3;
+            l->connInterval = p_ble_evt->evt.gap_evt.params.connected.conn_params.max_conn_interval;
+            l->central = central;
+            l->cpProfile = (central ? APP_CONN_PROFILE_FAST : APP_CONN_PROFILE_NORMAL);     // what we connect with
+            APP_ERROR_CHECK(app_fifo_init(&l->rx_fifo, &l->rx_fifo_buf[0], RX_FIFO_SIZE));
+            _ctx.linkHandle[slot] = conn_handle;
+            if (!_ctx.cpTimerOn) {
+                _ctx.cpTimerOn = (app_timer_start(m_ble_cp_timer, APP_TIMER_TICKS(CP_TICK_MS), NULL)==NRF_SUCCESS);
+            }
+            // password check has not been validated for this connection
+            clear_authentication(l->txfn);
+            comm_ble_pwr_start(l);
+            log_info("nus:link %d up", slot);
+            if (central) {
+                _ctx.nuscHandle = conn_handle;
+                // Seen this remote before? Then we know where its NUS is
+                for(int i=0;i<NUSC_HANDLE_CACHE_SZ;i++) {
+                    if (_ctx.nuscCache[i].valid && memcmp(_ctx.nuscCache[i].addr, _ctx.nuscAddr.addr, BLE_GAP_ADDR_LEN)==0) {
+                        log_info("nusc:handles from cache");
+                        _ctx.nuscUsedCache = true;
+                        ble_nus_c_evt_t evt = {
+                            .evt_type = BLE_NUS_C_EVT_DISCOVERY_COMPLETE,
+                            .conn_handle = conn_handle,
+                            .handles = _ctx.nuscCache[i].handles,
+                        };
+                        comm_ble_nusc_evt_handler(&m_nus_c, &evt);
+                        return;
+                    }
+                }
+                _ctx.nuscUsedCache = false;
+                memset(&m_db_disc, 0, sizeof(m_db_disc));
+                if (ble_db_discovery_start(&m_db_disc, conn_handle)!=NRF_SUCCESS) {
+                    comm_ble_nusc_result(false);
+                }
+            }
+            break;
+        }
+        case BLE_GAP_EVT_TIMEOUT:
+            if (p_ble_evt->evt.gap_evt.params.timeout.src==BLE_GAP_TIMEOUT_SRC_CONN && _ctx.nuscConnecting) {
+                log_info("nusc:remote not found");
+                comm_ble_nusc_result(false);
+            }
+            break;
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE: {
+            _ctx.cpUpd++;
+            ble_link_t* l = comm_ble_link(conn_handle);
+            if (l!=NULL) {
+                l->connInterval = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval;
+            }
+            log_info("nus:conn params now %d-%d, latency %d", p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.min_conn_interval,
+                        p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval,
+                        p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.slave_latency);
+            break;
+        }
+        case BLE_GAP_EVT_RSSI_CHANGED: {
+            ble_link_t* l = comm_ble_link(conn_handle);
+            if (l!=NULL) {
+                int8_t rssi = p_ble_evt->evt.gap_evt.params.rssi_changed.rssi;
+                l->rssi = (l->rssi==0 ? rssi : (int8_t)((l->rssi*3 + rssi)/4));
+            }
+            break;
+        }
+        case BLE_GATTC_EVT_WRITE_CMD_TX_COMPLETE: {
+            ble_link_t* l = comm_ble_link(p_ble_evt->evt.gattc_evt.conn_handle);
+            if (l!=NULL) {
+                comm_ble_txq_drain(l);
+            }
+            break;
+        }
+        case BLE_GAP_EVT_DISCONNECTED: {
+            ble_link_t* l = comm_ble_link(conn_handle);
+            if (l!=NULL) {
+                // any auth is now invalid, as is any response output still queued for it
+                clear_authentication(l->txfn);
+                at_process_outGone(l->txfn);
+                comm_ble_remote_disconnected(conn_handle);
+                l->conn_handle = BLE_CONN_HANDLE_INVALID;
+                _ctx.linkHandle[l->slot] = BLE_CONN_HANDLE_INVALID;
+                // last one gone : nothing for the cp tick to do
+                bool any = false;
+                for(int i=0;i<MAX_LINKS;i++) {
+                    any |= (_ctx.linkHandle[i]!=BLE_CONN_HANDLE_INVALID);
+                }
+                if (!any && _ctx.cpTimerOn) {
+                    app_timer_stop(m_ble_cp_timer);
+                    _ctx.cpTimerOn = false;
+                }
+            }
+            if (conn_handle==_ctx.nuscHandle) {
+                _ctx.nuscHandle = BLE_CONN_HANDLE_INVALID;
+                if (_ctx.nuscConnecting) {
+                    comm_ble_nusc_result(false);        // went before we were done
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Passthru wants (or no longer wants) the throughput profile on the links : change those that are not idle now
+void comm_ble_setThroughput(bool throughput) {
+    _ctx.throughput = throughput;
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL && !l->central) {
+            l->cpIdleTicks = 0;
+            comm_ble_cp_set(l, (throughput ? APP_CONN_PROFILE_FAST : APP_CONN_PROFILE_NORMAL));
+        }
+    }
+}
+// Traffic on an idle link : get back to a short interval now rather than at the next tick
+static void comm_ble_cp_traffic(ble_link_t* l) {
+    l->cpIdleTicks = 0;
+    if (l->cpProfile==APP_CONN_PROFILE_IDLE && !l->central) {
+        comm_ble_cp_set(l, (_ctx.throughput ? APP_CONN_PROFILE_FAST : APP_CONN_PROFILE_NORMAL));
+    }
+}
+static void comm_ble_cp_set(ble_link_t* l, APP_CONN_PROFILE_t p) {
+    if (l->cpRefused & (1<<p)) {
+        p = APP_CONN_PROFILE_NORMAL;
+        if (l->cpProfile==p) {
+            return;
+        }
+    }
+    if (app_setLinkProfile(l->conn_handle, p)) {
+        l->cpProfile = p;
+        _ctx.cpReq++;
+    } else {
+        _ctx.cpFail++;
+    }
+}
+
+// The conn params module gave up on a profile the central won't take (eg iOS and very short or long intervals). For the
+// idle and fast profiles go back to normal and keep the link : returns false if it was the normal one (caller drops the link)
+bool comm_ble_cpRefused(uint16_t conn_handle) {
+    ble_link_t* l = comm_ble_link(conn_handle);
+    if (l==NULL) {
+        return true;        // not one of ours (or gone) : nothing to drop
+    }
+    if (l->cpProfile==APP_CONN_PROFILE_NORMAL) {
+        return false;
+    }
+    _ctx.cpRefused++;
+    log_warn("nus:link %d refused conn params profile %d, staying on normal", l->slot, l->cpProfile);
+    l->cpRefused |= (1<<l->cpProfile);
+    comm_ble_cp_set(l, APP_CONN_PROFILE_NORMAL);
+    return true;
+}
+
+// Connection tx power levels the radio supports, lowest first. -40 is left out as links drop before it saves anything.
+static const int8_t _pwrLevels[] = { -20, -16, -12, -8, -4, 0, 3, 4 };
+#define PWR_NB_LEVELS ((int)(sizeof(_pwrLevels)/sizeof(_pwrLevels[0])))
+
+// New link starts at the configured level and asks for rssi reports to steer from
+static void comm_ble_pwr_start(ble_link_t* l) {
+    l->txPower = cfg_getTXPOWER_Level();
+    if (sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_CONN, l->conn_handle, l->txPower)!=NRF_SUCCESS) {
+        l->txPower = 0;     // what the softdevice uses by default
+    }
+    l->pwrHoldTicks = PWR_HOLD_TICKS;
+    if (sd_ble_gap_rssi_start(l->conn_handle, PWR_RSSI_THRESHOLD_DBM, PWR_RSSI_SKIP)!=NRF_SUCCESS) {
+        log_warn("nus:no rssi on link %d, tx power stays at %d", l->slot, l->txPower);
+    }
+}
+
+// Called every CP tick : one level up or down if our estimated signal at the remote is outside the window
+static void comm_ble_pwr_tick(ble_link_t* l) {
+    if (l->rssi==0) {
+        return;
+    }
+    if (l->pwrHoldTicks>0) {
+        l->pwrHoldTicks--;
+        return;
+    }
+    // highest level not above the current one (the configured level may be off the list)
+    int i = 0;
+    while(i<PWR_NB_LEVELS-1 && _pwrLevels[i+1]<=l->txPower) {
+        i++;
+    }
+    int8_t want = l->txPower;
+    int atRemote = l->txPower + l->rssi;
+    if (atRemote<PWR_TARGET_LOW_DBM) {
+        if (_pwrLevels[i]>l->txPower) {
+            want = _pwrLevels[i];
+        } else if (i<PWR_NB_LEVELS-1) {
+            want = _pwrLevels[i+1];
+        }
+    } else if (atRemote>PWR_TARGET_HIGH_DBM) {
+        if (_pwrLevels[i]<l->txPower) {
+            want = _pwrLevels[i];
+        } else if (i>0) {
+            want = _pwrLevels[i-1];
+        }
+    }
+    if (want==l->txPower) {
+        return;
+    }
+    if (sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_CONN, l->conn_handle, want)==NRF_SUCCESS) {
+        if (want>l->txPower) {
+            _ctx.pwrUp++;
+        } else {
+            _ctx.pwrDown++;
+        }
+        l->txPower = want;
+        l->pwrHoldTicks = PWR_HOLD_TICKS;
+    }
+}
+// Each tick, check the traffic on each peripheral link and pick its profile (we choose the params for central links ourselves)
+static void comm_ble_cp_timer_cb(void* p_context) {
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l==NULL || l->conn_handle==BLE_CONN_HANDLE_INVALID) {
+            continue;
+        }
+        comm_ble_pwr_tick(l);
+        if (l->central) {
+            continue;       // conn params are ours to choose when we connected
+        }
+        if (l->cpBytes>0) {
+            l->cpIdleTicks = 0;
+        } else if (l->cpIdleTicks<CP_IDLE_TICKS) {
+            l->cpIdleTicks++;
+        }
+        l->cpBytes = 0;
+        APP_CONN_PROFILE_t want = (l->cpIdleTicks>=CP_IDLE_TICKS ? APP_CONN_PROFILE_IDLE :
+                                    (_ctx.throughput ? APP_CONN_PROFILE_FAST : APP_CONN_PROFILE_NORMAL));
+        if (want!=l->cpProfile && !(l->cpRefused & (1<<want))) {
+            comm_ble_cp_set(l, want);
+        }
+    }
+}
+
+// Central connection is up (and discovered) or failed (and is dropped) : caller is told from main loop
+static void comm_ble_nusc_result(bool ok) {
+    if (!ok && _ctx.nuscHandle!=BLE_CONN_HANDLE_INVALID) {
+        sd_ble_gap_disconnect(_ctx.nuscHandle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+    }
+    if (_ctx.nuscConnecting) {
+        _ctx.nuscConnecting = false;
+        _ctx.nuscOk = ok;
+        _ctx.nuscDone = true;
+    }
+}
+
+static void comm_ble_db_disc_handler(ble_db_discovery_evt_t* p_evt) {
+    ble_nus_c_on_db_disc_evt(&m_nus_c, p_evt);
+    if (p_evt->evt_type==BLE_DB_DISCOVERY_SRV_NOT_FOUND || p_evt->evt_type==BLE_DB_DISCOVERY_ERROR) {
+        log_warn("nusc:no NUS on remote");
+        comm_ble_nusc_result(false);
+    }
+}
+
+static void comm_ble_nusc_evt_handler(ble_nus_c_t* p_ble_nus_c, ble_nus_c_evt_t const* p_evt) {
+    switch(p_evt->evt_type) {
+        case BLE_NUS_C_EVT_DISCOVERY_COMPLETE: {
+            ble_link_t* l = comm_ble_link(p_evt->conn_handle);
+            if (l==NULL) {
+                comm_ble_nusc_result(false);
+                break;
+            }
+            if (ble_nus_c_handles_assign(p_ble_nus_c, p_evt->conn_handle, &p_evt->handles)!=NRF_SUCCESS ||
+                    ble_nus_c_tx_notif_enable(p_ble_nus_c)!=NRF_SUCCESS) {
+                comm_ble_nusc_result(false);
+                break;
+            }
+            if (!_ctx.nuscUsedCache) {
+                // Remember for next time
+                int ci = _ctx.nuscCacheNext;
+                _ctx.nuscCacheNext = (_ctx.nuscCacheNext+1)%NUSC_HANDLE_CACHE_SZ;
+                _ctx.nuscCache[ci].valid = true;
+                memcpy(_ctx.nuscCache[ci].addr, _ctx.nuscAddr.addr, BLE_GAP_ADDR_LEN);
+                _ctx.nuscCache[ci].handles = p_evt->handles;
+            }
+            l->nus_rx_handle = p_evt->handles.nus_rx_handle;
+            l->connected = true;
+            comm_ble_txq_reset(l);
+            log_info("nusc:connected");
+            comm_ble_nusc_result(true);
+            break;
+        }
+        case BLE_NUS_C_EVT_NUS_TX_EVT: {
+            // Remote server sent us data : same as rx on a peripheral link
+            ble_link_t* l = comm_ble_link(p_evt->conn_handle);
+            if (l==NULL) {
+                _ctx.rxO += p_evt->data_len;
+                break;
+            }
+            uint32_t n = p_evt->data_len;
+            app_fifo_write(&l->rx_fifo, p_evt->p_data, &n);
+            if (n<p_evt->data_len) {
+                _ctx.rxO += (p_evt->data_len-n);     // lost
+            }
+            break;
+        }
+        case BLE_NUS_C_EVT_DISCONNECTED:
+            log_info("nusc:disconnected");
+            break;
+    }
+}
+
+// GATT queue error for the NUS client (eg the CCCD write failed) : if the handles came from the cache they are probably
+// stale (remote changed its GATT table), so forget them and let the next connect rediscover
+static void comm_ble_nusc_error_handler(uint32_t nrf_error) {
+    log_warn("nusc:error %d", nrf_error);
+    if (_ctx.nuscUsedCache) {
+        for(int i=0;i<NUSC_HANDLE_CACHE_SZ;i++) {
+            if (memcmp(_ctx.nuscCache[i].addr, _ctx.nuscAddr.addr, BLE_GAP_ADDR_LEN)==0) {
+                _ctx.nuscCache[i].valid = false;
+            }
+        }
+    }
+    comm_ble_nusc_result(false);
+}
 
 void comm_ble_print_stats(PRINTF_FN_T printf, void* odev) {
-    (*printf)(odev, "B:%d,%d,%d,%d,%d, %d", _ctx.rxC, _ctx.rxL, _ctx.txC, _ctx.txL, _ctx.txLfc, _ctx.txLemp);
+    int q = 0;
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL) {
+            q += TXQ_COUNT(l);
+        }
+    }
+    (*printf)(odev, "B:%d,%d,%d,%d,%d, %d,%d", _ctx.rxC, _ctx.rxL, _ctx.txC, _ctx.txL, _ctx.txLfc, _ctx.txLemp, q);
+    // notifications sent, and per KB of data (to see effect of coalescing)
+    (*printf)(odev, "B:N%d,%d/KB, O%d, L%d", _ctx.txN, (_ctx.txC>0 ? (_ctx.txN*1024)/_ctx.txC : 0), _ctx.rxO, comm_ble_nbLinks());
+    // conn param updates asked for, failed to ask, and done
+    (*printf)(odev, "B:CP%d,%d,%d,%d", _ctx.cpReq, _ctx.cpFail, _ctx.cpUpd, _ctx.cpRefused);
+    // connection tx power steps up and down, then per link slot:dBm/filtered rssi
+    char line[12*MAX_LINKS+1];
+    int n = 0;
+    for(int i=0;i<MAX_LINKS;i++) {
+        ble_link_t* l = comm_ble_link_slot(i);
+        if (l!=NULL && l->conn_handle!=BLE_CONN_HANDLE_INVALID) {
+            n += snprintf(&line[n], sizeof(line)-n, " %d:%d/%d", l->slot, l->txPower, l->rssi);
+        }
+    }
+    line[n] = '\0';
+    (*printf)(odev, "B:P%d,%d%s", _ctx.pwrUp, _ctx.pwrDown, line);
 }
 /**@brief Function for handling the events from the Nordic UART Service.
  *
@@ -180,34 +1154,24 @@ static void comm_ble_nus_data_handler(ble_nus_evt_t * p_evt)
         log_info("nus:rx data");
         const uint8_t* p_data = p_evt->params.rx_data.p_data;
         const uint16_t length = p_evt->params.rx_data.length;
-        for(int i=0;i<length;i++) {
-            _ctx.rx_buf[_ctx.rx_index] = p_data[i];
-            // Don't take nulls
-            if (_ctx.rx_buf[_ctx.rx_index]!=0) {
-                _ctx.rxC++;
-                if( (_ctx.rx_buf[_ctx.rx_index] == '\r') || (_ctx.rx_buf[_ctx.rx_index] == '\n') || (_ctx.rx_index >= (MAX_RX_LINE-2)) )
-                {
-                    // Don't process empty lines (eg the \n from people who do "<blah>\r\n" -> "<blah>\n","\n" after processing) 
-                    if (_ctx.rx_index>0) {
-                        _ctx.rx_buf[_ctx.rx_index] = '\n';  // make sure its got a LF on end
-                        _ctx.rx_index++;
-                        _ctx.rx_buf[_ctx.rx_index] = 0; // null terminate the data in buffer AFTER the \r or \n
-                        // And process
-                        at_process_input((char*)(&_ctx.rx_buf[0]), &comm_ble_tx);
-                        _ctx.rxL++;
-                    }
-                    // reset our line buffer
-                    _ctx.rx_index = 0;
-                    // Continue for rest of data in input
-                } else {
-                    _ctx.rx_index++;
-                }
-            }
+        ble_link_t* l = comm_ble_link(p_evt->conn_handle);
+        if (l==NULL) {
+            _ctx.rxO += length;
+            return;
+        }
+        // Just queue it for the main loop (comm_ble_processRX()) so we stay short in softdevice event context
+        uint32_t n = length;
+        app_fifo_write(&l->rx_fifo, p_data, &n);
+        if (n<length) {
+            _ctx.rxO += (length-n);     // lost
         }
+        l->cpBytes += length;
+        comm_ble_cp_traffic(l);
     } else if (p_evt->type==BLE_NUS_EVT_TX_RDY) {
         log_info("nus:tx rdy");
-        if (_ctx.tx_ready_fn!=NULL) {
-            (*_ctx.tx_ready_fn)(&comm_ble_tx);
+        ble_link_t* l = comm_ble_link(p_evt->conn_handle);
+        if (l!=NULL) {
+            comm_ble_txq_drain(l);
         }
     } else if (p_evt->type==BLE_NUS_EVT_COMM_STARTED) {
         log_info("nus:comm start");
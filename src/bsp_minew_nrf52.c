@@ -13,6 +13,7 @@
 #include "nrf_soc.h"
 #include "nrf_delay.h"
 #include "app_uart.h"
+#include "nrfx_saadc.h"
 #include "main.h"
 #include "wutils.h"
 
@@ -97,6 +98,21 @@ extern volatile uint32_t __FLASH_CONFIG_SZ[];
 static uint32_t FLASH_CONFIG_SZ = ((uint32_t)__FLASH_CONFIG_SZ);      // FLASH_CFG in .ld file
 static uint32_t FLASH_CONFIG_BASE_ADDR = (((uint32_t)__FLASH_CONFIG_BASE_ADDR));   // FLASH_CFG in .ld file
 
+#define NVM_ASYNC_RETRIES (3)
+typedef enum { NVM_IDLE, NVM_ERASE_REQ, NVM_ERASING, NVM_WRITE_REQ, NVM_WRITING, NVM_DONE } NVM_STATE_t;
+// State of the non-blocking page write
+static struct {
+    volatile NVM_STATE_t state;
+    volatile bool opOk;             // result of last flash operation (set from SOC event)
+    bool ok;                        // final result
+    uint8_t retries;
+    uint8_t len;
+    uint32_t buf[64];               // copy of data being written (len is <256)
+    NVM_WRITE_DONE_FN_T done_fn;
+} _nvm = {
+    .state = NVM_IDLE,
+};
+
 uint16_t hal_bsp_nvmSize() {
     return (uint16_t)FLASH_CONFIG_SZ;
 }
@@ -245,52 +261,177 @@ bool hal_bsp_nvmWrite(uint16_t off, uint8_t len, uint8_t* buf) {
     }
 }
 
+bool hal_bsp_nvmWriteAsync(uint8_t len, uint8_t* buf, NVM_WRITE_DONE_FN_T done_fn) {
+    if (_nvm.state!=NVM_IDLE) {
+        return false;
+    }
+    memcpy(&_nvm.buf[0], buf, len);
+    _nvm.len = len;
+    _nvm.done_fn = done_fn;
+    _nvm.retries = 0;
+    _nvm.ok = false;
+    _nvm.state = NVM_ERASE_REQ;
+    app_setRadioNotify(true);   // flash ops wait for a radio gap (see hal_bsp_nvmProcess)
+    app_setFlashBusy();         // keeps main loop running until we're done
+    hal_bsp_nvmProcess();       // get going
+    return true;
+}
+bool hal_bsp_nvmIsWriting() {
+    return (_nvm.state!=NVM_IDLE);
+}
+// Called from SOC event handler when a flash operation ends
+void hal_bsp_nvmFlashEvent(bool ok) {
+    _nvm.opOk = ok;
+    if (_nvm.state==NVM_ERASING) {
+        _nvm.state = (ok ? NVM_WRITE_REQ : NVM_ERASE_REQ);
+    } else if (_nvm.state==NVM_WRITING) {
+        _nvm.state = (ok ? NVM_DONE : NVM_ERASE_REQ);
+    } else {
+        return;     // not ours
+    }
+    if (!ok) {
+        // retry from the erase, but not forever
+        if (++_nvm.retries>NVM_ASYNC_RETRIES) {
+            _nvm.state = NVM_DONE;
+        }
+    } else if (_nvm.state==NVM_DONE) {
+        _nvm.ok = true;
+    }
+}
+// Issue the next step of the async write if required. Call from main loop
+void hal_bsp_nvmProcess() {
+    uint32_t status = NRF_SUCCESS;
+    switch(_nvm.state) {
+        case NVM_ERASE_REQ: {
+            uint32_t FLASH_PAGE_SIZE= *((uint32_t*)0x10000010);   // FICR/CODEPAGESIZE
+            // Start flash operations at the beginning of a radio gap, so the softdevice can fit them in rather than retry
+            // (NRF_EVT_FLASH_OPERATION_ERROR). Let the main loop sleep meanwhile : the radio notification wakes it.
+            if (!app_isRadioWindow()) {
+                app_setFlashIdle();
+                break;
+            }
+            app_setFlashBusy();
+            // State first : the SOC event can come in before the call returns to us (an ISR may run in between)
+            _nvm.state = NVM_ERASING;
+            status = sd_flash_page_erase(FLASH_CONFIG_BASE_ADDR/FLASH_PAGE_SIZE);
+            if (status!=NRF_SUCCESS) {
+                _nvm.state = NVM_ERASE_REQ;
+            }
+            break;
+        }
+        case NVM_WRITE_REQ: {
+            if (!app_isRadioWindow()) {
+                app_setFlashIdle();
+                break;
+            }
+            app_setFlashBusy();
+            _nvm.state = NVM_WRITING;
+            status = sd_flash_write((uint32_t*)FLASH_CONFIG_BASE_ADDR, &_nvm.buf[0], (_nvm.len/4)+1);        // Write rounded up to nearest 32 bit length
+            if (status!=NRF_SUCCESS) {
+                _nvm.state = NVM_WRITE_REQ;
+            }
+            break;
+        }
+        case NVM_DONE: {
+            _nvm.state = NVM_IDLE;
+            app_setRadioNotify(false);
+            if (!_nvm.ok) {
+                log_error("flash async write failed after %d retries", _nvm.retries);
+            }
+            if (_nvm.done_fn!=NULL) {
+                (*_nvm.done_fn)(_nvm.ok);
+            }
+            break;
+        }
+        default:
+            // Idle, or waiting for SOC event
+            break;
+    }
+    // NRF_ERROR_BUSY just means softdevice is still doing a previous flash op : we'll try again next time round
+    if (status!=NRF_SUCCESS && status!=NRF_ERROR_BUSY) {
+        log_error("flash async op failed %d", status);
+        app_setFlashIdle();
+        _nvm.ok = false;
+        _nvm.state = NVM_DONE;
+    }
+}
+
+// ADC : SAADC channel 0 on VDD. Gain 1/6 with the internal 0.6V reference gives a 3.6V full scale. 16x oversampling in burst
+// mode means one sample task does all 16 conversions back to back (~200us), then the SAADC is uninitialised until the next reading.
+#define ADC_VDD_CHANNEL     (0)
+#define ADC_FULL_SCALE_MV   (3600)
+#define ADC_RES_BITS        (12)
+#define ADC_CALIB_TIMEOUT_US (2000)     // offset calibration takes a few hundred us
+
+static struct {
+    bool isInit;
+    bool calibrated;        // offset calibration done (once, at the first reading)
+} _adc;
 
-// ADC
+static void adc_evt_handler(nrfx_saadc_evt_t const * p_event)
+{
+    // Only blocking conversions and calibration are used : nothing to do
+}
 
 void hal_bsp_adc_init(void)
 {
-    /* TODO new ADC fns?
-    //NRF_ADC->POWER = ADC_POWER_POWER_Enabled << ADC_POWER_POWER_Pos;
-    NRF_ADC->ENABLE = ADC_ENABLE_ENABLE_Enabled << ADC_ENABLE_ENABLE_Pos;
-    
-    NRF_ADC->CONFIG = (ADC_CONFIG_RES_10bit << ADC_CONFIG_RES_Pos) |
-                      (ADC_CONFIG_INPSEL_SupplyOneThirdPrescaling << ADC_CONFIG_INPSEL_Pos) |
-                      (ADC_CONFIG_REFSEL_VBG << ADC_CONFIG_REFSEL_Pos) |
-                      (ADC_CONFIG_PSEL_Disabled << ADC_CONFIG_PSEL_Pos) |
-                      (ADC_CONFIG_EXTREFSEL_None << ADC_CONFIG_EXTREFSEL_Pos);
-                      */
+    if (_adc.isInit) {
+        return;
+    }
+    nrfx_saadc_config_t cfg = NRFX_SAADC_DEFAULT_CONFIG;
+    cfg.resolution = NRF_SAADC_RESOLUTION_12BIT;
+    cfg.oversample = NRF_SAADC_OVERSAMPLE_16X;
+    cfg.low_power_mode = false;
+    if (nrfx_saadc_init(&cfg, adc_evt_handler)!=NRFX_SUCCESS) {
+        log_warn("adc init failed");
+        return;
+    }
+    nrf_saadc_channel_config_t ch = NRFX_SAADC_DEFAULT_CHANNEL_CONFIG_SE(NRF_SAADC_INPUT_VDD);
+    ch.burst = NRF_SAADC_BURST_ENABLED;
+    if (nrfx_saadc_channel_init(ADC_VDD_CHANNEL, &ch)!=NRFX_SUCCESS) {
+        log_warn("adc channel init failed");
+        nrfx_saadc_uninit();
+        return;
+    }
+    _adc.isInit = true;
+    // Calibration ends in the SAADC interrupt, which can't run while we're in a handler at its priority (eg the battery timer) :
+    // only from thread context, and not forever. Readings are still good without it, just a few LSB less accurate.
+    if (!_adc.calibrated && current_int_priority_get()==APP_IRQ_PRIORITY_THREAD) {
+        if (nrfx_saadc_calibrate_offset()==NRFX_SUCCESS) {
+            for(int us=0; us<ADC_CALIB_TIMEOUT_US && nrfx_saadc_is_busy(); us+=10) {
+                nrf_delay_us(10);
+            }
+            _adc.calibrated = !nrfx_saadc_is_busy();
+            if (!_adc.calibrated) {
+                log_warn("adc calibration timeout");
+            }
+        }
+    }
 }
  
 void hal_bsp_adc_disable(void)
 {
-    /* TODO new ADC fns?
-    NRF_ADC->ENABLE = ADC_ENABLE_ENABLE_Disabled << ADC_ENABLE_ENABLE_Pos;
-    //NRF_ADC->POWER = ADC_POWER_POWER_Disabled << ADC_POWER_POWER_Pos;
-    
-    NRF_ADC->CONFIG = (ADC_CONFIG_PSEL_Disabled << ADC_CONFIG_PSEL_Pos) |
-                      (ADC_CONFIG_EXTREFSEL_None << ADC_CONFIG_EXTREFSEL_Pos);
-                      */
+    if (_adc.isInit) {
+        nrfx_saadc_uninit();
+        _adc.isInit = false;
+    }
 }
  
+// Raw 12 bit reading of VDD (0 if the adc isn't initialised)
 uint16_t hal_bsp_adc_read_u16(void)
 {
-    /* TODO new ADC fns?
-    NRF_ADC->CONFIG     &= ~ADC_CONFIG_PSEL_Msk;
-    NRF_ADC->CONFIG     |= ADC_CONFIG_PSEL_Disabled << ADC_CONFIG_PSEL_Pos;
-    NRF_ADC->TASKS_START = 1;
-    while (((NRF_ADC->BUSY & ADC_BUSY_BUSY_Msk) >> ADC_BUSY_BUSY_Pos) == ADC_BUSY_BUSY_Busy) {};
-    NRF_ADC->TASKS_STOP = 1;
-    return (uint16_t)NRF_ADC->RESULT; // 10 bit
-    */
-   return 0;
+    nrf_saadc_value_t v = 0;
+    if (!_adc.isInit || nrfx_saadc_sample_convert(ADC_VDD_CHANNEL, &v)!=NRFX_SUCCESS) {
+        return 0;
+    }
+    return (v<0 ? 0 : (uint16_t)v);
 }
 
-#if 0 
-/* Interrupt handler for ADC data ready event. It will be executed when ADC sampling is complete */
-void ADC_IRQHandler(void)
+// One VDD measurement in mV : powers the SAADC up just for the reading. 0 if it failed.
+uint16_t hal_bsp_adc_read_vdd_mv(void)
 {
-    /* Clear dataready event */
-    NRF_ADC->EVENTS_END = 0;
+    hal_bsp_adc_init();
+    uint32_t raw = hal_bsp_adc_read_u16();
+    hal_bsp_adc_disable();
+    return (uint16_t)(((raw*ADC_FULL_SCALE_MV) + (1<<(ADC_RES_BITS-1))) >> ADC_RES_BITS);
 }
-#endif
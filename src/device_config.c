@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "bsp_minew_nrf52.h"
 #include "wutils.h"
@@ -26,12 +27,50 @@
 #define PASSWORD_LEN    (4)
 #define MAGIC_CFG_SAVED (0x60671520)    // magic number meaning full saved config present in flash
 #define MAGIC_CFG_PROD (0x60671519)     // magic number meaning just production saved config present in flash
+#define MAGIC_CFG_EXT (0x60671528)      // magic number meaning the extended part of the config was saved too
+#define SUMMARY_REFRESH_S_MIN (1)
+#define RELAY_MAX_IDS_MAX (32)
+#define BATT_PERIOD_S_MIN (10)
+#define BATT_PERIOD_S_MAX (500)         // app_timer can't go much past 512s at our RTC rate
+#define ADV_SLOT_MS_MIN (100)
 
 #define STR2(x) #x
 #define STR(x) STR2(x)
 // string in binary that shows verion build and date
 const char* BUILD="(@)Build v" STR(FW_MAJOR) "." STR(FW_MINOR) " card type " STR(CARD_TYPE) " on " __DATE__ " " __TIME__;
 
+// Advertising slot : advert interval (0=use the ADV_INT config) and share of the rotation ticks (0=off)
+typedef struct {
+    uint16_t intervalMs;
+    uint8_t weight;
+    uint8_t rfu;
+} cfg_adv_slot_t;
+// Extended config : added after the original structure, so config saved by older firmware doesn't have it (its magic won't match).
+// New fields go on the end only : size says how much of it the saving firmware had, and cfg_init() gives the rest their defaults
+typedef struct {
+    uint32_t magic;
+    uint16_t size;              // sizeof(cfg_ext_t) in the firmware that saved it
+    uint16_t bleCoalesceMs;     // delay to coalesce small NUS writes into full notifications (0=off)
+    uint16_t advSlotMs;         // advert rotation tick : each tick the scheduler picks the slot to advertise until the next
+    uint16_t battPeriodS;       // time between battery measurements
+    cfg_adv_slot_t advSlots[CFG_ADV_SLOTS];
+    uint16_t resetCount;        // boots since the config was first saved (or the count was last set)
+    // Adaptive advertising policy : adverts slow down (and tx power drops) as the battery runs down, speed up for a while after
+    // a button press or a wakeup write, and the connectable advert slows down when nobody has connected for a long time
+    bool policyOn;
+    uint8_t boostS;             // faster adverts for this long after a button press or wakeup write (0=never)
+    uint16_t battLowMv;         // below this : adverts 2x slower, tx power 4dB lower (0=never)
+    uint16_t battCritMv;        // below this : 4x slower, 8dB lower (0=never)
+    uint16_t idleMin;           // no connection for this long : connectable advert gets 1/4 of its slots (0=never)
+    uint16_t summaryRefreshS;   // time between scan summaries (each has the beacons seen since the last)
+    // Relay : scanned beacons whose major<<16|minor matches filter under mask are re-advertised, one per relay advert
+    uint8_t relayMaxIds;        // cap on distinct beacons relayed
+    uint8_t rfu;
+    uint16_t relayRateMs;       // a relay advert goes on to the next beacon at most this often
+    uint32_t relayFilter;
+    uint32_t relayMask;         // 0 : relay all
+} cfg_ext_t;
+
 // Device config structure
 static struct {
     uint32_t magic;
@@ -50,6 +89,7 @@ static struct {
     int8_t txPowerLevel; // Default -4dBm
     uint8_t extra_value;    // usually related to tx power
     bool flashWriteReq;
+    cfg_ext_t ext;              // must stay last, so a shorter one saved by older firmware reads back in place
 } _ctx = {
     .magic=MAGIC_CFG_SAVED,             // So that if config updated and saved, the next reboot will find it        
     .advertisingInterval_ms = 300, 
@@ -64,8 +104,45 @@ static struct {
     .extra_value = 0xC3,
     .passwordTab = {'1', '5', '1', '9'},
     .masterPasswordTab = {'6', '0', '6', '7'},
+    .ext = {
+        .magic = MAGIC_CFG_EXT,
+        .size = sizeof(cfg_ext_t),
+        .bleCoalesceMs = 10,
+        .advSlotMs = 1000,
+        .battPeriodS = 60,
+        // ibeacon, telemetry, connectable, eddystone UID, eddystone TLM : alternate ibeacon with the other advert as before.
+        // All at the ADV_INT interval, so the running set only has its advert swapped at each slot (a different interval
+        // means stopping, reconfiguring and restarting it). Scan summary and relay are off until asked for.
+        .advSlots = { {.intervalMs=0, .weight=1}, {.intervalMs=0, .weight=1}, {.intervalMs=0, .weight=1},
+                        {.intervalMs=0, .weight=0}, {.intervalMs=0, .weight=0},
+                        {.intervalMs=200, .weight=0}, {.intervalMs=0, .weight=0} },
+        .resetCount = 0,
+        .policyOn = true,
+        .boostS = 30,
+        .battLowMv = 2600,      // coin cell under load
+        .battCritMv = 2400,
+        .idleMin = 60,
+        .summaryRefreshS = 10,
+        .relayMaxIds = 8,
+        .relayRateMs = 1000,
+        .relayFilter = 0,
+        .relayMask = 0,
+    },
 };
 
+// Not part of the saved config
+static CFG_WRITE_DONE_FN_T _writeDoneFn = NULL;
+static uint32_t _cfgGen = 1;        // bumped on every change
+// Running boot count, kept across soft resets in uninitialised RAM so counting a boot needs no flash write
+#define RESET_COUNT_MAGIC (0x60671599)
+static struct {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t check;             // ~count
+} _resets __attribute__((section(".noinit")));
+
+static void cfg_writeDone(bool ok);
+
 // Refresh advertised name (eg when change maj/minor)
 // Note we put maj/min at front so can see it with short name of 8 chars
 static void makeNameAdv() {
@@ -89,7 +166,16 @@ void cfg_init() {
     } else if (magic==MAGIC_CFG_SAVED) {
         // Proper saved config present
         // load full structure
+        cfg_ext_t extDefaults = _ctx.ext;
         hal_bsp_nvmRead(0, sizeof(_ctx), (uint8_t*)&_ctx);
+        if (_ctx.ext.magic!=MAGIC_CFG_EXT || _ctx.ext.size<offsetof(cfg_ext_t, bleCoalesceMs) || _ctx.ext.size>sizeof(cfg_ext_t)) {
+            // saved by firmware without the extension : keep its defaults (will be saved with next config write)
+            _ctx.ext = extDefaults;
+        } else if (_ctx.ext.size<sizeof(cfg_ext_t)) {
+            // saved by firmware with a shorter extension : defaults for the fields added since
+            memcpy(((uint8_t*)&_ctx.ext)+_ctx.ext.size, ((uint8_t*)&extDefaults)+_ctx.ext.size, sizeof(cfg_ext_t)-_ctx.ext.size);
+            _ctx.ext.size = sizeof(cfg_ext_t);
+        }
         log_info("config initialised from flash [%s]", _ctx.nameAdv);
     } else {
         // go with defaults
@@ -99,21 +185,41 @@ void cfg_init() {
 
 // Request update of NVM with new config
 static void configUpdateRequest() {
+    // Anything made from the config is now out of date
+    _cfgGen++;
     // Set flag to do it in main loop (for ble timing reasons)
     _ctx.flashWriteReq = true;
 }
+// Start writing the config if it has changed. The write runs in the background (driven by hal_bsp_nvmProcess() and the flash events)
+// so the main loop keeps going. Changes made during a write set the request again and are written once it is done.
 void cfg_writeCheck() {
-    if (_ctx.flashWriteReq) {
-        //log_info("FLASH WRITE");
-        //log_mem((uint8_t*)0x77C00, sizeof(_ctx));
-        //log_mem((uint8_t*)&_ctx, sizeof(_ctx));
-        app_setFlashBusy();     // not sure if this works
+    if (_ctx.flashWriteReq && !hal_bsp_nvmIsWriting()) {
+        // Clear request before the structure is copied for writing
+        _ctx.flashWriteReq = false;
         // Write entire structure each time
-        hal_bsp_nvmWrite(0, sizeof(_ctx), (uint8_t*)&_ctx);
-        //log_info("FLASH WRITE DONE");
-        //log_mem((uint8_t*)0x77C00, sizeof(_ctx));
+        if (!hal_bsp_nvmWriteAsync(sizeof(_ctx), (uint8_t*)&_ctx, &cfg_writeDone)) {
+            _ctx.flashWriteReq = true;      // try again later
+        }
+    }
+}
+// Generation of the config : changes whenever any value does, so users can cache what they make from it (eg encoded adverts)
+uint32_t cfg_getGeneration() {
+    return _cfgGen;
+}
+bool cfg_isWritePending() {
+    return (_ctx.flashWriteReq || hal_bsp_nvmIsWriting());
+}
+void cfg_setWriteDoneCB(CFG_WRITE_DONE_FN_T fn) {
+    _writeDoneFn = fn;
+}
+static void cfg_writeDone(bool ok) {
+    if (!ok) {
+        log_warn("config write to flash failed");
+    }
+    // Only tell listener once config is up to date in flash, or if it failed
+    if (_writeDoneFn!=NULL && (!ok || !_ctx.flashWriteReq)) {
+        (*_writeDoneFn)(ok);
     }
-    _ctx.flashWriteReq = false;
 }
 /*!
 * Set And Get methods
@@ -268,11 +374,200 @@ void cfg_setExtra_Value(uint8_t value) {
 uint8_t cfg_getExtra_Value() {
     return _ctx.extra_value;
 }
+void cfg_setBleCoalesceMs(uint16_t value) {
+    if (value!=_ctx.ext.bleCoalesceMs) {
+        _ctx.ext.bleCoalesceMs = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getBleCoalesceMs() {
+    return _ctx.ext.bleCoalesceMs;
+}
+void cfg_setAdvSlotMs(uint16_t value) {
+    if (value<ADV_SLOT_MS_MIN) {
+        value = ADV_SLOT_MS_MIN;
+    }
+    if (value!=_ctx.ext.advSlotMs) {
+        _ctx.ext.advSlotMs = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getAdvSlotMs() {
+    return _ctx.ext.advSlotMs;
+}
+static cfg_adv_slot_t* cfg_advSlot(uint8_t slot) {
+    return (slot<CFG_ADV_SLOTS ? &_ctx.ext.advSlots[slot] : NULL);
+}
+void cfg_setAdvSlot(uint8_t slot, uint16_t intervalMs, uint8_t weight) {
+    cfg_adv_slot_t* s = cfg_advSlot(slot);
+    if (s==NULL) {
+        return;
+    }
+    if (intervalMs!=s->intervalMs || weight!=s->weight) {
+        s->intervalMs = intervalMs;
+        s->weight = weight;
+        configUpdateRequest();
+    }
+}
+// Advert interval of the slot : its own, or the ADV_INT config if it has none
+uint16_t cfg_getAdvSlotInterval(uint8_t slot) {
+    cfg_adv_slot_t* s = cfg_advSlot(slot);
+    if (s==NULL || s->intervalMs==0) {
+        return cfg_getADV_IND();
+    }
+    return s->intervalMs;
+}
+uint8_t cfg_getAdvSlotWeight(uint8_t slot) {
+    cfg_adv_slot_t* s = cfg_advSlot(slot);
+    return (s!=NULL ? s->weight : 0);
+}
+void cfg_setSummaryRefreshS(uint16_t value) {
+    if (value<SUMMARY_REFRESH_S_MIN) {
+        value = SUMMARY_REFRESH_S_MIN;
+    }
+    if (value!=_ctx.ext.summaryRefreshS) {
+        _ctx.ext.summaryRefreshS = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getSummaryRefreshS() {
+    return _ctx.ext.summaryRefreshS;
+}
+void cfg_setRelayFilter(uint32_t filter, uint32_t mask) {
+    if (filter!=_ctx.ext.relayFilter || mask!=_ctx.ext.relayMask) {
+        _ctx.ext.relayFilter = filter;
+        _ctx.ext.relayMask = mask;
+        configUpdateRequest();
+    }
+}
+uint32_t cfg_getRelayFilter() {
+    return _ctx.ext.relayFilter;
+}
+uint32_t cfg_getRelayMask() {
+    return _ctx.ext.relayMask;
+}
+void cfg_setRelayMaxIds(uint8_t value) {
+    if (value>RELAY_MAX_IDS_MAX) {
+        value = RELAY_MAX_IDS_MAX;
+    }
+    if (value!=_ctx.ext.relayMaxIds) {
+        _ctx.ext.relayMaxIds = value;
+        configUpdateRequest();
+    }
+}
+uint8_t cfg_getRelayMaxIds() {
+    return _ctx.ext.relayMaxIds;
+}
+void cfg_setRelayRateMs(uint16_t value) {
+    if (value!=_ctx.ext.relayRateMs) {
+        _ctx.ext.relayRateMs = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getRelayRateMs() {
+    return _ctx.ext.relayRateMs;
+}
+void cfg_setBattPeriodS(uint16_t value) {
+    if (value<BATT_PERIOD_S_MIN) {
+        value = BATT_PERIOD_S_MIN;
+    } else if (value>BATT_PERIOD_S_MAX) {
+        value = BATT_PERIOD_S_MAX;
+    }
+    if (value!=_ctx.ext.battPeriodS) {
+        _ctx.ext.battPeriodS = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getBattPeriodS() {
+    return _ctx.ext.battPeriodS;
+}
+static void cfg_resetsSave() {
+    _resets.magic = RESET_COUNT_MAGIC;
+    _resets.count = _ctx.ext.resetCount;
+    _resets.check = (uint16_t)~_resets.count;
+}
+// Count this boot (called once at startup, after cfg_init). The count lives in noinit RAM and only reaches flash with the
+// next real config write, so a power-on reset (which clears RAM) loses the boots counted since that write
+void cfg_countReset() {
+    uint16_t count = _ctx.ext.resetCount;
+    if (_resets.magic==RESET_COUNT_MAGIC && _resets.check==(uint16_t)~_resets.count && _resets.count>=count) {
+        count = _resets.count;
+    }
+    if (count<0xFFFF) {
+        count++;
+    }
+    _ctx.ext.resetCount = count;
+    cfg_resetsSave();
+}
+void cfg_setResetCount(uint16_t value) {
+    if (value!=_ctx.ext.resetCount) {
+        _ctx.ext.resetCount = value;
+        configUpdateRequest();
+    }
+    cfg_resetsSave();
+}
+uint16_t cfg_getResetCount() {
+    return _ctx.ext.resetCount;
+}
+void cfg_setAdvPolicyOn(bool value) {
+    if (value!=_ctx.ext.policyOn) {
+        _ctx.ext.policyOn = value;
+        configUpdateRequest();
+    }
+}
+bool cfg_isAdvPolicyOn() {
+    return _ctx.ext.policyOn;
+}
+void cfg_setAdvPolicyBattLowMv(uint16_t value) {
+    if (value!=_ctx.ext.battLowMv) {
+        _ctx.ext.battLowMv = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getAdvPolicyBattLowMv() {
+    return _ctx.ext.battLowMv;
+}
+void cfg_setAdvPolicyBattCritMv(uint16_t value) {
+    if (value!=_ctx.ext.battCritMv) {
+        _ctx.ext.battCritMv = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getAdvPolicyBattCritMv() {
+    return _ctx.ext.battCritMv;
+}
+void cfg_setAdvPolicyBoostS(uint8_t value) {
+    if (value!=_ctx.ext.boostS) {
+        _ctx.ext.boostS = value;
+        configUpdateRequest();
+    }
+}
+uint8_t cfg_getAdvPolicyBoostS() {
+    return _ctx.ext.boostS;
+}
+void cfg_setAdvPolicyIdleMin(uint16_t value) {
+    if (value!=_ctx.ext.idleMin) {
+        _ctx.ext.idleMin = value;
+        configUpdateRequest();
+    }
+}
+uint16_t cfg_getAdvPolicyIdleMin() {
+    return _ctx.ext.idleMin;
+}
 
 
 // Generic access by keys
 // Get key value or 0 if not found
 int cfg_getByKey(uint16_t key, uint8_t* vp, int maxlen) {
+    if (key>=DCFG_KEY_ADV_SLOT_0 && key<(DCFG_KEY_ADV_SLOT_0+CFG_ADV_SLOTS)) {
+        // 4 bytes : interval ms (LE), weight, 0 (so reads as 0x00WWIIII)
+        cfg_adv_slot_t* s = cfg_advSlot(key-DCFG_KEY_ADV_SLOT_0);
+        vp[0] = (s->intervalMs & 0xff);
+        vp[1] = (s->intervalMs >> 8);
+        vp[2] = s->weight;
+        vp[3] = 0;
+        return 4;
+    }
     switch (key) {
         case DCFG_KEY_MAJOR: {
             *((uint16_t*)vp) = cfg_getMajor_Value();
@@ -312,12 +607,72 @@ int cfg_getByKey(uint16_t key, uint8_t* vp, int maxlen) {
             memcpy(vp, _ctx.passwordTab, l);
             return PASSWORD_LEN;
         }
+        case DCFG_KEY_BLE_COALESCE: {
+            *((uint16_t*)vp) = cfg_getBleCoalesceMs();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_ADV_SLOT_MS: {
+            *((uint16_t*)vp) = cfg_getAdvSlotMs();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_BATT_PERIOD: {
+            *((uint16_t*)vp) = cfg_getBattPeriodS();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_RESET_COUNT: {
+            *((uint16_t*)vp) = cfg_getResetCount();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_POL_ON: {
+            *((bool*)vp) = cfg_isAdvPolicyOn();
+            return sizeof(bool);
+        }
+        case DCFG_KEY_POL_BATT_LOW: {
+            *((uint16_t*)vp) = cfg_getAdvPolicyBattLowMv();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_POL_BATT_CRIT: {
+            *((uint16_t*)vp) = cfg_getAdvPolicyBattCritMv();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_POL_BOOST: {
+            *vp = cfg_getAdvPolicyBoostS();
+            return sizeof(uint8_t);
+        }
+        case DCFG_KEY_POL_IDLE: {
+            *((uint16_t*)vp) = cfg_getAdvPolicyIdleMin();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_SUMMARY_REFRESH: {
+            *((uint16_t*)vp) = cfg_getSummaryRefreshS();
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_RELAY_FILTER: {
+            *((uint32_t*)vp) = cfg_getRelayFilter();
+            return sizeof(uint32_t);
+        }
+        case DCFG_KEY_RELAY_MASK: {
+            *((uint32_t*)vp) = cfg_getRelayMask();
+            return sizeof(uint32_t);
+        }
+        case DCFG_KEY_RELAY_MAX_IDS: {
+            *vp = cfg_getRelayMaxIds();
+            return sizeof(uint8_t);
+        }
+        case DCFG_KEY_RELAY_RATE: {
+            *((uint16_t*)vp) = cfg_getRelayRateMs();
+            return sizeof(uint16_t);
+        }
         default:
             return 0;
     }
 }
 // Set key value, return real key length
 int cfg_setByKey(uint16_t key, uint8_t* vp, int len) {
+    if (key>=DCFG_KEY_ADV_SLOT_0 && key<(DCFG_KEY_ADV_SLOT_0+CFG_ADV_SLOTS)) {
+        cfg_setAdvSlot(key-DCFG_KEY_ADV_SLOT_0, (vp[0] | (vp[1]<<8)), vp[2]);
+        return 4;
+    }
     switch (key) {
         case DCFG_KEY_MAJOR: {
             cfg_setMajor_Value(*((uint16_t*)vp));
@@ -360,13 +715,74 @@ int cfg_setByKey(uint16_t key, uint8_t* vp, int len) {
             configUpdateRequest();
             return PASSWORD_LEN;
         }
+        case DCFG_KEY_BLE_COALESCE: {
+            cfg_setBleCoalesceMs(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_ADV_SLOT_MS: {
+            cfg_setAdvSlotMs(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_BATT_PERIOD: {
+            cfg_setBattPeriodS(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_RESET_COUNT: {
+            cfg_setResetCount(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_POL_ON: {
+            cfg_setAdvPolicyOn(*((bool*)vp));
+            return sizeof(bool);
+        }
+        case DCFG_KEY_POL_BATT_LOW: {
+            cfg_setAdvPolicyBattLowMv(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_POL_BATT_CRIT: {
+            cfg_setAdvPolicyBattCritMv(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_POL_BOOST: {
+            cfg_setAdvPolicyBoostS(*vp);
+            return sizeof(uint8_t);
+        }
+        case DCFG_KEY_POL_IDLE: {
+            cfg_setAdvPolicyIdleMin(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_SUMMARY_REFRESH: {
+            cfg_setSummaryRefreshS(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
+        case DCFG_KEY_RELAY_FILTER: {
+            cfg_setRelayFilter(*((uint32_t*)vp), cfg_getRelayMask());
+            return sizeof(uint32_t);
+        }
+        case DCFG_KEY_RELAY_MASK: {
+            cfg_setRelayFilter(cfg_getRelayFilter(), *((uint32_t*)vp));
+            return sizeof(uint32_t);
+        }
+        case DCFG_KEY_RELAY_MAX_IDS: {
+            cfg_setRelayMaxIds(*vp);
+            return sizeof(uint8_t);
+        }
+        case DCFG_KEY_RELAY_RATE: {
+            cfg_setRelayRateMs(*((uint16_t*)vp));
+            return sizeof(uint16_t);
+        }
         default:
             return 0;       // not found
     }
 }
+// Keys shown by AT+GETCFG with no key, in this order
+static const uint16_t KEYS[] = {DCFG_KEY_MAJOR, DCFG_KEY_MINOR, DCFG_KEY_ADV_INT, DCFG_KEY_TXPOW, 
+                        DCFG_KEY_UUID, DCFG_KEY_COMP_ID, DCFG_KEY_PASS, DCFG_KEY_CONNECTABLE, DCFG_KEY_IBEACONNING,
+                        DCFG_KEY_BLE_COALESCE, DCFG_KEY_ADV_SLOT_MS, DCFG_KEY_BATT_PERIOD, DCFG_KEY_RESET_COUNT,
+                        DCFG_KEY_ADV_SLOT_0, DCFG_KEY_ADV_SLOT_0+1, DCFG_KEY_ADV_SLOT_0+2, DCFG_KEY_ADV_SLOT_0+3, DCFG_KEY_ADV_SLOT_0+4, DCFG_KEY_ADV_SLOT_0+5, DCFG_KEY_SUMMARY_REFRESH,
+                        DCFG_KEY_ADV_SLOT_0+6, DCFG_KEY_RELAY_FILTER, DCFG_KEY_RELAY_MASK, DCFG_KEY_RELAY_MAX_IDS, DCFG_KEY_RELAY_RATE,
+                        DCFG_KEY_POL_ON, DCFG_KEY_POL_BATT_LOW, DCFG_KEY_POL_BATT_CRIT, DCFG_KEY_POL_BOOST, DCFG_KEY_POL_IDLE};
 int cfg_iterateKeys(void* odev, PK_CB_T pkcb) {
-    static uint16_t KEYS[] = {DCFG_KEY_MAJOR, DCFG_KEY_MINOR, DCFG_KEY_ADV_INT, DCFG_KEY_TXPOW, 
-                        DCFG_KEY_UUID, DCFG_KEY_COMP_ID, DCFG_KEY_PASS, DCFG_KEY_CONNECTABLE, DCFG_KEY_IBEACONNING};
     uint8_t d[16];
     for(int i=0; i<(sizeof(KEYS)/sizeof(KEYS[0]));i++) {
         int l = cfg_getByKey(KEYS[i], &d[0], 16);
@@ -374,3 +790,9 @@ int cfg_iterateKeys(void* odev, PK_CB_T pkcb) {
     }
     return sizeof(KEYS)/sizeof(KEYS[0]);
 }
+uint16_t cfg_getKeyAt(int i) {
+    if (i<0 || i>=(sizeof(KEYS)/sizeof(KEYS[0]))) {
+        return DCFG_KEY_ILLEGAL;
+    }
+    return KEYS[i];
+}
@@ -141,6 +141,24 @@ bool ibs_scan_stop()
 int ibs_scan_getTableSize() {
     return _ctx.ibs_scan_result_index;
 }
+// Entry i of the table (false past the end)
+bool ibs_scan_get(int i, ibs_scan_result_t* out) {
+    if (i<0 || i>=_ctx.ibs_scan_result_index) {
+        return false;
+    }
+    *out = _ctx.ibs_scan_results[i];
+    return true;
+}
+int ibs_scan_takeRecent(ibs_scan_result_t* out, int max) {
+    int n = 0;
+    for(int i=0; i<_ctx.ibs_scan_result_index && n<max; i++) {
+        if (_ctx.ibs_scan_results[i].recent) {
+            _ctx.ibs_scan_results[i].recent = false;
+            out[n++] = _ctx.ibs_scan_results[i];
+        }
+    }
+    return n;
+}
 
 void ibs_handle_advert(const ble_gap_evt_adv_report_t * p_adv_report) 
 {
@@ -204,6 +222,7 @@ static void ibs_scan_add(const uint8_t* remoteaddr, const uint8_t* data, int8_t
             // update RSSI
             // If rssi changes 'significantly' from the first time, then resend on uart?
             _ctx.ibs_scan_results[i].rssi = rssi;
+            _ctx.ibs_scan_results[i].recent = true;
             return;
         }
     }
@@ -212,6 +231,7 @@ static void ibs_scan_add(const uint8_t* remoteaddr, const uint8_t* data, int8_t
     ib->major = major;
     ib->minor = minor;
     ib->rssi = rssi;
+    ib->recent = true;
     
     uint8_t meas_pow = data[IBS_IBEACON_MEAS_POWER_OFFSET];
     // Create output line (all values in hex) : MAJHEX,MINHEX,XTRA,RSSI,remote device address
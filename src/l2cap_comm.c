@@ -0,0 +1,367 @@
+/* l2cap_comm.c : L2CAP connection oriented channel used as an alternative to the NUS for the communication with a remote BLE
+ * (AT commands, passthru). SDUs are much bigger than notifications, and the peer's credits do the flow control, so bulk
+ * transfers go faster with fewer wakeups. One channel at a time, opened by the remote (we are the peripheral).
+ */
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "bsp_minew_nrf52.h"
+#include "ble.h"
+#include "ble_l2cap.h"
+#include "app_util_platform.h"
+#include "nrf_sdh_ble.h"
+
+#include "wutils.h"
+
+#include "main.h"
+#include "at_process.h"
+#include "comm_ble.h"
+#include "comm_l2cap.h"
+
+#if COMM_L2CAP_ENABLED
+
+#ifndef COMM_L2CAP_PSM
+#define COMM_L2CAP_PSM          (0x0081)        // dynamic LE_PSM range is 0x0080-0x00FF
+#endif
+#define L2CAP_MTU               (1024)          // biggest SDU each way
+#define L2CAP_MPS               (NRF_SDH_BLE_GAP_DATA_LENGTH-4)    // PDU payload that fits in one LL packet
+#define L2CAP_RX_BUFS           (2)             // SDU buffers lent to the softdevice for rx (the peer gets credits for these)
+#define L2CAP_TX_BUFS           (2)             // and SDUs in flight
+#define MAX_RX_LINE             (250)
+// TX queue for data waiting for a free SDU buffer. Size MUST BE POWER OF 2.
+#define L2CAP_TXQ_SIZE          (2048)
+#define L2CAP_TXQ_HIGH_WM       (L2CAP_TXQ_SIZE-256)
+#define L2CAP_TXQ_LOW_WM        (512)
+#define TXQ_COUNT() ((uint16_t)(_ctx.txqHead-_ctx.txqTail))
+
+#define APP_BLE_OBSERVER_PRIO   3
+
+static void comm_l2cap_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context);
+NRF_SDH_BLE_OBSERVER(m_l2cap_observer, APP_BLE_OBSERVER_PRIO, comm_l2cap_on_ble_evt, NULL);
+
+static struct {
+    volatile bool open;                 // channel is set up
+    volatile bool discReq;              // released, tell at processor from main loop
+    uint16_t conn_handle;
+    uint16_t cid;
+    uint16_t txMtu;                     // biggest SDU the peer takes
+    // rx : the SDU buffers are the queue. The softdevice fills them in the order we give them, and we give each one back
+    // once the main loop has used it (so a slow main loop holds back the peer's credits rather than losing data)
+    uint8_t rxSdu[L2CAP_RX_BUFS][L2CAP_MTU];
+    volatile bool rxFull[L2CAP_RX_BUFS];       // softdevice has given that buffer back with an SDU (which can be empty)
+    volatile uint16_t rxLen[L2CAP_RX_BUFS];    // and its length
+    uint8_t rxNext;                     // next buffer to be filled
+    uint16_t rxOff;                     // data in it already used (raw mode, when the other side couldn't take it all)
+    uint8_t rx_buf[MAX_RX_LINE];
+    uint16_t rx_index;
+    // tx
+    uint8_t txSdu[L2CAP_TX_BUFS][L2CAP_MTU];
+    volatile bool txBusy[L2CAP_TX_BUFS];
+    uint8_t txq[L2CAP_TXQ_SIZE];
+    volatile uint16_t txqHead;
+    volatile uint16_t txqTail;
+    volatile bool txqBlocked;
+    UART_TX_READY_FN_T tx_ready_fn;
+    uint32_t nbCh;                      // channels opened
+    uint32_t rxC;
+    uint32_t rxL;
+    uint32_t rxN;                       // SDUs received
+    uint32_t txC;
+    uint32_t txN;                       // SDUs sent
+    uint32_t txLfc;
+} _ctx;
+
+static void comm_l2cap_txq_drain(void);
+static void comm_l2cap_rx_give(int i);
+static void comm_l2cap_closed(void);
+
+// Softdevice needs to know how much to allocate per connection for L2CAP
+uint32_t comm_l2cap_cfg_set(uint8_t conn_cfg_tag, uint32_t ram_start) {
+    ble_cfg_t ble_cfg;
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag = conn_cfg_tag;
+    ble_cfg.conn_cfg.params.l2cap_conn_cfg.rx_mps = L2CAP_MPS;
+    ble_cfg.conn_cfg.params.l2cap_conn_cfg.tx_mps = L2CAP_MPS;
+    ble_cfg.conn_cfg.params.l2cap_conn_cfg.rx_queue_size = L2CAP_RX_BUFS;
+    ble_cfg.conn_cfg.params.l2cap_conn_cfg.tx_queue_size = L2CAP_TX_BUFS;
+    ble_cfg.conn_cfg.params.l2cap_conn_cfg.ch_count = 1;
+    return sd_ble_cfg_set(BLE_CONN_CFG_L2CAP, &ble_cfg, ram_start);
+}
+
+bool comm_l2cap_isConnected(void) {
+    return _ctx.open;
+}
+
+// Tx on the channel. returns number of bytes not sent due to flow control or -1 if no channel. Data goes in the tx queue and from
+// there into SDUs as buffers come free, so while both are in flight the data behind them builds up into one bigger SDU.
+// A write with len 0 is the flush hint, which is what we do anyway.
+int comm_l2cap_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    if (!_ctx.open) {
+        return -1;
+    }
+    if (data==NULL) {
+        log_info("l2cap:release request");
+        sd_ble_l2cap_ch_release(_ctx.conn_handle, _ctx.cid);
+        return 0;
+    }
+    _ctx.tx_ready_fn = tx_ready;
+    if (len<=0) {
+        return 0;
+    }
+    if (_ctx.txqBlocked) {
+        _ctx.txLfc++;
+        return len;     // come back when we call tx_ready
+    }
+    int off = 0;
+    while(off<len && TXQ_COUNT()<L2CAP_TXQ_SIZE) {
+        _ctx.txq[_ctx.txqHead & (L2CAP_TXQ_SIZE-1)] = data[off++];
+        _ctx.txqHead++;
+    }
+    if (TXQ_COUNT()>=L2CAP_TXQ_HIGH_WM) {
+        _ctx.txqBlocked = true;
+    }
+    if (off<len) {
+        _ctx.txLfc++;
+    }
+    comm_l2cap_txq_drain();
+    comm_ble_linkTraffic(_ctx.conn_handle, off);
+    return len-off;
+}
+
+// Fill free SDU buffers from the queue and give them to the softdevice
+// Called from main loop and the CH_TX event, so protected against itself
+static void comm_l2cap_txq_drain(void) {
+    bool ready = false;
+    CRITICAL_REGION_ENTER();
+    for(int b=0;b<L2CAP_TX_BUFS && _ctx.open && TXQ_COUNT()>0;b++) {
+        if (_ctx.txBusy[b]) {
+            continue;
+        }
+        int n = TXQ_COUNT();
+        if (n>_ctx.txMtu) {
+            n = _ctx.txMtu;
+        }
+        for(int i=0;i<n;i++) {
+            _ctx.txSdu[b][i] = _ctx.txq[(_ctx.txqTail+i) & (L2CAP_TXQ_SIZE-1)];
+        }
+        ble_data_t sdu = { .p_data = &_ctx.txSdu[b][0], .len = n };
+        uint32_t err_code = sd_ble_l2cap_ch_tx(_ctx.conn_handle, _ctx.cid, &sdu);
+        if (err_code==NRF_ERROR_RESOURCES) {
+            break;          // softdevice queue full, goes on CH_TX
+        } else if (err_code!=NRF_SUCCESS) {
+            log_warn("l2cap:tx error %d", err_code);
+            break;
+        }
+        _ctx.txBusy[b] = true;
+        _ctx.txqTail += n;
+        _ctx.txC += n;
+        _ctx.txN++;
+    }
+    ready = (_ctx.txqBlocked && TXQ_COUNT()<=L2CAP_TXQ_LOW_WM);
+    if (ready) {
+        _ctx.txqBlocked = false;
+    }
+    CRITICAL_REGION_EXIT();
+    if (ready && _ctx.tx_ready_fn!=NULL) {
+        (*_ctx.tx_ready_fn)(&comm_l2cap_tx);
+    }
+}
+
+// Lend an rx buffer (back) to the softdevice
+static void comm_l2cap_rx_give(int i) {
+    _ctx.rxFull[i] = false;
+    _ctx.rxLen[i] = 0;
+    ble_data_t sdu = { .p_data = &_ctx.rxSdu[i][0], .len = L2CAP_MTU };
+    uint32_t err_code = sd_ble_l2cap_ch_rx(_ctx.conn_handle, _ctx.cid, &sdu);
+    if (err_code!=NRF_SUCCESS) {
+        log_warn("l2cap:rx buffer refused %d", err_code);
+    }
+}
+
+// Call this from main loop to process received SDUs : as lines for the at processor, or straight to the other side in raw mode
+void comm_l2cap_processRX(void) {
+    if (_ctx.discReq) {
+        _ctx.discReq = false;
+        // Tell at cmd processor by sending disc at command
+        at_process_input("AT+DISC", &comm_l2cap_tx);
+        return;
+    }
+    // Buffers are given back in the order they were filled, empty SDUs too (or rxNext would wait on the wrong one)
+    while(_ctx.open && _ctx.rxFull[_ctx.rxNext]) {
+        uint8_t* sdu = &_ctx.rxSdu[_ctx.rxNext][0];
+        uint16_t len = _ctx.rxLen[_ctx.rxNext];
+        while(_ctx.rxOff<len) {
+            if (at_process_isRaw(&comm_l2cap_tx)) {
+                int left = at_process_rawInput(&sdu[_ctx.rxOff], len-_ctx.rxOff, &comm_l2cap_tx);
+                if (left>0) {
+                    _ctx.rxOff = len-left;
+                    return;         // other side is full : keep the buffer (and so the peer's credits) until it isn't
+                }
+                _ctx.rxOff = len;
+                break;
+            }
+            if (!at_process_outReady()) {
+                return;             // at processor output is backed up : keep the rest of the SDU until it isn't
+            }
+            uint8_t c = sdu[_ctx.rxOff++];
+            // Don't take nulls
+            if (c==0) {
+                continue;
+            }
+            _ctx.rx_buf[_ctx.rx_index] = c;
+            if (c=='\r' || c=='\n' || _ctx.rx_index>=(MAX_RX_LINE-2)) {
+                if (_ctx.rx_index>0) {
+                    _ctx.rx_buf[_ctx.rx_index++] = '\n';
+                    _ctx.rx_buf[_ctx.rx_index] = 0;
+                    at_process_input((char*)(&_ctx.rx_buf[0]), &comm_l2cap_tx);
+                    _ctx.rxL++;
+                }
+                _ctx.rx_index = 0;
+            } else {
+                _ctx.rx_index++;
+            }
+        }
+        _ctx.rxOff = 0;
+        if (_ctx.open) {
+            comm_l2cap_rx_give(_ctx.rxNext);
+        }
+        _ctx.rxNext = (_ctx.rxNext+1) % L2CAP_RX_BUFS;
+    }
+}
+
+void comm_l2cap_print_stats(PRINTF_FN_T printf, void* odev) {
+    (*printf)(odev, "L:%d,%d,%d,%d,%d,%d, C%d,%d", _ctx.rxC, _ctx.rxL, _ctx.rxN, _ctx.txC, _ctx.txN, _ctx.txLfc, _ctx.nbCh, (_ctx.open?1:0));
+}
+
+// Channel gone (released by either side, or the link dropped)
+static void comm_l2cap_closed(void) {
+    if (!_ctx.open) {
+        return;
+    }
+    log_info("l2cap:channel closed");
+    _ctx.open = false;
+    _ctx.discReq = true;
+    _ctx.tx_ready_fn = NULL;
+    clear_authentication(&comm_l2cap_tx);
+    at_process_outGone(&comm_l2cap_tx);
+}
+
+static void comm_l2cap_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context) {
+    ble_l2cap_evt_t const* p_evt = &p_ble_evt->evt.l2cap_evt;
+    switch (p_ble_evt->header.evt_id) {
+        case BLE_L2CAP_EVT_CH_SETUP_REQUEST: {
+            ble_l2cap_ch_setup_params_t params;
+            memset(&params, 0, sizeof(params));
+            uint16_t cid = p_evt->local_cid;
+            if (p_evt->params.ch_setup_request.le_psm!=COMM_L2CAP_PSM) {
+                params.status = BLE_L2CAP_CH_STATUS_CODE_LE_PSM_NOT_SUPPORTED;
+            } else if (_ctx.open) {
+                params.status = BLE_L2CAP_CH_STATUS_CODE_NO_RESOURCES;       // one at a time
+            } else {
+                // First rx buffer goes with the reply, the others once its set up
+                params.status = BLE_L2CAP_CH_STATUS_CODE_SUCCESS;
+                params.rx_params.rx_mtu = L2CAP_MTU;
+                params.rx_params.rx_mps = L2CAP_MPS;
+                params.rx_params.sdu_buf.p_data = &_ctx.rxSdu[0][0];
+                params.rx_params.sdu_buf.len = L2CAP_MTU;
+            }
+            uint32_t err_code = sd_ble_l2cap_ch_setup(p_evt->conn_handle, &cid, &params);
+            if (err_code!=NRF_SUCCESS) {
+                log_warn("l2cap:setup reply failed %d", err_code);
+            }
+            break;
+        }
+        case BLE_L2CAP_EVT_CH_SETUP: {
+            _ctx.conn_handle = p_evt->conn_handle;
+            _ctx.cid = p_evt->local_cid;
+            _ctx.txMtu = p_evt->params.ch_setup.tx_params.tx_mtu;
+            if (_ctx.txMtu>L2CAP_MTU) {
+                _ctx.txMtu = L2CAP_MTU;
+            }
+            memset((void*)&_ctx.rxFull[0], 0, sizeof(_ctx.rxFull));
+            memset((void*)&_ctx.rxLen[0], 0, sizeof(_ctx.rxLen));
+            memset((void*)&_ctx.txBusy[0], 0, sizeof(_ctx.txBusy));
+            _ctx.rxNext = 0;
+            _ctx.rxOff = 0;
+            _ctx.rx_index = 0;
+            _ctx.txqHead = _ctx.txqTail = 0;
+            _ctx.txqBlocked = false;
+            _ctx.discReq = false;
+            // password check has not been validated for this channel
+            clear_authentication(&comm_l2cap_tx);
+            _ctx.open = true;
+            _ctx.nbCh++;
+            for(int i=1;i<L2CAP_RX_BUFS;i++) {
+                comm_l2cap_rx_give(i);
+            }
+            log_info("l2cap:channel up, tx mtu %d, %d credits", _ctx.txMtu, p_evt->params.ch_setup.tx_params.credits);
+            break;
+        }
+        case BLE_L2CAP_EVT_CH_SETUP_REFUSED:
+            log_info("l2cap:setup refused %d", p_evt->params.ch_setup_refused.status);
+            break;
+        case BLE_L2CAP_EVT_CH_RELEASED:
+            if (_ctx.open && p_evt->conn_handle==_ctx.conn_handle && p_evt->local_cid==_ctx.cid) {
+                comm_l2cap_closed();
+            }
+            break;
+        case BLE_L2CAP_EVT_CH_RX: {
+            if (!_ctx.open || p_evt->local_cid!=_ctx.cid) {
+                break;
+            }
+            int i = (p_evt->params.rx.sdu_buf.p_data-&_ctx.rxSdu[0][0])/L2CAP_MTU;
+            if (i<0 || i>=L2CAP_RX_BUFS) {
+                break;
+            }
+            uint16_t len = p_evt->params.rx.sdu_len;
+            if (len>L2CAP_MTU) {
+                len = L2CAP_MTU;
+            }
+            _ctx.rxC += len;
+            _ctx.rxN++;
+            comm_ble_linkTraffic(_ctx.conn_handle, len);
+            // main loop gives it back when its done with it, in turn even if its empty
+            _ctx.rxLen[i] = len;
+            _ctx.rxFull[i] = true;
+            break;
+        }
+        case BLE_L2CAP_EVT_CH_TX: {
+            for(int b=0;b<L2CAP_TX_BUFS;b++) {
+                if (p_evt->params.tx.sdu_buf.p_data==&_ctx.txSdu[b][0]) {
+                    _ctx.txBusy[b] = false;
+                }
+            }
+            comm_l2cap_txq_drain();
+            break;
+        }
+        case BLE_L2CAP_EVT_CH_SDU_BUF_RELEASED:
+            // we reset all the buffers when the next channel is set up
+            break;
+        case BLE_GAP_EVT_DISCONNECTED:
+            if (_ctx.open && p_ble_evt->evt.gap_evt.conn_handle==_ctx.conn_handle) {
+                comm_l2cap_closed();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+#else   /* COMM_L2CAP_ENABLED */
+
+uint32_t comm_l2cap_cfg_set(uint8_t conn_cfg_tag, uint32_t ram_start) {
+    return NRF_SUCCESS;
+}
+bool comm_l2cap_isConnected(void) {
+    return false;
+}
+void comm_l2cap_processRX(void) {
+}
+int comm_l2cap_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
+    return -1;
+}
+void comm_l2cap_print_stats(PRINTF_FN_T printf, void* odev) {
+}
+
+#endif  /* COMM_L2CAP_ENABLED */
@@ -27,6 +27,8 @@
 
 #include "ble.h"
 #include "ble_conn_params.h"
+#include "ble_conn_state.h"
+#include "ble_radio_notification.h"
 //#include "ble_db_discovery.h"
 #include "ble_gap.h"
 #include "ble_nus.h"
@@ -36,7 +38,6 @@
 //#include "ble_hci.h"
 //#include "ble_gatts.h"
 #include "ble_advdata.h"
-#include "ble_advertising.h"
 #include "nrf_ble_gatt.h"
 #include "nrf_ble_qwr.h"
 #include "nrf_sdh.h"
@@ -54,6 +55,9 @@
 #include "main.h"
 #include "comm_uart.h"
 #include "comm_ble.h"
+#include "comm_l2cap.h"
+#include "at_process.h"
+#include "bench.h"
 #include "ble_wakehost.h"
 #include "device_config.h"
 
@@ -74,7 +78,6 @@
 
 #define NRF_BLE_MAX_MTU_SIZE    NRF_SDH_BLE_GATT_MAX_MTU_SIZE   /**< MTU size used in the softdevice enabling and to reply to a BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST event. */
 #define APP_SOC_OBSERVER_PRIO           1                                           /**< Applications SOC event observer priority (must be <2) */
-#define APP_BLE_CONN_CFG_TAG            1                                           /**< A tag identifying the SoftDevice BLE configuration. */
 #define APP_BLE_OBSERVER_PRIO           3                                           /**< Application's BLE observer priority. You shouldn't need to modify this value. */
 
 #define APP_FEATURE_NOT_SUPPORTED       BLE_GATT_STATUS_ATTERR_APP_BEGIN + 2        /**< Reply when unsupported features are requested. */
@@ -85,6 +88,15 @@
 #define MAX_CONN_INTERVAL               MSEC_TO_UNITS(75, UNIT_1_25_MS)             /**< Maximum acceptable connection interval (75 ms), Connection interval uses 1.25 ms units. */
 #define SLAVE_LATENCY                   0                                           /**< Slave latency. */
 #define CONN_SUP_TIMEOUT                MSEC_TO_UNITS(4000, UNIT_10_MS)             /**< Connection supervisory timeout (4 seconds), Supervision Timeout uses 10 ms units. */
+#define FAST_MIN_CONN_INTERVAL          MSEC_TO_UNITS(7.5, UNIT_1_25_MS)            /**< Throughput profile (passthru) minimum connection interval (7.5 ms). */
+#define FAST_MAX_CONN_INTERVAL          MSEC_TO_UNITS(15, UNIT_1_25_MS)             /**< Throughput profile (passthru) maximum connection interval (15 ms). */
+#define IDLE_MIN_CONN_INTERVAL          MSEC_TO_UNITS(100, UNIT_1_25_MS)            /**< Idle profile (no NUS traffic) minimum connection interval (100 ms). */
+#define IDLE_MAX_CONN_INTERVAL          MSEC_TO_UNITS(200, UNIT_1_25_MS)            /**< Idle profile maximum connection interval (200 ms). */
+#define IDLE_SLAVE_LATENCY              4                                           /**< Idle profile slave latency : we only listen every 5th event (up to 1s) */
+// Idle profile must be one the conn params module accepts, and that the spec allows : (1+latency)*max interval*2 < supervision timeout
+STATIC_ASSERT(IDLE_SLAVE_LATENCY <= NRF_BLE_CONN_PARAMS_MAX_SLAVE_LATENCY_DEVIATION);
+STATIC_ASSERT((1+IDLE_SLAVE_LATENCY)*IDLE_MAX_CONN_INTERVAL*125*2 < CONN_SUP_TIMEOUT*1000);
+#define APP_WRITE_CMD_TX_QUEUE_SIZE     4                                           /**< Write commands the softdevice can queue per connection (central passthru) */
 #define FIRST_CONN_PARAMS_UPDATE_DELAY  APP_TIMER_TICKS(5000)  /**< Time from initiating event (connect or start of notification) to first time sd_ble_gap_conn_param_update is called (5 seconds). */
 #define NEXT_CONN_PARAMS_UPDATE_DELAY   APP_TIMER_TICKS(30000) /**< Time between each call to sd_ble_gap_conn_param_update after the first call (30 seconds). */
 #define MAX_CONN_PARAMS_UPDATE_COUNT    3                                           /**< Number of attempts before giving up the connection parameter negotiation. */
@@ -99,7 +111,16 @@
 #define SLAVE_LATENCY           0                               /**< Determines slave latency in counts of connection events. */
 #define SUPERVISION_TIMEOUT     MSEC_TO_UNITS(4000, UNIT_10_MS) /**< Determines supervision time-out in units of 10 millisecond. */
 
-#define APP_BATTERY_TIME_PERIOD APP_TIMER_TICKS(10000)           /* convert ms to ticks for apptimer */
+#define APP_BATT_MV_FULL        3000                            /* battery level 100% at or above this */
+#define APP_BATT_MV_EMPTY       2000                            /* and 0% at or below this (linear in between) */
+#define APP_RESET_DELAY APP_TIMER_TICKS(200)                    /* time for last responses to get out before reset */
+// Radio notification : work that competes with the radio (flash) is started at the beginning of a radio-inactive window.
+// The inactive signal is configured once at init (the softdevice won't change it while the radio is in use), and the app only
+// looks at it while such work is waiting (see app_setRadioNotify).
+#define RADIO_NOTIF_DISTANCE    NRF_RADIO_NOTIFICATION_DISTANCE_800US   /* needed by the init, unused for the inactive signal */
+#define RADIO_WINDOW_MS         (3)                             /* started this soon after the radio goes inactive : has the whole gap */
+#define RADIO_QUIET_MS          (100)                           /* no radio event for this long : radio idle, any time will do */
+#define RADIO_WAIT_MAX_MS       (1000)                          /* never defer for longer than this */
 //WBeacon
 #define APP_BEACON_INFO_LENGTH          0x17                                    /**< Total length of information advertised by the Beacon. */
 #define APP_CFG_NON_CONN_ADV_TIMEOUT    0                                   /**< Time for which the device must be advertising in non-connectable mode (in seconds). 0 disables timeout. */
@@ -108,12 +129,67 @@
 
 // for cycling between advert packet types
 #define APP_ADV_INTERVAL_MS_SLOW        500                                          /**< The advertising interval when not actively beaconing (in units of ms). */
-#define APP_ADV_TIMEOUT_IN_SECONDS       1                                         /**< The advertising timeout (in units of seconds). */
-typedef enum { ADVERT_TYPE_IBEACON=0, ADVERT_TYPE_TELEMETRY, ADVERT_TYPE_LAST } advtype_t;
+// Advert types, one per slot of the rotation. Value is the slot index in the config (DCFG_KEY_ADV_SLOT_0+type)
+typedef enum { ADVERT_TYPE_IBEACON=0, ADVERT_TYPE_TELEMETRY, ADVERT_TYPE_CONNECT, ADVERT_TYPE_EDDY_UID, ADVERT_TYPE_EDDY_TLM, ADVERT_TYPE_SUMMARY, ADVERT_TYPE_RELAY, ADVERT_TYPE_LAST } advtype_t;
+STATIC_ASSERT(ADVERT_TYPE_LAST == CFG_ADV_SLOTS);
+#define EDDYSTONE_UUID                  0xFEAA
+#define EDDY_FRAME_UID                  0x00
+#define EDDY_FRAME_TLM                  0x20
+#define EDDY_UID_FRAME_LENGTH           20
+#define EDDY_TLM_FRAME_LENGTH           14
+// Telemetry advert : manufacturer data record of live health values, for gateways to monitor without connecting.
+// Little endian : version, battery mV (2), die temp C (1, signed), uptime minutes (3), resets (2), beacons in the scan
+// table (1), uart rx errors (2), NUS rx bytes lost (2). Counters saturate.
+// Adaptive advertising policy rules (thresholds are in the config)
+#define ADV_POL_BOOST                   (1<<0)          // after a button press or wakeup write : 4x faster
+#define ADV_POL_BATT_LOW                (1<<1)          // 2x slower, 4dB less
+#define ADV_POL_BATT_CRIT               (1<<2)          // 4x slower, 8dB less (and no boost)
+#define ADV_POL_IDLE                    (1<<3)          // no connection for a long time : connectable advert gets 1/4 of its slots
+#define ADV_POL_BOOST_MIN_MS            100             // boost doesn't go faster than this
+#define ADV_POL_TX_MIN                  (-20)           // battery saving doesn't take tx power below this (unless configured lower)
+#define TELEM_COMPANY_ID                0xFFFF          // 'no company' id, for test/internal use
+#define TELEM_VERSION                   0x01
+#define TELEM_RECORD_LENGTH             14
+// Scan summary advert : beacons seen since the last summary, as manufacturer data (same company id) in an extended advert
+// on the 2M PHY. Record : type, sequence, count, then per beacon, sorted by major/minor : the LEB128 varint of
+// major<<16|minor less the previous beacon's (0 for the first), and its rssi.
+#define SUMMARY_TYPE                    0x10
+#define SUMMARY_HEADER_LENGTH           3
+#define SUMMARY_MAX_LENGTH              (BLE_GAP_ADV_SET_DATA_SIZE_EXTENDED_MAX_SUPPORTED-4)     // less AD length/type, company id
+#define SUMMARY_MAX_ENTRIES             ((SUMMARY_MAX_LENGTH-SUMMARY_HEADER_LENGTH)/2)          // 2 bytes each at best
+#define BEACON_KEY(r)                   ((((uint32_t)(r).major)<<16) | (r).minor)
+// Relay advert : one scanned beacon matching the relay filter, re-advertised for gateways out of its range. Record (same
+// company id, little endian) : type, hops, major, minor, rssi it was heard at, relayer major, minor. Only direct
+// sightings are relayed (relay adverts aren't scanned), so hops is always 1.
+#define RELAY_TYPE                      0x20
+#define RELAY_RECORD_LENGTH             11
+#define RELAY_IDS_MAX                   32              // cap on the DCFG_KEY_RELAY_MAX_IDS config
+typedef struct {
+    uint32_t key;                       // major<<16|minor
+    uint8_t rssi;
+    bool seen;                          // still in the scan table
+} relay_id_t;
+typedef struct {
+    uint16_t battMv;
+    int8_t temp;
+    uint32_t upMins;
+    uint16_t resets;
+    uint8_t scanned;
+    uint16_t uartErrs;
+    uint16_t nusLost;
+} telem_t;
+// Encoded advert (and scan response) of one type, valid for the config generation it was made from
+typedef struct {
+    bool valid;
+    uint32_t gen;
+    ble_gap_adv_data_t data;            // points to adv/sr
+    int8_t txPower;                     // it was made for (in the scan response / power byte)
+    uint8_t adv[BLE_GAP_ADV_SET_DATA_SIZE_EXTENDED_MAX_SUPPORTED];    // legacy adverts only use the first 31
+    uint8_t sr[BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+} adv_cache_t;
 // Our applicatio context
 static struct app_context {
-    //UART Variables
-    uint16_t                m_conn_handle;    /**< Handle of the current GAP connection. */
+    // Connections are tracked by ble_conn_state (for the link count) and comm_ble (for the NUS links)
     // TODO we don't need to have a gatt server db unless acting as the central to talk to periphs? Takes up a lot of memory
 //    ble_db_discovery_t      m_ble_db_discovery;             /**< Instance of database discovery module. Must be passed to all db_discovert API calls */
     // config
@@ -123,8 +199,69 @@ static struct app_context {
     char advName[20];
     int8_t txPower;
     advtype_t advertType;
+    adv_cache_t advCache[ADVERT_TYPE_LAST];
+    uint32_t nameGen;                   // config generation the device name was set from
+    bool advRunning;                    // adv set started and not yet terminated or connected
+    // stats
+    uint32_t advRotations;
+    uint32_t advEncodes;
+    uint32_t advTicks;                  // time spent in advertising_check_start() setting up the next advert
+    // slot scheduler
+    int16_t advCredit[ADVERT_TYPE_LAST];
+    uint32_t advPicks[ADVERT_TYPE_LAST];
+    uint32_t advLastTick;
+    // advertising set (driven directly, configured once and then updated in place)
+    uint8_t advHandle;
+    ble_gap_adv_params_t advParams;
+    int8_t advTxPower;                  // tx power applied to the set
+    uint8_t advAirIdx;                  // which of advAir the softdevice is using
+    ble_gap_adv_data_t advAir[2];
+    bool advExtended;                   // set is configured for an extended advert
+    uint8_t advAirAdv[2][BLE_GAP_ADV_SET_DATA_SIZE_EXTENDED_MAX_SUPPORTED];
+    uint8_t advAirSr[2][BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+    uint32_t advRestarts;
+    uint32_t advSwaps;
+    uint64_t upTicks;                   // uptime (for the TLM)
+    // battery : measured every BATT_PERIOD, everyone else uses these
+    uint16_t battMv;
+    uint8_t battPercent;
+    uint32_t battReads;
+    uint32_t advPdus;                   // adverts sent (estimated from the time advertising and the interval)
+    // telemetry advert : values in its cached encoding, and where the record is in it (so it can be patched in place)
+    telem_t telem;
+    uint8_t telemRecord[TELEM_RECORD_LENGTH];
+    uint8_t* telemAdv;
+    uint32_t telemPatches;
+    // radio notification
+    volatile bool radioNotify;          // someone is waiting for a window : track the inactive signal
+    volatile bool radioSeen;            // inactive signal seen since radioNotifyTick
+    uint32_t radioNotifyTick;           // when tracking started
+    volatile uint32_t radioIdleTick;    // when it last went inactive
+    volatile uint32_t radioEvents;
+    bool radioWaiting;                  // someone is waiting for a window since radioWaitTick
+    uint32_t radioWaitTick;
+    uint32_t radioDeferred;             // times app_isRadioWindow() said to wait
+    uint32_t radioForced;               // and gave up waiting
+    uint32_t ramStartLink;              // app RAM start from the linker script
+    uint32_t ramStartNeeded;            // and the lowest the softdevice says it can be with our BLE config
+    // adaptive advertising policy
+    uint8_t polFlags;                   // ADV_POL_xxx rules applied to the current advert
+    uint64_t boostUntil;                // uptime ticks
+    uint64_t lastConnUp;                // uptime ticks at the last connection or disconnection
+    // scan summary advert
+    uint8_t summary[SUMMARY_MAX_LENGTH];
+    uint8_t summaryLen;
+    uint8_t summarySeq;
+    uint64_t summaryUp;                 // uptime ticks when it was made
+    ibs_scan_result_t summaryScan[SUMMARY_MAX_ENTRIES];
+    // relay : beacons being relayed (in the order they were first heard), the next to go, and when the last went
+    relay_id_t relayIds[RELAY_IDS_MAX];
+    uint8_t relayCount;
+    uint8_t relayNext;
+    uint64_t relayUp;
+    uint8_t relayRecord[RELAY_RECORD_LENGTH];
+    uint32_t relaySent;
 } _ctx = {
-    .m_conn_handle = BLE_CONN_HANDLE_INVALID, 
     .advertType = ADVERT_TYPE_IBEACON,
 };
 /** Nordic service modules are all direct ble event observers - no need to call from our event handler
@@ -133,10 +270,11 @@ static struct app_context {
  */
 // Timer ids are const pointers to static structures - so nasty
 APP_TIMER_DEF(m_battery_timer_id);                                      /**< Battery timer. */
+APP_TIMER_DEF(m_reset_timer_id);                                        /**< Delay before reset. */
+APP_TIMER_DEF(m_adv_slot_timer_id);                                     /**< Advertising slot rotation. */
 BLE_BAS_DEF(m_bas);                                                     /**< Structure used to identify the battery service. */
 NRF_BLE_GATT_DEF(m_gatt);                                               /**< GATT module instance. */
-NRF_BLE_QWR_DEF(m_qwr);                                                 /**< Context for the Queued Write module.*/
-BLE_ADVERTISING_DEF(m_advertising);                                     /**< Advertising module instance. */
+NRF_BLE_QWRS_DEF(m_qwr, NRF_SDH_BLE_TOTAL_LINK_COUNT);                  /**< Context for the Queued Write module, 1 per link (by conn state index).*/
 
 static void sys_evt_handler(uint32_t evt_id, void * p_context);
 static void ble_evt_dispatch(const ble_evt_t * p_ble_evt, void* p_ctx);
@@ -146,9 +284,11 @@ NRF_SDH_SOC_OBSERVER(m_soc_observer, APP_SOC_OBSERVER_PRIO, sys_evt_handler, NUL
 // Register a handler for BLE events.
 NRF_SDH_BLE_OBSERVER(m_ble_observer, APP_BLE_OBSERVER_PRIO, ble_evt_dispatch, NULL);
 
-static void advertising_init(ble_advertising_t* p_adv_ctx, int8_t* p_txPower);
-static bool advertising_update(ble_advertising_t* p_adv_ctx, int8_t* p_txPower);
-static bool advertising_check_start();
+static void advertising_init(void);
+static bool advertising_update(advtype_t type, int8_t* p_txPower);
+static bool advertising_check_start(bool rotate);
+static uint64_t uptime_ticks(void);
+static void adv_policy_boost(void);
 static uint8_t makeAdvPowerLevel( void );
 
 static void button1_event(uint8_t pin_no, uint8_t button_action);
@@ -160,6 +300,9 @@ static app_button_cfg_t button_cfgs[BUTTONS_NUMBER] = {
 //    { .pin_no = BSP_BUTTON_3, .active_state=APP_BUTTON_ACTIVE_HIGH, .pull_cfg=GPIO_PIN_CNF_PULL_Pulldown, .button_handler = button3_event },
 };
 static void battery_update_timer_cb(void * p_context);
+static void reset_timer_cb(void * p_context);
+static void adv_slot_timer_cb(void * p_context);
+static void radio_notification_evt_handler(bool radio_active);
 
 // debug startup helpers
 static void init_stage(int s);
@@ -242,9 +385,8 @@ static void bas_evt_handler(ble_bas_t * p_bas, ble_bas_evt_t * p_evt) {
  * @details This function will be called for all events in the Connection Parameters Module
  *          which are passed to the application.
  *
- * @note All this function does is to disconnect. This could have been done by simply setting
- *       the disconnect_on_fail config parameter, but instead we use the event handler
- *       mechanism to demonstrate its use.
+ * @note A central refusing the idle or fast profile (asked for to save power or for throughput) just
+ *       puts the link back on the normal one. Only failing to get the normal parameters disconnects.
  *
  * @param[in] p_evt  Event received from the Connection Parameters Module.
  */
@@ -253,9 +395,9 @@ static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
     uint32_t err_code;
     log_info("evt:conn params evt %d", p_evt->evt_type);
 
-    if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
+    if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED && !comm_ble_cpRefused(p_evt->conn_handle))
     {
-        err_code = sd_ble_gap_disconnect(_ctx.m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
+        err_code = sd_ble_gap_disconnect(p_evt->conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
         APP_ERROR_CHECK(err_code);
         // We will get the BLE_GAP_EVT_DISCONNECTED event to restart advertising etc
     }
@@ -271,36 +413,6 @@ static void conn_params_error_handler(uint32_t nrf_error)
 }
 
  
-/**@brief Function for handling events linked to our advertising.
- *
- * @details This function will be called for advertising events which are passed to the application.
- *
- * @param[in] ble_adv_evt  Advertising event.
- */
-static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
-{
-
-    switch (ble_adv_evt)
-    {
-        case BLE_ADV_EVT_FAST:
-            //log_info("evt:advertsing FAST");
-            break;
-        case BLE_ADV_EVT_SLOW:
-            //log_info("evt:advertsing SLOW");
-            // if not being an ibeacon we are sending just NUS adverts
-            break;
-        case BLE_ADV_EVT_IDLE:
-            //log_info("evt:advertsing IDLE");
-        // BW : no sleeping on this job TODO check
-//            sleep_mode_enter();
-        break;
-        default:
-            log_info("evt:unprocessed advertsing evt %d", ble_adv_evt);
-        break;
-    }
-}
-  
-
 /**@brief Function for dispatching a BLE stack event to all modules with a BLE stack event handler.
  *
  * @details This function is called from the scheduler in the main loop after a BLE stack event has
@@ -319,42 +431,41 @@ static void ble_evt_dispatch(const ble_evt_t * p_ble_evt, void* p_ctx)
  
     switch (p_ble_evt->header.evt_id)
     {
-        case BLE_GAP_EVT_CONNECTED:
+        case BLE_GAP_EVT_CONNECTED: {
             log_info("evt:gap connect");
-            // Only allow the connection if we are configured to allow it and there is not already someone connected
+            uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+            if (p_ble_evt->evt.gap_evt.params.connected.role!=BLE_GAP_ROLE_PERIPH) {
+                break;      // we initiated it
+            }
+            _ctx.advRunning = false;        // connecting stops the advert
+            // Only allow the connection if we are configured to allow it. The softdevice won't give us more than
+            // NRF_SDH_BLE_PERIPHERAL_LINK_COUNT at once (each link gets its own NUS context in comm_ble)
             if (cfg_getConnectable()) {
-                if (_ctx.m_conn_handle==BLE_CONN_HANDLE_INVALID) {
-                    led_indication(INDICATE_CONNECTED);
-                    // Stop advertising, we only let 1 cnx at a time
-                    //sd_ble_gap_adv_stop(_ctx.adv_ctx.adv_handle);
-                    _ctx.m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
-                    err_code = nrf_ble_qwr_conn_handle_assign(&m_qwr, _ctx.m_conn_handle);
-                    APP_ERROR_CHECK(err_code);
-                    // password check has not been validated for this connection
-                    clear_authentication();
-                    log_info("evt:gap connect - connected");
-                } else {
-                    // Not allowed to connect
-                    log_info("evt:gap connect REJECTED as connection already established");
-                    err_code = sd_ble_gap_disconnect(_ctx.m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
-                    APP_ERROR_CHECK(err_code);
-                }
+                _ctx.lastConnUp = uptime_ticks();
+                led_indication(INDICATE_CONNECTED);
+                err_code = nrf_ble_qwr_conn_handle_assign(&m_qwr[ble_conn_state_conn_idx(conn_handle)], conn_handle);
+                APP_ERROR_CHECK(err_code);
+                log_info("evt:gap connect - connected (%d links)", ble_conn_state_peripheral_conn_count());
+                // Connecting stopped the advertising : keep going if there is room for more remotes
+                advertising_check_start(false);
             } else {
                 // Not allowed to connect
                 log_info("evt:gap connect REJECTED as configured non-connectable");
-                err_code = sd_ble_gap_disconnect(_ctx.m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
+                err_code = sd_ble_gap_disconnect(conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
                 APP_ERROR_CHECK(err_code);
             }
         break; // BLE_GAP_EVT_CONNECTED
+        }
  
         case BLE_GAP_EVT_DISCONNECTED:
             log_info("evt:gap disconnect");
-            led_indication(INDICATE_IDLE);
-            _ctx.m_conn_handle = BLE_CONN_HANDLE_INVALID;
-            // any auth is now invalid
-            clear_authentication();
+            // (comm_ble invalidates any auth for the link)
+            _ctx.lastConnUp = uptime_ticks();       // idle time counts from the end of the last connection
+            if (ble_conn_state_peripheral_conn_count()==0) {
+                led_indication(INDICATE_IDLE);
+            }
             // Restart advertising if required
-            advertising_check_start();
+            advertising_check_start(false);
         break; // BLE_GAP_EVT_DISCONNECTED
         
         case BLE_GAP_EVT_ADV_REPORT: {
@@ -368,7 +479,7 @@ static void ble_evt_dispatch(const ble_evt_t * p_ble_evt, void* p_ctx)
         case BLE_GAP_EVT_TIMEOUT:
             log_info("evt:gap timeout");
 
-            advertising_check_start();
+            advertising_check_start(false);
             
             const ble_gap_evt_t * p_gap_evt = &p_ble_evt->evt.gap_evt;
             if (p_gap_evt->params.timeout.src == BLE_GAP_TIMEOUT_SRC_SCAN)
@@ -381,16 +492,34 @@ static void ble_evt_dispatch(const ble_evt_t * p_ble_evt, void* p_ctx)
             }
         break;
             
+        case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
+        {
+            // Let softdevice pick best PHY supported by both sides
+            log_info("evt:phy update request");
+            ble_gap_phys_t const phys = {
+                .rx_phys = BLE_GAP_PHY_AUTO,
+                .tx_phys = BLE_GAP_PHY_AUTO,
+            };
+            err_code = sd_ble_gap_phy_update(p_ble_evt->evt.gap_evt.conn_handle, &phys);
+            APP_ERROR_CHECK(err_code);
+        }
+        break; // BLE_GAP_EVT_PHY_UPDATE_REQUEST
+
+        case BLE_GAP_EVT_PHY_UPDATE:
+            log_info("evt:phy now tx %d rx %d (status %d)", p_ble_evt->evt.gap_evt.params.phy_update.tx_phy,
+                        p_ble_evt->evt.gap_evt.params.phy_update.rx_phy, p_ble_evt->evt.gap_evt.params.phy_update.status);
+        break; // BLE_GAP_EVT_PHY_UPDATE
+
         case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
             // Pairing not supported
-            err_code = sd_ble_gap_sec_params_reply(_ctx.m_conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
+            err_code = sd_ble_gap_sec_params_reply(p_ble_evt->evt.gap_evt.conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
             APP_ERROR_CHECK(err_code);
             // TODO If it was, we can do set/clear_authentication() to update status
         break; // BLE_GAP_EVT_SEC_PARAMS_REQUEST
  
         case BLE_GATTS_EVT_SYS_ATTR_MISSING:
             // No system attributes have been stored.
-            err_code = sd_ble_gatts_sys_attr_set(_ctx.m_conn_handle, NULL, 0, 0);
+            err_code = sd_ble_gatts_sys_attr_set(p_ble_evt->evt.gatts_evt.conn_handle, NULL, 0, 0);
             APP_ERROR_CHECK(err_code);
         break; // BLE_GATTS_EVT_SYS_ATTR_MISSING
  
@@ -459,10 +588,11 @@ static void ble_evt_dispatch(const ble_evt_t * p_ble_evt, void* p_ctx)
         case BLE_GAP_EVT_ADV_SET_TERMINATED:
         {
             const ble_gap_evt_adv_set_terminated_t* p_adv_term = &p_ble_evt->evt.gap_evt.params.adv_set_terminated;
+            _ctx.advRunning = false;
             if (p_adv_term->reason==BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT) {
                 // restart it
                 //log_info("advertising restart");
-                advertising_check_start();
+                advertising_check_start(false);
             } else {
                 log_info("advertising stopped due to %d", p_adv_term->reason);
             }
@@ -483,11 +613,13 @@ static void sys_evt_handler(uint32_t evt_id, void * p_context)
         case NRF_EVT_FLASH_OPERATION_SUCCESS:
             //log_info("SOC flash success");
             _ctx.flashBusy = false;
+            hal_bsp_nvmFlashEvent(true);
         break;
         
         case NRF_EVT_FLASH_OPERATION_ERROR:
             log_warn("SOC flash error");
             _ctx.flashBusy = false;         // Still finished though
+            hal_bsp_nvmFlashEvent(false);
         break;
         
         default:
@@ -501,10 +633,10 @@ static void sys_evt_handler(uint32_t evt_id, void * p_context)
 /**@brief Function for handling events from the GATT library. */
 static void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt)
 {
-    if ((_ctx.m_conn_handle == p_evt->conn_handle) && (p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED))
+    if (p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED)
     {
         uint16_t ble_nus_max_data_len = p_evt->params.att_mtu_effective - OPCODE_LENGTH - HANDLE_LENGTH;
-        comm_ble_set_max_data_len(ble_nus_max_data_len);
+        comm_ble_set_max_data_len(p_evt->conn_handle, ble_nus_max_data_len);
         log_info("Data len is set to 0x%X(%d)", ble_nus_max_data_len, ble_nus_max_data_len);
     }
     log_info("ATT MTU exchange completed. central 0x%x peripheral 0x%x",
@@ -514,6 +646,7 @@ static void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const *
 
 static void wakeup_host(const void * wakedata, uint32_t wd_len) {
     log_info("WAKEUP HOST request");
+    adv_policy_boost();
 }
 
 /**@brief Function for initializing the Connection Parameters module.
@@ -566,6 +699,9 @@ static void gatt_init(void)
 
     err_code = nrf_ble_gatt_att_mtu_periph_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
     APP_ERROR_CHECK(err_code);
+    // and when we connect to a NUS server
+    err_code = nrf_ble_gatt_att_mtu_central_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
+    APP_ERROR_CHECK(err_code);
 }
 
 /**@brief Function for initializing services that will be used by the application.
@@ -582,8 +718,10 @@ static void services_init(void)
     // Initialize Queued Write Module
     log_info("BLE Queued Wrte (QWR) init");
     qwr_init.error_handler = nrf_qwr_error_handler;
-    err_code = nrf_ble_qwr_init(&m_qwr, &qwr_init);
-    APP_ERROR_CHECK(err_code);
+    for(int i=0;i<NRF_SDH_BLE_TOTAL_LINK_COUNT;i++) {
+        err_code = nrf_ble_qwr_init(&m_qwr[i], &qwr_init);
+        APP_ERROR_CHECK(err_code);
+    }
 
     // Initialize Battery Service.
     log_info("BLE Battery service (BAS) init");
@@ -646,11 +784,39 @@ static void ble_stack_init(void)
     log_info("softdevice says app ram starts at %x", ram_start);
     err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
     APP_ERROR_CHECK(err_code);
-    // Enable BLE stack.
+    // As central, passthru data goes as write commands : let several be queued per connection event
+    ble_cfg_t ble_cfg;
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+    ble_cfg.conn_cfg.params.gattc_conn_cfg.write_cmd_tx_queue_size = APP_WRITE_CMD_TX_QUEUE_SIZE;
+    err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTC, &ble_cfg, ram_start);
+    APP_ERROR_CHECK(err_code);
+    // L2CAP channel for the CoC transport
+    err_code = comm_l2cap_cfg_set(APP_BLE_CONN_CFG_TAG, ram_start);
+    APP_ERROR_CHECK(err_code);
+    // Enable BLE stack. The softdevice gives back the RAM start it needs for this config : above the linker script's
+    // ORIGIN (linker/blev2_nrf52832_xxaa_s132.ld) it fails, so say what to change before the error handler resets us
+    _ctx.ramStartLink = ram_start;
     err_code = nrf_sdh_ble_enable(&ram_start);
+    _ctx.ramStartNeeded = ram_start;
+    if (err_code!=NRF_SUCCESS) {
+        log_error("ble enable failed %d : softdevice needs app RAM from %x, linker script has %x", err_code, ram_start, _ctx.ramStartLink);
+    }
+    APP_ERROR_CHECK(err_code);
+    log_info("ble enabled, app RAM from %x (softdevice needs from %x)", _ctx.ramStartLink, ram_start);
+    // Let connection events extend beyond NRF_SDH_BLE_GAP_EVENT_LENGTH when there is free radio time, so several
+    // full length packets can go per connection interval (for passthru throughput)
+    ble_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_evt_ext.enable = 1;
+    err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+    APP_ERROR_CHECK(err_code);
+    // Tell us when the radio goes inactive, to find the gaps between radio events. Configured now, while the softdevice is
+    // idle : sd_radio_notification_cfg_set() is refused once advertising, scanning or a connection is running
+    err_code = ble_radio_notification_init(APP_IRQ_PRIORITY_LOW, RADIO_NOTIF_DISTANCE, radio_notification_evt_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = sd_radio_notification_cfg_set(NRF_RADIO_NOTIFICATION_TYPE_INT_ON_INACTIVE, NRF_RADIO_NOTIFICATION_DISTANCE_NONE);
     APP_ERROR_CHECK(err_code);
-    log_info("ble enabled");
-
 }
 
 /* One time boot init of ble stack */
@@ -673,7 +839,7 @@ static void ble_init(void) {
     conn_params_init();
 
     log_info("ble advertising params init");
-    advertising_init(&m_advertising, &_ctx.txPower);
+    advertising_init();
     log_info("ble stack init done");
 
 }
@@ -709,10 +875,20 @@ static void system_init(void)
     err_code = app_button_enable();
     APP_ERROR_CHECK(err_code);
 
+    // single shot so each reading can use the current period config
     err_code = app_timer_create(&m_battery_timer_id,
-                                APP_TIMER_MODE_REPEATED,
+                                APP_TIMER_MODE_SINGLE_SHOT,
                                 battery_update_timer_cb);
     APP_ERROR_CHECK(err_code);
+    err_code = app_timer_create(&m_reset_timer_id,
+                                APP_TIMER_MODE_SINGLE_SHOT,
+                                reset_timer_cb);
+    APP_ERROR_CHECK(err_code);
+    // single shot so each tick can use the current slot time config
+    err_code = app_timer_create(&m_adv_slot_timer_id,
+                                APP_TIMER_MODE_SINGLE_SHOT,
+                                adv_slot_timer_cb);
+    APP_ERROR_CHECK(err_code);
 
 }
 
@@ -723,39 +899,29 @@ static uint8_t makeAdvPowerLevel( void )
     if (cfg_getExtra_Value()!=0) {
         return cfg_getExtra_Value();
     }
-    // Otherwise we use value based on tx power and battery
+    // Otherwise we use value based on tx power and battery (last measured voltage, in mV)
     uint8_t result_adv = 0;
-    float battery = 0.0;
-    
-    // Get voltage
-    hal_bsp_adc_init();
-    battery = (float)hal_bsp_adc_read_u16();
-    hal_bsp_adc_disable();
-    battery = (battery * 3.6) / 1024.0;
+    uint16_t battery = _ctx.battMv;
  
-    if(battery > 3.2)
+    if(battery > 3200)
     {
         result_adv = 0x18;
     }
-    else if((battery <= 3.2) && (battery > 3.0))
+    else if(battery > 3000)
     {
         result_adv = 0x10;
     }
-    else if((battery <= 3.0) && (battery > 2.9))
+    else if(battery > 2900)
     {
         result_adv = 0x08;
     }
-    else if(battery <= 2.9)
-    {
-        result_adv = 0x00;
-    }
     else
     {
         result_adv = 0x00;
     }
     
     // add tx power to the byte
-    switch(cfg_getTXPOWER_Level())
+    switch(_ctx.txPower)
     {
         case (int8_t)0x00: // RADIO_TXPOWER_TXPOWER_0dBm
             result_adv |= 0x00;
@@ -798,53 +964,258 @@ static uint8_t makeAdvPowerLevel( void )
 }
  
 /**@brief Function for initializing the Advertising functionality params
- * call once to init the p_adv_ctx
+ * The set is driven directly : configured when it starts (or its interval changes), and adverts are swapped in place
+ * while it runs. It has no timeout as the slot timer decides when to change advert, and we restart it after a disconnect.
  */
-static void advertising_init(ble_advertising_t* p_adv_ctx, int8_t* p_txPower)
+static void advertising_init(void)
 {
-    uint32_t               err_code;
-    ble_advertising_init_t ai;
-
-    memset(&ai, 0, sizeof(ai));
-
-    ai.evt_handler = on_adv_evt;
-    ai.error_handler = NULL;
-    ai.advdata.name_type             = BLE_ADVDATA_FULL_NAME;
-    ai.advdata.flags                 = (BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED);
-    // Not connectable, no uuids advertised to avoid access to NUS
-    ai.srdata.uuids_complete.uuid_cnt = 0;
-    ai.srdata.uuids_complete.p_uuids  = NULL;
-    ai.srdata.name_type = BLE_ADVDATA_FULL_NAME;
-    ai.srdata.short_name_len = 8;      // get at least id part (maj/min in hex)
-    ai.srdata.p_tx_power_level = p_txPower;
-
-    // Give both options for advert speed (the one used depends on whether isIBeaconning() is true or not)
-    ai.config.ble_adv_fast_enabled  = true;
-    ai.config.ble_adv_fast_interval = MSEC_TO_UNITS(cfg_getADV_IND(), UNIT_0_625_MS);
-    ai.config.ble_adv_fast_timeout  = APP_ADV_TIMEOUT_IN_SECONDS*100;
-    ai.config.ble_adv_slow_enabled = true;
-    ai.config.ble_adv_slow_interval = MSEC_TO_UNITS(APP_ADV_INTERVAL_MS_SLOW, UNIT_0_625_MS);     //1285*1.6;
-    ai.config.ble_adv_slow_timeout  = APP_ADV_TIMEOUT_IN_SECONDS*100;
-     
-    err_code = ble_advertising_init(p_adv_ctx, &ai);
-    APP_ERROR_CHECK(err_code);
-    ble_advertising_conn_cfg_tag_set(p_adv_ctx, APP_BLE_CONN_CFG_TAG);
+    _ctx.advHandle = BLE_GAP_ADV_SET_HANDLE_NOT_SET;
+    _ctx.advTxPower = INT8_MAX;         // not applied yet
+    memset(&_ctx.advParams, 0, sizeof(_ctx.advParams));
+    _ctx.advParams.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED;
+    _ctx.advParams.primary_phy     = BLE_GAP_PHY_1MBPS;
+    _ctx.advParams.filter_policy   = BLE_GAP_ADV_FP_ANY;
+    _ctx.advParams.duration        = BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED;
+    _ctx.advParams.interval        = MSEC_TO_UNITS(APP_ADV_INTERVAL_MS_SLOW, UNIT_0_625_MS);
 }
- /**@brief Function for updateing the Advertising functionality params
- * call before each start of beaconning to update from config in case it changed
+
+// Put an advert on air with the given interval (0.625ms units). The softdevice uses the data buffers of the running set
+// until it is given new ones, so the advert is copied into whichever of the 2 air buffers it isn't using. If the set
+// is running at that interval (and of the same kind) the data is just swapped, otherwise the set is (re)configured and
+// started. Extended adverts are non-connectable and non-scannable, with the data on the 2M secondary PHY.
+static uint32_t advertising_set(const ble_gap_adv_data_t* p_data, uint32_t interval, bool extended)
+{
+    uint32_t err_code;
+    uint8_t next = (_ctx.advAirIdx ^ 1);
+    ble_gap_adv_data_t* air = &_ctx.advAir[next];
+    memset(air, 0, sizeof(ble_gap_adv_data_t));
+    memcpy(_ctx.advAirAdv[next], p_data->adv_data.p_data, p_data->adv_data.len);
+    air->adv_data.p_data = _ctx.advAirAdv[next];
+    air->adv_data.len = p_data->adv_data.len;
+    if (p_data->scan_rsp_data.len>0) {
+        memcpy(_ctx.advAirSr[next], p_data->scan_rsp_data.p_data, p_data->scan_rsp_data.len);
+        air->scan_rsp_data.p_data = _ctx.advAirSr[next];
+        air->scan_rsp_data.len = p_data->scan_rsp_data.len;
+    }
+    if (_ctx.advRunning && interval==_ctx.advParams.interval && extended==_ctx.advExtended) {
+        err_code = sd_ble_gap_adv_set_configure(&_ctx.advHandle, air, NULL);
+        if (err_code==NRF_SUCCESS) {
+            _ctx.advAirIdx = next;
+            _ctx.advSwaps++;
+        }
+    } else {
+        if (_ctx.advRunning) {
+            // (no ADV_SET_TERMINATED event for a stop)
+            (void)sd_ble_gap_adv_stop(_ctx.advHandle);
+            _ctx.advRunning = false;
+        }
+        _ctx.advParams.interval = interval;
+        _ctx.advParams.properties.type = (extended ? BLE_GAP_ADV_TYPE_EXTENDED_NONCONNECTABLE_NONSCANNABLE_UNDIRECTED :
+                                                    BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED);
+        _ctx.advParams.secondary_phy = (extended ? BLE_GAP_PHY_2MBPS : BLE_GAP_PHY_AUTO);
+        _ctx.advExtended = extended;
+        err_code = sd_ble_gap_adv_set_configure(&_ctx.advHandle, air, &_ctx.advParams);
+        if (err_code!=NRF_SUCCESS) {
+            return err_code;
+        }
+        _ctx.advAirIdx = next;
+        err_code = sd_ble_gap_adv_start(_ctx.advHandle, APP_BLE_CONN_CFG_TAG);
+        if (err_code!=NRF_SUCCESS) {
+            return err_code;
+        }
+        _ctx.advRunning = true;
+        _ctx.advRestarts++;
+    }
+    // Advert tx power is per set (handle is only valid once it has been configured)
+    if (err_code==NRF_SUCCESS && _ctx.advTxPower!=_ctx.txPower) {
+        if (sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_ADV, _ctx.advHandle, _ctx.txPower)==NRF_SUCCESS) {
+            _ctx.advTxPower = _ctx.txPower;
+        }
+    }
+    return err_code;
+}
+
+static void advertising_stop(void)
+{
+    if (_ctx.advRunning) {
+        (void)sd_ble_gap_adv_stop(_ctx.advHandle);
+        _ctx.advRunning = false;
+    }
+}
+
+ // Live values for the telemetry advert
+static void telemetry_read(telem_t* t)
+{
+    int32_t temp = 0;
+    memset(t, 0, sizeof(*t));           // so they can be compared with memcmp
+    t->battMv = _ctx.battMv;
+    if (sd_temp_get(&temp)==NRF_SUCCESS) {
+        t->temp = (int8_t)(temp/4);     // temp is in 0.25C steps
+    }
+    t->upMins = (uint32_t)(_ctx.upTicks/(60*APP_TIMER_TICKS_PER_SEC));
+    if (t->upMins>0xFFFFFF) {
+        t->upMins = 0xFFFFFF;
+    }
+    t->resets = cfg_getResetCount();
+    int n = ibs_scan_getTableSize();
+    t->scanned = (n>0xFF ? 0xFF : n);
+    uint32_t e = comm_uart_nbErrors();
+    t->uartErrs = (e>0xFFFF ? 0xFFFF : e);
+    e = comm_ble_nbRxLost();
+    t->nusLost = (e>0xFFFF ? 0xFFFF : e);
+}
+static void telemetry_write(uint8_t* p, const telem_t* t)
+{
+    p[0] = TELEM_VERSION;
+    uint16_encode(t->battMv, &p[1]);
+    p[3] = (uint8_t)t->temp;
+    uint24_encode(t->upMins, &p[4]);
+    uint16_encode(t->resets, &p[7]);
+    p[9] = t->scanned;
+    uint16_encode(t->uartErrs, &p[10]);
+    uint16_encode(t->nusLost, &p[12]);
+}
+// Scan summary record of the beacons seen since the last one. Any that don't fit are left out of this one (they will be
+// back in a later one if they are still around)
+static void summary_make(void)
+{
+    ibs_scan_result_t* s = _ctx.summaryScan;
+    int n = ibs_scan_takeRecent(s, SUMMARY_MAX_ENTRIES);
+    // sort by major/minor so the differences are small
+    for(int i=1; i<n; i++) {
+        ibs_scan_result_t e = s[i];
+        int j = i-1;
+        for(; j>=0 && BEACON_KEY(s[j])>BEACON_KEY(e); j--) {
+            s[j+1] = s[j];
+        }
+        s[j+1] = e;
+    }
+    int len = SUMMARY_HEADER_LENGTH;
+    int count = 0;
+    uint32_t prev = 0;
+    for(int i=0; i<n; i++) {
+        uint8_t entry[6];
+        int l = 0;
+        uint32_t v = BEACON_KEY(s[i])-prev;
+        do {
+            entry[l] = (v & 0x7F) | (v>0x7F ? 0x80 : 0);
+            v >>= 7;
+            l++;
+        } while(v>0);
+        entry[l++] = s[i].rssi;
+        if ((len+l)>SUMMARY_MAX_LENGTH) {
+            break;
+        }
+        memcpy(&_ctx.summary[len], entry, l);
+        len += l;
+        count++;
+        prev = BEACON_KEY(s[i]);
+    }
+    _ctx.summary[0] = SUMMARY_TYPE;
+    _ctx.summary[1] = _ctx.summarySeq++;
+    _ctx.summary[2] = count;
+    _ctx.summaryLen = len;
+    _ctx.summaryUp = uptime_ticks();
+}
+// Bring the relay list up to date from the scan table : beacons matching the filter, up to the cap on distinct ids. Ones that
+// have left the table (new scan) are dropped, making room for others.
+static void relay_refresh(void)
+{
+    if (cfg_getAdvSlotWeight(ADVERT_TYPE_RELAY)==0 || !ibs_is_scan_active()) {
+        _ctx.relayCount = 0;
+        return;
+    }
+    uint32_t mask = cfg_getRelayMask();
+    uint32_t filter = (cfg_getRelayFilter() & mask);
+    uint8_t cap = cfg_getRelayMaxIds();
+    if (cap>RELAY_IDS_MAX) {
+        cap = RELAY_IDS_MAX;
+    }
+    for(int j=0; j<_ctx.relayCount; j++) {
+        _ctx.relayIds[j].seen = false;
+    }
+    ibs_scan_result_t r;
+    for(int i=0; ibs_scan_get(i, &r); i++) {
+        uint32_t key = BEACON_KEY(r);
+        if ((key & mask)!=filter) {
+            continue;
+        }
+        int j = 0;
+        while(j<_ctx.relayCount && _ctx.relayIds[j].key!=key) {
+            j++;
+        }
+        if (j==_ctx.relayCount) {
+            if (_ctx.relayCount>=cap) {
+                continue;
+            }
+            _ctx.relayIds[j].key = key;
+            _ctx.relayCount++;
+        }
+        _ctx.relayIds[j].rssi = r.rssi;
+        _ctx.relayIds[j].seen = true;
+    }
+    int n = 0;
+    for(int j=0; j<_ctx.relayCount; j++) {
+        if (_ctx.relayIds[j].seen) {
+            _ctx.relayIds[n++] = _ctx.relayIds[j];
+        }
+    }
+    _ctx.relayCount = n;
+    if (_ctx.relayNext>=n) {
+        _ctx.relayNext = 0;
+    }
+}
+// Relay record for the next beacon in the list (round robin)
+static void relay_make(void)
+{
+    uint8_t* p = _ctx.relayRecord;
+    memset(p, 0, RELAY_RECORD_LENGTH);
+    p[0] = RELAY_TYPE;
+    if (_ctx.relayCount>0) {
+        relay_id_t* r = &_ctx.relayIds[_ctx.relayNext];
+        _ctx.relayNext = (_ctx.relayNext+1) % _ctx.relayCount;
+        p[1] = 1;                       // hops
+        uint16_encode((uint16_t)(r->key>>16), &p[2]);
+        uint16_encode((uint16_t)(r->key & 0xFFFF), &p[4]);
+        p[6] = r->rssi;
+        _ctx.relaySent++;
+    }
+    uint16_encode(cfg_getMajor_Value(), &p[7]);
+    uint16_encode(cfg_getMinor_Value(), &p[9]);
+    _ctx.relayUp = uptime_ticks();
+}
+// Find the data (after the company id) of the manufacturer specific AD structure in an encoded advert, NULL if not there
+static uint8_t* advertising_findManuf(uint8_t* adv, uint16_t len, uint8_t dlen)
+{
+    for(uint16_t i=0; (i+1)<len && adv[i]>0; i += adv[i]+1) {
+        if (adv[i+1]==BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA && adv[i]==(dlen+3) && (i+1+adv[i])<=len) {
+            return &adv[i+4];
+        }
+    }
+    return NULL;
+}
+
+/**@brief Function for encoding the advert (and scan response) of one type into its cache entry
+ * only called when the entry is out of date, the periodic path just points the advertising module at it
  */
-static bool advertising_update(ble_advertising_t* p_adv_ctx, int8_t* p_txPower)
+static void advertising_encode(advtype_t type, int8_t* p_txPower)
 {
-    bool ret_ibeacons = false;
     uint32_t               err_code;
+    adv_cache_t* c = &_ctx.advCache[type];
     ble_advdata_t advdata;
     ble_advdata_t srdata;
     ble_advdata_manuf_data_t manuf_specific_data; 
+    ble_advdata_service_data_t service_data;
+    uint8_t eddy_frame[EDDY_UID_FRAME_LENGTH];
+    bool has_sr = true;
     // advertise only basic services in main advert
     ble_uuid_t m_adv_uuids[] = {
         {BLE_UUID_DEVICE_INFORMATION_SERVICE, BLE_UUID_TYPE_BLE},
         {BLE_UUID_BATTERY_SERVICE, BLE_UUID_TYPE_BLE},
     };
+    ble_uuid_t eddy_uuids[] = {
+        {EDDYSTONE_UUID, BLE_UUID_TYPE_BLE},
+    };
     // and special services in the scan response 
     /* NO - too long with 2 128but vendor specific IDs!
     ble_uuid_t m_sr_uuids[] = {
@@ -860,141 +1231,425 @@ static bool advertising_update(ble_advertising_t* p_adv_ctx, int8_t* p_txPower)
 
     memset(&advdata, 0, sizeof(advdata));
     memset(&srdata, 0, sizeof(srdata));
+    memset(&c->data, 0, sizeof(c->data));
 
-    // Build advertising data struct to pass into @ref ble_advertising_init.
-    // We switch between advertising content each time so that we can mix iBeacons (if required), telemetry data and connection data.
-    // This happens each time the 'adv_X_timeout' happens, which is after 1s.
-    _ctx.advertType = ((_ctx.advertType+1) % ADVERT_TYPE_LAST);
-    switch (_ctx.advertType) {
+    switch (type) {
         case ADVERT_TYPE_IBEACON:
         {
-            if (cfg_isIBeaconning()) {
-                // Only make our advert look like an ibeacon if we are wanting it to be one
-                manuf_specific_data.company_identifier = cfg_getCompanyID();
-                // iBeacons are a BLE advert with a specific 'manufacteur specific' block, which is a TLV essentially
-                _ctx.m_beacon_info[0] = APP_BEACON_ADV_DEVICE_TYPE;     // Tag - this is a ibeacon
-                _ctx.m_beacon_info[1] = APP_BEACON_ADV_DATA_LENGTH;     // length of rest of block
-
-                memcpy(&_ctx.m_beacon_info[2], cfg_getUUID(), UUID128_SIZE);
-                _ctx.m_beacon_info[18] = MSB_16(cfg_getMajor_Value());
-                _ctx.m_beacon_info[19] = LSB_16(cfg_getMajor_Value());
-                _ctx.m_beacon_info[20] = MSB_16(cfg_getMinor_Value());
-                _ctx.m_beacon_info[21] = LSB_16(cfg_getMinor_Value());    
-                _ctx.m_beacon_info[22] = makeAdvPowerLevel();
-
-                manuf_specific_data.data.p_data = (uint8_t *) (&_ctx.m_beacon_info[0]);
-                manuf_specific_data.data.size   = APP_BEACON_INFO_LENGTH;
-
-                advdata.name_type             = BLE_ADVDATA_NO_NAME;
-                advdata.p_manuf_specific_data = &manuf_specific_data;
-                advdata.flags                 = (BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED);
-                // Not connectable, no uuids advertised to avoid access to NUS
-                err_code = ble_advertising_advdata_update(p_adv_ctx, &advdata, NULL);
-                APP_ERROR_CHECK(err_code);
-                ret_ibeacons = true;
-                break;
-            } else {
-                // fallthru to next type
-            }
+            manuf_specific_data.company_identifier = cfg_getCompanyID();
+            // iBeacons are a BLE advert with a specific 'manufacteur specific' block, which is a TLV essentially
+            _ctx.m_beacon_info[0] = APP_BEACON_ADV_DEVICE_TYPE;     // Tag - this is a ibeacon
+            _ctx.m_beacon_info[1] = APP_BEACON_ADV_DATA_LENGTH;     // length of rest of block
+
+            memcpy(&_ctx.m_beacon_info[2], cfg_getUUID(), UUID128_SIZE);
+            _ctx.m_beacon_info[18] = MSB_16(cfg_getMajor_Value());
+            _ctx.m_beacon_info[19] = LSB_16(cfg_getMajor_Value());
+            _ctx.m_beacon_info[20] = MSB_16(cfg_getMinor_Value());
+            _ctx.m_beacon_info[21] = LSB_16(cfg_getMinor_Value());    
+            _ctx.m_beacon_info[22] = makeAdvPowerLevel();
+
+            manuf_specific_data.data.p_data = (uint8_t *) (&_ctx.m_beacon_info[0]);
+            manuf_specific_data.data.size   = APP_BEACON_INFO_LENGTH;
+
+            advdata.name_type             = BLE_ADVDATA_NO_NAME;
+            advdata.p_manuf_specific_data = &manuf_specific_data;
+            advdata.flags                 = (BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED);
+            // Not connectable, no uuids advertised to avoid access to NUS
+            has_sr = false;
+            break;
         }
         case ADVERT_TYPE_TELEMETRY:
+        {
+            // Not connectable, no more uuids advertised in advert to avoid access to NUS. Name is only in the scan
+            // response, to leave room for the telemetry record
+            telemetry_read(&_ctx.telem);
+            telemetry_write(_ctx.telemRecord, &_ctx.telem);
+            manuf_specific_data.company_identifier = TELEM_COMPANY_ID;
+            manuf_specific_data.data.p_data = _ctx.telemRecord;
+            manuf_specific_data.data.size = TELEM_RECORD_LENGTH;
+            advdata.name_type             = BLE_ADVDATA_NO_NAME;
+            advdata.p_manuf_specific_data = &manuf_specific_data;
+            advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+            advdata.uuids_complete.p_uuids  = m_adv_uuids;
+            break;
+        }
+        case ADVERT_TYPE_CONNECT:
         {
             advdata.name_type             = BLE_ADVDATA_FULL_NAME;
-            // depending on if we accept connections or not, advert data is different
-            if (cfg_getConnectable()) {
-                advdata.flags                 = (BLE_GAP_ADV_FLAG_LE_GENERAL_DISC_MODE |
-                                                BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED);
-                // advertise short list of services, and say more are available (stack takes care of sending the others when someone connects to me)
-                advdata.uuids_more_available.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
-                advdata.uuids_more_available.p_uuids  = m_adv_uuids;
-                /* no need to have SR uuid list, stack takes care of sending other declared services apparenrtly
-                advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
-                advdata.uuids_complete.p_uuids  = m_adv_uuids;
-                srdata.uuids_more_available.uuid_cnt = sizeof(m_sr_uuids) / sizeof(m_sr_uuids[0]);
-                srdata.uuids_more_available.p_uuids  = m_sr_uuids;
-                */
-            } else {
-                // Not connectable, no more uuids advertised in advert to avoid access to NUS
-                advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
-                advdata.uuids_complete.p_uuids  = m_adv_uuids;
+            advdata.flags                 = (BLE_GAP_ADV_FLAG_LE_GENERAL_DISC_MODE |
+                                            BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED);
+            // advertise short list of services, and say more are available (stack takes care of sending the others when someone connects to me)
+            advdata.uuids_more_available.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+            advdata.uuids_more_available.p_uuids  = m_adv_uuids;
+            /* no need to have SR uuid list, stack takes care of sending other declared services apparenrtly
+            advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+            advdata.uuids_complete.p_uuids  = m_adv_uuids;
+            srdata.uuids_more_available.uuid_cnt = sizeof(m_sr_uuids) / sizeof(m_sr_uuids[0]);
+            srdata.uuids_more_available.p_uuids  = m_sr_uuids;
+            */
+            break;
+        }
+        case ADVERT_TYPE_EDDY_UID:
+        {
+            // Namespace is the start of the ibeacon uuid, instance is the major/minor : same identity as the ibeacon
+            eddy_frame[0] = EDDY_FRAME_UID;
+            eddy_frame[1] = (uint8_t)_ctx.txPower;                  // ranging data : power at 0m
+            memcpy(&eddy_frame[2], cfg_getUUID(), 10);
+            eddy_frame[12] = 0;
+            eddy_frame[13] = 0;
+            eddy_frame[14] = MSB_16(cfg_getMajor_Value());
+            eddy_frame[15] = LSB_16(cfg_getMajor_Value());
+            eddy_frame[16] = MSB_16(cfg_getMinor_Value());
+            eddy_frame[17] = LSB_16(cfg_getMinor_Value());
+            eddy_frame[18] = 0;
+            eddy_frame[19] = 0;
+            service_data.data.size = EDDY_UID_FRAME_LENGTH;
+            has_sr = false;
+            break;
+        }
+        case ADVERT_TYPE_EDDY_TLM:
+        {
+            // Unencrypted TLM : battery mV, temperature (8.8 signed), adverts sent, uptime in 0.1s. All big endian.
+            uint16_t mv = _ctx.battMv;
+            int32_t temp = 0;
+            int16_t temp88 = (int16_t)0x8000;       // 'not supported'
+            if (sd_temp_get(&temp)==NRF_SUCCESS) {
+                temp88 = (int16_t)(temp*64);        // temp is in 0.25C steps
             }
-            srdata.name_type = BLE_ADVDATA_FULL_NAME;
-            srdata.short_name_len = 8;      // get at least id part (maj/min in hex)
-            srdata.p_tx_power_level = p_txPower;
-            err_code = ble_advertising_advdata_update(p_adv_ctx, &advdata, &srdata);
-            APP_ERROR_CHECK(err_code);
-            break;        
+            uint32_t secs = (uint32_t)((_ctx.upTicks*10)/APP_TIMER_TICKS_PER_SEC);
+            eddy_frame[0] = EDDY_FRAME_TLM;
+            eddy_frame[1] = 0;                      // version
+            eddy_frame[2] = MSB_16(mv);
+            eddy_frame[3] = LSB_16(mv);
+            eddy_frame[4] = MSB_16((uint16_t)temp88);
+            eddy_frame[5] = LSB_16((uint16_t)temp88);
+            uint32_big_encode(_ctx.advPdus, &eddy_frame[6]);
+            uint32_big_encode(secs, &eddy_frame[10]);
+            service_data.data.size = EDDY_TLM_FRAME_LENGTH;
+            has_sr = false;
+            break;
         }
-        default:
+        case ADVERT_TYPE_SUMMARY:
+        {
+            summary_make();
+            manuf_specific_data.company_identifier = TELEM_COMPANY_ID;
+            manuf_specific_data.data.p_data = _ctx.summary;
+            manuf_specific_data.data.size = _ctx.summaryLen;
+            advdata.name_type             = BLE_ADVDATA_NO_NAME;
+            advdata.p_manuf_specific_data = &manuf_specific_data;
+            has_sr = false;
+            break;
+        }
+        case ADVERT_TYPE_RELAY:
         {
-            log_warn("unknown advert type requested %d", _ctx.advertType);
+            relay_make();
+            manuf_specific_data.company_identifier = TELEM_COMPANY_ID;
+            manuf_specific_data.data.p_data = _ctx.relayRecord;
+            manuf_specific_data.data.size = RELAY_RECORD_LENGTH;
+            advdata.name_type             = BLE_ADVDATA_NO_NAME;
+            advdata.flags                 = BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;
+            advdata.p_manuf_specific_data = &manuf_specific_data;
+            has_sr = false;
             break;
         }
+        default:
+        {
+            log_warn("unknown advert type requested %d", type);
+            return;
+        }
     } 
-    return ret_ibeacons;
+    if (type==ADVERT_TYPE_EDDY_UID || type==ADVERT_TYPE_EDDY_TLM) {
+        advdata.name_type             = BLE_ADVDATA_NO_NAME;
+        advdata.flags                 = (BLE_GAP_ADV_FLAG_LE_GENERAL_DISC_MODE | BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED);
+        advdata.uuids_complete.uuid_cnt = 1;
+        advdata.uuids_complete.p_uuids  = eddy_uuids;
+        service_data.service_uuid = EDDYSTONE_UUID;
+        service_data.data.p_data = eddy_frame;
+        advdata.p_service_data_array = &service_data;
+        advdata.service_data_count = 1;
+    }
+    if (has_sr) {
+        // ibeacon and eddystone have no scan response
+        srdata.name_type = BLE_ADVDATA_FULL_NAME;
+        srdata.short_name_len = 8;      // get at least id part (maj/min in hex)
+        srdata.p_tx_power_level = p_txPower;
+        c->data.scan_rsp_data.p_data = c->sr;
+        c->data.scan_rsp_data.len = sizeof(c->sr);
+        err_code = ble_advdata_encode(&srdata, c->sr, &c->data.scan_rsp_data.len);
+        APP_ERROR_CHECK(err_code);
+    }
+    c->data.adv_data.p_data = c->adv;
+    c->data.adv_data.len = (type==ADVERT_TYPE_SUMMARY ? sizeof(c->adv) : BLE_GAP_ADV_SET_DATA_SIZE_MAX);
+    err_code = ble_advdata_encode(&advdata, c->adv, &c->data.adv_data.len);
+    APP_ERROR_CHECK(err_code);
+    if (type==ADVERT_TYPE_TELEMETRY) {
+        _ctx.telemAdv = advertising_findManuf(c->adv, c->data.adv_data.len, TELEM_RECORD_LENGTH);
+    }
+    c->gen = cfg_getGeneration();
+    c->txPower = _ctx.txPower;
+    c->valid = true;
+    _ctx.advEncodes++;
+}
+
+// Does the cached advert of this type need to be rebuilt?
+static bool advertising_isStale(advtype_t type)
+{
+    adv_cache_t* c = &_ctx.advCache[type];
+    if (!c->valid || c->gen!=cfg_getGeneration() || c->txPower!=_ctx.txPower) {
+        return true;
+    }
+    // power byte includes the battery level, which isn't part of the config. TLM is live data.
+    // The scan summary is remade at its refresh period, and the relay advert moves on to the next beacon at the relay rate.
+    return ((type==ADVERT_TYPE_IBEACON && _ctx.m_beacon_info[22]!=makeAdvPowerLevel()) || type==ADVERT_TYPE_EDDY_TLM ||
+            (type==ADVERT_TYPE_SUMMARY &&
+                (uptime_ticks()-_ctx.summaryUp)>=((uint64_t)cfg_getSummaryRefreshS()*APP_TIMER_TICKS_PER_SEC)) ||
+            (type==ADVERT_TYPE_RELAY &&
+                (uptime_ticks()-_ctx.relayUp)>=((uint64_t)cfg_getRelayRateMs()*APP_TIMER_TICKS_PER_SEC/1000)));
+}
+
+// Bring the live values in a cached advert up to date, without re-encoding it. Returns true if it changed.
+static bool advertising_refresh(advtype_t type)
+{
+    if (type!=ADVERT_TYPE_TELEMETRY || _ctx.telemAdv==NULL || advertising_isStale(type)) {
+        return false;
+    }
+    telem_t t;
+    telemetry_read(&t);
+    if (memcmp(&t, &_ctx.telem, sizeof(t))==0) {
+        return false;
+    }
+    _ctx.telem = t;
+    telemetry_write(_ctx.telemAdv, &t);
+    _ctx.telemPatches++;
+    return true;
+}
+
+// Can this slot be advertised with the current config?
+static bool advertising_slotEnabled(advtype_t type)
+{
+    if (type>=ADVERT_TYPE_LAST || cfg_getAdvSlotWeight(type)==0) {
+        return false;
+    }
+    switch(type) {
+        case ADVERT_TYPE_CONNECT:
+            return cfg_getConnectable();
+        case ADVERT_TYPE_SUMMARY:
+            // only while there is a scan to summarise
+            return ibs_is_scan_active();
+        case ADVERT_TYPE_RELAY:
+            // and beacons from it to relay (list is refreshed each slot tick)
+            return (_ctx.relayCount>0);
+        default:
+            return cfg_isIBeaconning();
+    }
+}
+
+// Weight of a slot in the rotation, x4 so the idle policy can give the connectable advert a quarter of its share. This rather
+// than a slower interval, which would mean restarting the set each time it comes round.
+static int advertising_slotWeight(advtype_t type)
+{
+    int w = cfg_getAdvSlotWeight(type);
+    if (type==ADVERT_TYPE_CONNECT && (_ctx.polFlags & ADV_POL_IDLE) && (_ctx.polFlags & ADV_POL_BOOST)==0) {
+        return w;
+    }
+    return w*4;
+}
+
+// Pick the slot for the next tick : smooth weighted round robin, so each enabled slot gets its weight's share of the
+// ticks, spread out as evenly as possible, in an order that only depends on the config. ADVERT_TYPE_LAST if none enabled.
+static advtype_t advertising_slotNext(void)
+{
+    int total = 0;
+    advtype_t best = ADVERT_TYPE_LAST;
+    for(advtype_t t=0; t<ADVERT_TYPE_LAST; t++) {
+        if (!advertising_slotEnabled(t)) {
+            _ctx.advCredit[t] = 0;
+            continue;
+        }
+        int w = advertising_slotWeight(t);
+        _ctx.advCredit[t] += w;
+        total += w;
+        if (best==ADVERT_TYPE_LAST || _ctx.advCredit[t]>_ctx.advCredit[best]) {
+            best = t;
+        }
+    }
+    if (best!=ADVERT_TYPE_LAST) {
+        _ctx.advCredit[best] -= total;
+        _ctx.advPicks[best]++;
+    }
+    return best;
+}
+
+ /**@brief Function for updateing the Advertising functionality params
+ * call before each start of beaconning to set up the advert of the given slot. Its encoded form is only rebuilt if the config
+ * changed since it was made (or for the ibeacon, if the battery level moved its power byte). The telemetry record is
+ * patched in place by advertising_refresh() when its values change.
+ */
+static bool advertising_update(advtype_t type, int8_t* p_txPower)
+{
+    if (advertising_isStale(type)) {
+        advertising_encode(type, p_txPower);
+    }
+    _ctx.advertType = type;
+    return (type==ADVERT_TYPE_IBEACON);
+}
+
+// Uptime in ticks, up to date (upTicks itself moves on at each slot tick)
+static uint64_t uptime_ticks(void)
+{
+    return _ctx.upTicks + app_timer_cnt_diff_compute(app_timer_cnt_get(), _ctx.advLastTick);
+}
+
+// Work out which of the adaptive policy rules apply now
+static void adv_policy_update(void)
+{
+    uint8_t flags = 0;
+    if (cfg_isAdvPolicyOn()) {
+        uint64_t now = uptime_ticks();
+        if (now<_ctx.boostUntil) {
+            flags |= ADV_POL_BOOST;
+        }
+        if (_ctx.battMv>0 && _ctx.battMv<cfg_getAdvPolicyBattCritMv()) {
+            flags |= ADV_POL_BATT_CRIT;
+        } else if (_ctx.battMv>0 && _ctx.battMv<cfg_getAdvPolicyBattLowMv()) {
+            flags |= ADV_POL_BATT_LOW;
+        }
+        uint16_t idleMin = cfg_getAdvPolicyIdleMin();
+        if (idleMin>0 && ble_conn_state_peripheral_conn_count()==0 &&
+                (now-_ctx.lastConnUp)>=((uint64_t)idleMin*60*APP_TIMER_TICKS_PER_SEC)) {
+            flags |= ADV_POL_IDLE;
+        }
+    }
+    _ctx.polFlags = flags;
+}
+
+// Speed the adverts up for a while (someone pressed the button or wants us, so is probably looking for us)
+static void adv_policy_boost(void)
+{
+    if (cfg_isAdvPolicyOn() && cfg_getAdvPolicyBoostS()>0) {
+        _ctx.boostUntil = uptime_ticks() + ((uint64_t)cfg_getAdvPolicyBoostS()*APP_TIMER_TICKS_PER_SEC);
+        advertising_check_start(true);
+    }
+}
+
+// Advert tx power : the configured one, less when the battery is low (down to a level the radio supports)
+static int8_t adv_policy_txPower(void)
+{
+    static const int8_t levels[] = {-40, -20, -16, -12, -8, -4, 0, 3, 4};
+    int8_t txPower = cfg_getTXPOWER_Level();
+    int target = txPower;
+    if (_ctx.polFlags & ADV_POL_BATT_CRIT) {
+        target -= 8;
+    } else if (_ctx.polFlags & ADV_POL_BATT_LOW) {
+        target -= 4;
+    }
+    if (target<ADV_POL_TX_MIN) {
+        target = (txPower<ADV_POL_TX_MIN ? txPower : ADV_POL_TX_MIN);
+    }
+    if (target==txPower) {
+        return txPower;
+    }
+    for(int i=0; i<(sizeof(levels)/sizeof(levels[0])) && levels[i]<=target; i++) {
+        txPower = levels[i];
+    }
+    return txPower;
+}
+
+// Advert interval of the slot in 0.625ms units, after the adaptive policy
+static uint32_t advertising_interval(advtype_t type)
+{
+    uint32_t ms = cfg_getAdvSlotInterval(type);
+    if (_ctx.polFlags & ADV_POL_BOOST) {
+        if ((_ctx.polFlags & ADV_POL_BATT_CRIT)==0) {
+            uint32_t fast = ms/4;
+            ms = (fast>=ADV_POL_BOOST_MIN_MS ? fast : (ms<ADV_POL_BOOST_MIN_MS ? ms : ADV_POL_BOOST_MIN_MS));
+        }
+    } else {
+        if (_ctx.polFlags & ADV_POL_BATT_CRIT) {
+            ms *= 4;
+        } else if (_ctx.polFlags & ADV_POL_BATT_LOW) {
+            ms *= 2;
+        }
+    }
+    uint32_t interval = MSEC_TO_UNITS(ms, UNIT_0_625_MS);
+    if (interval<BLE_GAP_ADV_INTERVAL_MIN) {
+        interval = BLE_GAP_ADV_INTERVAL_MIN;
+    } else if (interval>BLE_GAP_ADV_INTERVAL_MAX) {
+        interval = BLE_GAP_ADV_INTERVAL_MAX;
+    }
+    return interval;
 }
  
 
 
-static bool advertising_check_start()
+/**@brief Start the advertising for the current slot if it isn't running (after a connection change, or at boot), or if rotate is set
+ * (slot timer) move to the slot the scheduler picks next. Returns true if advertising.
+ */
+static bool advertising_check_start(bool rotate)
 {
     uint32_t err_code;
-    // Can't start if currently got an active BLE connection (not enough channels)
-    if (_ctx.m_conn_handle!=BLE_CONN_HANDLE_INVALID) {
+    // Can't start if all the peripheral links are in use (softdevice won't do connectable adverts)
+    if (ble_conn_state_peripheral_conn_count()>=NRF_SDH_BLE_PERIPHERAL_LINK_COUNT) {
         return false;
     }
-    // in all cases, setup to be ready otherwise the ble_advertisting_start() will fail with wrong state error
+    // Still going (eg a disconnect while advertising) : the next slot tick picks up any change
+    if (!rotate && _ctx.advRunning && advertising_slotEnabled(_ctx.advertType)) {
+        return true;
+    }
+    uint32_t t0 = app_timer_cnt_get();
+    _ctx.advRotations++;
     // security - none, open adverts/scan connect
     ble_gap_conn_sec_mode_t sec_mode;    
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
 
-    // create context
-    _ctx.txPower = cfg_getTXPOWER_Level();
-    bool ibeacons = advertising_update(&m_advertising, &_ctx.txPower);
-    // Change name
-    char* advname = cfg_getAdvName();
-    memset(_ctx.advName, 0, sizeof(_ctx.advName));
-    strncpy(_ctx.advName, advname, sizeof(_ctx.advName)-1);
-    sd_ble_gap_device_name_set(&sec_mode,
-                            (const uint8_t *)_ctx.advName,
-                                strlen(_ctx.advName));
-    sd_ble_gap_appearance_set(BLE_APPEARANCE_GENERIC_HID);
-    //    log_info("set advName to %s",_ctx.advName);
-
-    // Change tx power level
-    // NOT RUIRED? sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_ADV, m_advertising.adv_handle, cfg_getTXPOWER_Level());
-
-    // only advertise if we want to be connectable, or we are ibeaconning, and we are NOT scanning
-    if ((cfg_getConnectable() || cfg_isIBeaconning())) // && ibs_is_scan_active()==false)
+    // Change name (before the adverts that include it get encoded)
+    if (_ctx.nameGen!=cfg_getGeneration()) {
+        char* advname = cfg_getAdvName();
+        memset(_ctx.advName, 0, sizeof(_ctx.advName));
+        strncpy(_ctx.advName, advname, sizeof(_ctx.advName)-1);
+        sd_ble_gap_device_name_set(&sec_mode,
+                                (const uint8_t *)_ctx.advName,
+                                    strlen(_ctx.advName));
+        sd_ble_gap_appearance_set(BLE_APPEARANCE_GENERIC_HID);
+        //    log_info("set advName to %s",_ctx.advName);
+        _ctx.nameGen = cfg_getGeneration();
+    }
+    adv_policy_update();
+    _ctx.txPower = adv_policy_txPower();
+    advtype_t type = _ctx.advertType;
+    if (rotate || !advertising_slotEnabled(type)) {
+        type = advertising_slotNext();
+    }
+
+    // only advertise if there is a slot we can use (connectable, or we are ibeaconning), and we are NOT scanning
+    if (type!=ADVERT_TYPE_LAST) // && ibs_is_scan_active()==false)
     {
-        if (ibeacons) {
-            err_code = ble_advertising_start(&m_advertising, BLE_ADV_MODE_SLOW);
-            if (err_code!=NRF_SUCCESS) {
-                log_warn("failed to start advertising, error %d",err_code);
-                // set timer to try again in a bit
-                // TODO
-                return false;
-            }
-            led_indication(INDICATE_ADVERTISING_IBEACON);
-        } else {
-            err_code = ble_advertising_start(&m_advertising, BLE_ADV_MODE_SLOW);
-            if (err_code!=NRF_SUCCESS) {
-                log_warn("failed to start advertising, error %d",err_code);
-                // set timer to try again in a bit
-                // TODO
-                return false;
-            }
-            led_indication(INDICATE_ADVERTISING_TELEMETERY);
+        bool changed = advertising_refresh(type);
+        if (_ctx.advRunning && type==_ctx.advertType && !changed && !advertising_isStale(type) &&
+                advertising_interval(type)==_ctx.advParams.interval) {
+            // Same advert as the one on air : leave it going
+            _ctx.advTicks += app_timer_cnt_diff_compute(app_timer_cnt_get(), t0);
+            return true;
+        }
+        // create context
+        bool ibeacons = advertising_update(type, &_ctx.txPower);
+        err_code = advertising_set(&_ctx.advCache[type].data, advertising_interval(type), (type==ADVERT_TYPE_SUMMARY));
+        if (err_code!=NRF_SUCCESS) {
+            log_warn("failed to start advertising, error %d",err_code);
+            // the next slot tick tries again
+            return false;
         }
-        //log_info("adv check : connectable [%s] beaconning : %s", cfg_getAdvName(), ibeacons?"yes":"no");
+        led_indication(ibeacons ? INDICATE_ADVERTISING_IBEACON : INDICATE_ADVERTISING_TELEMETERY);
+        //log_info("adv check : connectable [%s] slot : %d", cfg_getAdvName(), type);
+        _ctx.advTicks += app_timer_cnt_diff_compute(app_timer_cnt_get(), t0);
         return true;
     } else {
         //idle the adverts
-        err_code = ble_advertising_start(&m_advertising, BLE_ADV_MODE_IDLE);
-        APP_ERROR_CHECK(err_code);
+        if (_ctx.advRunning) {
+            advertising_stop();
+            log_info("adv check: stopped beaconning");
+        }
         led_indication(INDICATE_IDLE);
-        //sd_ble_gap_adv_stop(m_advertising.adv_handle);
-        log_info("adv check: stopped beaconning");
         return false;
     }
 }
@@ -1031,6 +1686,52 @@ void ibb_stop() {
     // TODO (the current phase will timeout in a while anyway and then we'll re-check it)
 }
 
+/** Set the connections to the throughput profile (2M PHY, 7.5-15ms interval) for passthru, or back to the normal one.
+ * Data length (251) and MTU (247) are negotiated at connection by the gatt module, and connection event extension is on.
+ * comm_ble applies it to each link, and moves idle links to the low power profile (and back when traffic resumes)
+ */
+void app_setConnProfile(bool throughput) {
+    comm_ble_setThroughput(throughput);
+}
+/** Ask for a link's connection parameters to change to the given profile. Returns false if it can't be done now
+ * (eg an update is in progress) : caller should try again later
+ */
+bool app_setLinkProfile(uint16_t conn_handle, APP_CONN_PROFILE_t profile) {
+    ble_gap_conn_params_t cp = {
+        .min_conn_interval = MIN_CONN_INTERVAL,
+        .max_conn_interval = MAX_CONN_INTERVAL,
+        .slave_latency     = SLAVE_LATENCY,
+        .conn_sup_timeout  = CONN_SUP_TIMEOUT,
+    };
+    if (profile==APP_CONN_PROFILE_FAST) {
+        cp.min_conn_interval = FAST_MIN_CONN_INTERVAL;
+        cp.max_conn_interval = FAST_MAX_CONN_INTERVAL;
+    } else if (profile==APP_CONN_PROFILE_IDLE) {
+        cp.min_conn_interval = IDLE_MIN_CONN_INTERVAL;
+        cp.max_conn_interval = IDLE_MAX_CONN_INTERVAL;
+        cp.slave_latency = IDLE_SLAVE_LATENCY;
+    }
+    // Tell conn params module so it negotiates towards these rather than the ppcp ones. Can fail if an update
+    // is in progress, in which case we stay as we are (not fatal)
+    uint32_t err_code = ble_conn_params_change_conn_params(conn_handle, &cp);
+    if (err_code!=NRF_SUCCESS) {
+        log_warn("conn params change failed %d", err_code);
+        return false;
+    }
+    if (profile==APP_CONN_PROFILE_FAST) {
+        ble_gap_phys_t const phys = {
+            .rx_phys = BLE_GAP_PHY_2MBPS,
+            .tx_phys = BLE_GAP_PHY_2MBPS,
+        };
+        // Peer may refuse, we get the result in BLE_GAP_EVT_PHY_UPDATE
+        err_code = sd_ble_gap_phy_update(conn_handle, &phys);
+        if (err_code!=NRF_SUCCESS) {
+            log_warn("phy update failed %d", err_code);
+        }
+    }
+    return true;
+}
+
 /** request a reset asap */
 void app_reset_request() {
     _ctx.resetRequested = true;    
@@ -1045,10 +1746,129 @@ void app_setFlashIdle() {
 bool app_isFlashBusy() {
     return _ctx.flashBusy;      // they would like to know if its busy right now
 }
+// Radio notification (SWI1 interrupt) : the inactive signal also wakes the main loop, so waiting work gets to run at the start of the gap.
+// Only the inactive signal is configured, so every call is one : ignore radio_active, which the SDK just toggles on each call.
+// Nothing to do unless someone is waiting for a window.
+static void radio_notification_evt_handler(bool radio_active) {
+    if (!_ctx.radioNotify) {
+        return;
+    }
+    _ctx.radioIdleTick = app_timer_cnt_get();
+    _ctx.radioSeen = true;
+    _ctx.radioEvents++;
+}
+// Track the inactive signal while something waits for app_isRadioWindow() (eg the async flash write), stop when it is done
+void app_setRadioNotify(bool on) {
+    if (on==_ctx.radioNotify) {
+        return;
+    }
+    if (on) {
+        _ctx.radioSeen = false;
+        _ctx.radioNotifyTick = app_timer_cnt_get();
+    }
+    _ctx.radioNotify = on;
+}
+/** Is now a good time to start something that competes with the radio (eg a flash erase)? True just after the radio goes
+ * inactive (the softdevice then has the whole gap to fit it in), when there has been no radio event for a while, or if the
+ * caller has already waited RADIO_WAIT_MAX_MS. Callers waiting for a window should let the main loop sleep : the next
+ * radio notification wakes it.
+ */
+bool app_isRadioWindow() {
+    uint32_t now = app_timer_cnt_get();
+    // Until the first inactive signal we don't know where the gaps are : only a quiet period since tracking started will do
+    bool seen = _ctx.radioSeen;
+    uint32_t idle = app_timer_cnt_diff_compute(now, (seen ? _ctx.radioIdleTick : _ctx.radioNotifyTick));
+    if ((seen && idle<APP_TIMER_TICKS(RADIO_WINDOW_MS)) || idle>=APP_TIMER_TICKS(RADIO_QUIET_MS)) {
+        _ctx.radioWaiting = false;
+        return true;
+    }
+    if (!_ctx.radioWaiting) {
+        _ctx.radioWaiting = true;
+        _ctx.radioWaitTick = now;
+    } else if (app_timer_cnt_diff_compute(now, _ctx.radioWaitTick)>=APP_TIMER_TICKS(RADIO_WAIT_MAX_MS)) {
+        _ctx.radioWaiting = false;
+        _ctx.radioForced++;
+        return true;
+    }
+    _ctx.radioDeferred++;
+    return false;
+}
+void app_print_adv_stats(PRINTF_FN_T printf, void* odev) {
+    uint32_t us = 0;
+    if (_ctx.advRotations>0) {
+        us = (uint32_t)(((uint64_t)_ctx.advTicks*1000000)/APP_TIMER_TICKS_PER_SEC/_ctx.advRotations);
+    }
+    (*printf)(odev, "A:%d,%d,%dus,%d,%d", _ctx.advRotations, _ctx.advEncodes, us, _ctx.advRestarts, _ctx.advSwaps);
+    (*printf)(odev, "AS:%d,%d,%d,%d,%d,%d,%d", _ctx.advPicks[ADVERT_TYPE_IBEACON], _ctx.advPicks[ADVERT_TYPE_TELEMETRY],
+                _ctx.advPicks[ADVERT_TYPE_CONNECT], _ctx.advPicks[ADVERT_TYPE_EDDY_UID], _ctx.advPicks[ADVERT_TYPE_EDDY_TLM],
+                _ctx.advPicks[ADVERT_TYPE_SUMMARY], _ctx.advPicks[ADVERT_TYPE_RELAY]);
+    // beacons in the relay list, relay adverts made
+    (*printf)(odev, "AR:%d,%d", _ctx.relayCount, _ctx.relaySent);
+    // telemetry record patches (values changed while its advert was cached), resets
+    (*printf)(odev, "AT:%d,%d", _ctx.telemPatches, cfg_getResetCount());
+    // radio inactive signals, waits for a window, waits given up
+    (*printf)(odev, "RN:%d,%d,%d", _ctx.radioEvents, _ctx.radioDeferred, _ctx.radioForced);
+}
+static void reset_timer_cb(void * p_context) {
+    NVIC_SystemReset();
+}
+// Slot tick : move the advertising on to the next slot
+static void adv_slot_timer_cb(void * p_context) {
+    uint32_t now = app_timer_cnt_get();
+    uint32_t elapsed = app_timer_cnt_diff_compute(now, _ctx.advLastTick);
+    _ctx.advLastTick = now;
+    _ctx.upTicks += elapsed;
+    if (_ctx.advRunning && _ctx.advParams.interval>0) {
+        // interval is in 0.625ms units
+        _ctx.advPdus += (uint32_t)(((uint64_t)elapsed*1000000/APP_TIMER_TICKS_PER_SEC) / ((uint64_t)_ctx.advParams.interval*625));
+    }
+    relay_refresh();
+    advertising_check_start(true);
+    app_timer_start(m_adv_slot_timer_id, APP_TIMER_TICKS(cfg_getAdvSlotMs()), NULL);
+}
+// Measure the battery (the only place the ADC is used) and update the BAS with it
+static void battery_measure(void) {
+    uint16_t mv = hal_bsp_adc_read_vdd_mv();
+    if (mv==0) {
+        return;         // adc failed, keep the last value
+    }
+    _ctx.battMv = mv;
+    _ctx.battReads++;
+    if (mv>=APP_BATT_MV_FULL) {
+        _ctx.battPercent = 100;
+    } else if (mv<=APP_BATT_MV_EMPTY) {
+        _ctx.battPercent = 0;
+    } else {
+        _ctx.battPercent = (uint8_t)(((uint32_t)(mv-APP_BATT_MV_EMPTY)*100)/(APP_BATT_MV_FULL-APP_BATT_MV_EMPTY));
+    }
+    ble_bas_battery_level_update(&m_bas, _ctx.battPercent, BLE_CONN_HANDLE_ALL);
+}
 static void battery_update_timer_cb(void * p_context) {
-    // TODO read battery level
-    uint8_t battery_level = 99;
-    ble_bas_battery_level_update(&m_bas, battery_level, BLE_CONN_HANDLE_ALL);
+    battery_measure();
+    app_timer_start(m_battery_timer_id, APP_TIMER_TICKS((uint32_t)cfg_getBattPeriodS()*1000), NULL);
+}
+uint16_t app_getBatteryMv() {
+    return _ctx.battMv;
+}
+uint8_t app_getBatteryPercent() {
+    return _ctx.battPercent;
+}
+// ADV:<slot>,<interval ms>,<tx power dBm>,<policy rules : B(oost), L(ow battery), C(ritical battery), I(dle)>
+// for the advert on air, or ADV:- if none
+void app_print_adv_policy(PRINTF_FN_T printf, void* odev) {
+    if (!_ctx.advRunning) {
+        (*printf)(odev, "ADV:-");
+        return;
+    }
+    (*printf)(odev, "ADV:%d,%d,%d,%s%s%s%s", _ctx.advertType, (_ctx.advParams.interval*5)/8, _ctx.advTxPower,
+                ((_ctx.polFlags & ADV_POL_BOOST) ? "B" : ""), ((_ctx.polFlags & ADV_POL_BATT_LOW) ? "L" : ""),
+                ((_ctx.polFlags & ADV_POL_BATT_CRIT) ? "C" : ""), ((_ctx.polFlags & ADV_POL_IDLE) ? "I" : ""));
+}
+void app_print_batt_stats(PRINTF_FN_T printf, void* odev) {
+    (*printf)(odev, "B:%d,%d,%d", _ctx.battMv, _ctx.battPercent, _ctx.battReads);
+}
+void app_print_ram_stats(PRINTF_FN_T printf, void* odev) {
+    (*printf)(odev, "RAM:%x,%x", _ctx.ramStartLink, _ctx.ramStartNeeded);
 }
 
 static void button1_event(uint8_t pin_no, uint8_t button_action) {
@@ -1056,6 +1876,7 @@ static void button1_event(uint8_t pin_no, uint8_t button_action) {
         // send event to main board
         // TODO
         bsp_board_led_invert(1);
+        adv_policy_boost();
     }
 }
 
@@ -1064,6 +1885,7 @@ static void button2_event(uint8_t pin_no, uint8_t button_action) {
         // send event to main board
         // TODO
         bsp_board_led_invert(1);
+        adv_policy_boost();
     }
 
 }
@@ -1193,6 +2015,7 @@ int main(void)
     init_stage(INDICATE_STARTUP_3);
 
     cfg_init();              
+    cfg_countReset();
     log_info("config/log init done");
 
     init_stage(INDICATE_STARTUP_4);
@@ -1204,14 +2027,18 @@ int main(void)
 
     // Tell host we are ready to rock
     comm_uart_tx((uint8_t *)"+READY\r\n",8, NULL);
+    // First battery reading before the adverts that carry it
+    battery_measure();
     // Init adv parameters and start if required
-    advertising_check_start();
+    advertising_check_start(false);
+    _ctx.advLastTick = app_timer_cnt_get();
+    app_timer_start(m_adv_slot_timer_id, APP_TIMER_TICKS(cfg_getAdvSlotMs()), NULL);
     log_info("advertising setup done");
 
     init_stage(INDICATE_STARTUP_6);
 
     // Start timer for battery rad updates
-    app_timer_start(m_battery_timer_id, APP_BATTERY_TIME_PERIOD,NULL);
+    app_timer_start(m_battery_timer_id, APP_TIMER_TICKS((uint32_t)cfg_getBattPeriodS()*1000), NULL);
 
     //todo remove uart disabled at 10s of ibeaconning for power
     /*                    
@@ -1227,14 +2054,24 @@ int main(void)
 
     for (;;)
     {        
-        if (_ctx.resetRequested)
+        // Reset once config is safely in flash, after a short delay for the last responses to go out
+        if (_ctx.resetRequested && !cfg_isWritePending())
         {
-            NVIC_SystemReset();
+            _ctx.resetRequested = false;
+            app_timer_start(m_reset_timer_id, APP_RESET_DELAY, NULL);
         }
-        // Check if flash needs updating
+        // Check if flash needs updating, and move on any write in progress
         cfg_writeCheck();
+        hal_bsp_nvmProcess();
         // Check if UART has data to process
         comm_uart_processRX();
+        // And data received over BLE
+        comm_ble_processRX();
+        comm_l2cap_processRX();
+        // Send any queued AT response output
+        at_process_pump();
+        // Move on any AT+BENCH run
+        bench_process();
         // Go in lowpower only if flash isn't busy
         if(!app_isFlashBusy())
         {
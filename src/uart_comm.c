@@ -25,7 +25,7 @@
 #define COMM_UART_BAUDRATE  (UARTE_BAUDRATE_BAUDRATE_Baud115200)
 #warning easydma uart
 #endif
-#define MAX_RX_LINE (100)            // AT+IB_START E2C56DB5DFFB48D2B060D0F5A71096E0,8201,135C,00,0200,-10   is longest command and is 67
+#define MAX_RX_LINE (250)            // AT+IB_START E2C56DB5DFFB48D2B060D0F5A71096E0,8201,135C,00,0200,-10   is longest command and is 67, but several can be sent on 1 line separated by ';'
 
 static struct {
     int uartNb;
@@ -69,6 +69,9 @@ int comm_uart_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
         _ctx.tx_ready_fn = tx_ready;        // in case of..
         // check if disconnecting 
         if (data!=NULL)  {
+            if (len==0) {
+                return 0;       // flush hint, we send straight away anyway
+            }
             _ctx.txL++;
             return (hal_bsp_uart_tx(_ctx.uartNb, data, len));
         } else {
@@ -84,9 +87,29 @@ int comm_uart_tx(uint8_t* data, int len, UART_TX_READY_FN_T tx_ready) {
 
 // Call this from main loop to check if uart has input data to process
 void comm_uart_processRX() {
+    if (_ctx.isOpen && at_process_isRaw(&comm_uart_tx)) {
+        // Raw mode : pass the bytes on in blocks as big as we've got (up to the line buffer size) rather than as lines.
+        // Anything the other side can't take is kept in the buffer for next time, and the rest stays in the uart fifo
+        while(_ctx.rx_index<MAX_RX_LINE && app_uart_get(&_ctx.rx_buf[_ctx.rx_index])==NRF_SUCCESS) {
+            _ctx.rx_index++;
+            _ctx.rxC++;
+        }
+        if (_ctx.rx_index>0) {
+            int left = at_process_rawInput(&_ctx.rx_buf[0], _ctx.rx_index, &comm_uart_tx);
+            if (left>0) {
+                memmove(&_ctx.rx_buf[0], &_ctx.rx_buf[_ctx.rx_index-left], left);
+                _ctx.rx_index = left;
+            } else {
+                _ctx.rx_index = 0;
+            }
+        }
+        _ctx.rxDataReady = false;
+        return;
+    }
     if (_ctx.isOpen) {
-        // Read all the bytes we can and pass any complete lines to the at command processor
-        while(app_uart_get(&_ctx.rx_buf[_ctx.rx_index])==NRF_SUCCESS) 
+        // Read all the bytes we can and pass any complete lines to the at command processor (while it has room for the responses,
+        // the rest waits in the uart fifo)
+        while(at_process_outReady() && app_uart_get(&_ctx.rx_buf[_ctx.rx_index])==NRF_SUCCESS) 
         {
             // Don't take nulls
             if (_ctx.rx_buf[_ctx.rx_index]!=0) {
@@ -105,6 +128,10 @@ void comm_uart_processRX() {
                     }
                     // reset our line buffer to start
                     _ctx.rx_index = 0;
+                    // that line may have put us in raw mode (AT+RAW) : the rest is raw data
+                    if (at_process_isRaw(&comm_uart_tx)) {
+                        break;
+                    }
                     // Continue for rest of data in input
                 } else {
                     _ctx.rx_index++;
@@ -112,9 +139,16 @@ void comm_uart_processRX() {
             }
         }
         _ctx.rxDataReady = false;       // as we ate all the data
+        if (at_process_isRaw(&comm_uart_tx)) {
+            comm_uart_processRX();      // pass on what followed the AT+RAW line now, rather than when more comes in
+        }
     }
 }
 
+// rx errors (framing/overrun, and lines too long) for the telemetry advert
+uint32_t comm_uart_nbErrors(void) {
+    return (_ctx.rxFerr+_ctx.rxLerr);
+}
 void comm_uart_print_stats(PRINTF_FN_T printf, void* odev) {
     (*printf)(odev, "U:%d,%d,-,%d,%d,%d", _ctx.rxC, _ctx.rxL, _ctx.txL, _ctx.rxFerr, _ctx.rxLerr);
 }
@@ -315,3 +315,39 @@ int Util_scanhex(char* in, int len, uint8_t* out) {
     }
     return len;     // got them all
 }
+/** parse a hex value of 1 to maxdigits digits (no 0x prefix) into out. Whole string must be hex digits. Returns true if ok */
+bool Util_parsehex(const char* in, int maxdigits, uint32_t* out) {
+    uint32_t v = 0;
+    int i=0;
+    for(;in[i]!='\0';i++) {
+        if (i>=maxdigits || !isxdigit((int)in[i])) {
+            return false;
+        }
+        v = (v<<4) | Util_hexdigit(in[i]);
+    }
+    if (i==0) {
+        return false;       // empty
+    }
+    *out = v;
+    return true;
+}
+/** parse a signed decimal value into out. Whole string must be consumed. Returns true if ok */
+bool Util_parsedec(const char* in, int32_t* out) {
+    bool neg = false;
+    int32_t v = 0;
+    if (*in=='-' || *in=='+') {
+        neg = (*in=='-');
+        in++;
+    }
+    if (*in=='\0') {
+        return false;       // no digits
+    }
+    for(;*in!='\0';in++) {
+        if (*in<'0' || *in>'9' || v>(INT32_MAX/10) || (v==(INT32_MAX/10) && (*in-'0')>(INT32_MAX%10))) {
+            return false;       // not a digit, or would overflow
+        }
+        v = (v*10) + (*in-'0');
+    }
+    *out = (neg ? -v : v);
+    return true;
+}